@@ -31,6 +31,9 @@
 /* Define to 1 if you have the <windows.h> header file. */
 #cmakedefine HAVE_WINDOWS_H @HAVE_WINDOWS_H@
 
+/* Define to 1 if FFTW is available */
+#cmakedefine FFTW_SUPPORT @FFTW_SUPPORT@
+
 /* Define if using the MinGW32 environment */
 #cmakedefine MINGW32 @MINGW32@
 
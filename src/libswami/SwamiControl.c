@@ -93,11 +93,8 @@ static inline void swami_control_set_event_real(SwamiControl *control,
         SwamiControlEvent *event);
 static inline gboolean swami_control_loop_check(SwamiControl *control,
         SwamiControlEvent *event);
-
-/* a master list of all controls, used for doing periodic inactive event
-   expiration cleanup */
-G_LOCK_DEFINE_STATIC(control_list);
-static GList *control_list = NULL;
+static inline void swami_control_active_add(SwamiControl *control,
+        SwamiControlEvent *origin);
 
 static GObjectClass *parent_class = NULL;
 static guint control_signals[SIGNAL_COUNT] = { 0 };
@@ -203,17 +200,15 @@ static void
 swami_control_init(SwamiControl *control)
 {
     control->flags = SWAMI_CONTROL_SENDS;
-
-    /* prepend control to master list */
-    G_LOCK(control_list);
-    control_list = g_list_prepend(control_list, control);
-    G_UNLOCK(control_list);
 }
 
 static void
 swami_control_finalize(GObject *object)
 {
     SwamiControl *control = SWAMI_CONTROL(object);
+    SwamiControlEvent *origin;
+    GSList *p;
+    int i;
 
     /* free control queue (if any exist) */
     if (control->queue)
@@ -221,9 +216,23 @@ swami_control_finalize(GObject *object)
         g_object_unref (control->queue); /* -- unref old queue */
     }
 
-    G_LOCK(control_list);
-    control_list = g_list_remove(control_list, object);
-    G_UNLOCK(control_list);
+    /* -- unref recent event origins */
+    for(i = 0; i < SWAMI_CONTROL_ACTIVE_RING_SIZE; i++)
+    {
+        origin = control->active[i];
+
+        if(origin)
+        {
+            swami_control_event_unref(origin);
+        }
+    }
+
+    for(p = control->active_overflow; p; p = p->next)
+    {
+        swami_control_event_unref((SwamiControlEvent *)(p->data));
+    }
+
+    g_slist_free(control->active_overflow);
 }
 
 /**
@@ -864,7 +873,7 @@ swami_control_set_transform(SwamiControl *src, SwamiControl *dest,
     g_return_if_fail(SWAMI_IS_CONTROL(src));
     g_return_if_fail(SWAMI_IS_CONTROL(dest));
 
-    SWAMI_LOCK_READ(src);
+    SWAMI_LOCK_WRITE(src);
 
     /* look for matching connection */
     for(p = src->outputs; p; p = p->next)
@@ -884,7 +893,7 @@ swami_control_set_transform(SwamiControl *src, SwamiControl *dest,
         }
     }
 
-    SWAMI_UNLOCK_READ(src);
+    SWAMI_UNLOCK_WRITE(src);
 
     /* if there already was a transform with destroy function, call it on the user data */
     if(oldnotify && olddata)
@@ -1046,7 +1055,7 @@ swami_control_get_queue(SwamiControl *control)
         queue = g_object_ref(control->queue);    /* ++ ref queue */
     }
 
-    SWAMI_UNLOCK_WRITE(control);
+    SWAMI_UNLOCK_READ(control);
 
     return (queue);		/* !! caller takes over reference */
 }
@@ -1402,11 +1411,10 @@ swami_control_set_value(SwamiControl *control, const GValue *value)
     event = swami_control_new_event(control, NULL, value);  /* ++ ref new */
 
     swami_control_event_active_ref(event);  /* ++ active ref the event */
-    swami_control_event_ref(event);  /* ++ ref event for control active list */
 
-    /* prepend the event to the active list */
+    /* add the event to the recent origins */
     SWAMI_LOCK_WRITE(control);
-    control->active = g_list_prepend(control->active, event);
+    swami_control_active_add(control, event);
     SWAMI_UNLOCK_WRITE(control);
 
     queue = swami_control_get_queue(control);  /* ++ ref queue */
@@ -1461,11 +1469,10 @@ swami_control_set_value_no_queue(SwamiControl *control, const GValue *value)
     event = swami_control_new_event(control, NULL, value);  /* ++ ref new */
 
     swami_control_event_active_ref(event);  /* ++ active ref the event */
-    swami_control_event_ref(event);  /* ++ ref event for control active list */
 
-    /* prepend the event to the active list */
+    /* add the event to the recent origins */
     SWAMI_LOCK_WRITE(control);
-    control->active = g_list_prepend(control->active, event);
+    swami_control_active_add(control, event);
     SWAMI_UNLOCK_WRITE(control);
 
     swami_control_set_event_real(control, event);
@@ -1508,13 +1515,11 @@ swami_control_set_event(SwamiControl *control, SwamiControlEvent *event)
         return;
     }
 
-    /* prepend the event origin to the active list */
-    control->active = g_list_prepend(control->active, origin);
+    /* add the event origin to the recent origins */
+    swami_control_active_add(control, origin);
 
     SWAMI_UNLOCK_WRITE(control);
 
-    swami_control_event_ref(origin);  /* ++ ref event for control active list */
-
     queue = swami_control_get_queue(control);  /* ++ ref queue */
 
     if(queue)	    /* if queue, then add event to the queue */
@@ -1571,13 +1576,11 @@ swami_control_set_event_no_queue(SwamiControl *control,
         return;
     }
 
-    /* prepend the event origin to the active list */
-    control->active = g_list_prepend(control->active, origin);
+    /* add the event origin to the recent origins */
+    swami_control_active_add(control, origin);
 
     SWAMI_UNLOCK_WRITE(control);
 
-    swami_control_event_ref(origin);  /* ++ ref event for control active list */
-
     swami_control_set_event_real(control, event);
 
     swami_control_event_active_unref(event);  /* -- decrement active ref */
@@ -1686,14 +1689,18 @@ swami_control_set_event_real(SwamiControl *control, SwamiControlEvent *event)
     }
 }
 
-/* Check if an event is already visited a control. Also purges old active
-   events. Control must be locked by caller.
+/* Check if an event is already visited a control, by looking for its origin
+   in the control's ring of recent origins and in the overflow list of in
+   flight origins (inactive overflow origins are purged).  Origins are only
+   replaced in the ring once they are no longer active, so an in flight
+   origin is always found.  Control must be locked by caller.
    Returns: TRUE if not looped, FALSE otherwise */
 static inline gboolean
 swami_control_loop_check(SwamiControl *control, SwamiControlEvent *event)
 {
-    SwamiControlEvent *ev, *origin;
-    GList *p, *temp;
+    SwamiControlEvent *origin, *ev;
+    GSList *p, *temp;
+    int i;
 
     /* if control only sends or only receives, don't do loop check.
      * FIXME - Is that right? */
@@ -1704,46 +1711,120 @@ swami_control_loop_check(SwamiControl *control, SwamiControlEvent *event)
 
     origin = event->origin ? event->origin : event;
 
-    /* look through active events to stop loops and to cleanup old entries */
-    p = control->active;
+    for(i = 0; i < SWAMI_CONTROL_ACTIVE_RING_SIZE; i++)
+    {
+        if(control->active[i] == origin)	/* event loop catch */
+        {
+            break;
+        }
+    }
 
-    while(p)
+    if(i == SWAMI_CONTROL_ACTIVE_RING_SIZE)
     {
-        ev = (SwamiControlEvent *)(p->data);
+        p = control->active_overflow;
 
-        if(ev == origin)		/* event loop catch */
+        while(p)
         {
+            ev = (SwamiControlEvent *)(p->data);
 
-#if DEBUG
+            if(ev == origin)		/* event loop catch */
+            {
+                break;
+            }
 
-            if(swami_control_debug)
+            if(!ev->active)		/* event still active? */
             {
-                char *s1 = pretty_control(control);
-                g_message("Loop killer: %s EV:%p ORIGIN:%p", s1, event, origin);
-                g_free(s1);
+                /* no, remove from list */
+                temp = p;
+                p = g_slist_next(p);
+                control->active_overflow
+                    = g_slist_delete_link(control->active_overflow, temp);
+                swami_control_event_unref(ev);  /* -- unref inactive event */
+            }
+            else
+            {
+                p = g_slist_next(p);
             }
+        }
+
+        if(!p)
+        {
+            return (TRUE);    /* not looped */
+        }
+    }
+
+#if DEBUG
+
+    if(swami_control_debug)
+    {
+        char *s1 = pretty_control(control);
+        g_message("Loop killer: %s EV:%p ORIGIN:%p", s1, event, origin);
+        g_free(s1);
+    }
 
-            SWAMI_CONTROL_TEST_BREAK(control, NULL);
+    SWAMI_CONTROL_TEST_BREAK(control, NULL);
 #endif
 
-            return (FALSE);	/* return immediately, looped */
-        }
+    return (FALSE);	/* looped */
+}
+
+/* Add an event origin to the recent origins of a control.  Replaces the
+   oldest ring entry which is no longer active, if all ring entries are still
+   in flight the origin is added to the overflow list instead.  Control must
+   be locked by caller. */
+static inline void
+swami_control_active_add(SwamiControl *control, SwamiControlEvent *origin)
+{
+    SwamiControlEvent *old;
+    GSList *p, *temp;
+    guint pos;
+    int i;
+
+    /* origins are only checked by controls which send and receive */
+    if((control->flags & SWAMI_CONTROL_SENDRECV) != SWAMI_CONTROL_SENDRECV)
+    {
+        return;
+    }
+
+    for(i = 0; i < SWAMI_CONTROL_ACTIVE_RING_SIZE; i++)
+    {
+        pos = (control->active_pos + i) % SWAMI_CONTROL_ACTIVE_RING_SIZE;
+        old = control->active[pos];
 
-        if(!ev->active)		/* event still active? */
+        if(!old || !old->active)
         {
-            /* no, remove from list */
-            temp = p;
-            p = g_list_next(p);
-            control->active = g_list_delete_link(control->active, temp);
-            swami_control_event_unref(ev);  /* -- unref inactive event */
+            control->active[pos] = swami_control_event_ref(origin);  /* ++ ref */
+            control->active_pos = (pos + 1) % SWAMI_CONTROL_ACTIVE_RING_SIZE;
+
+            if(old)
+            {
+                swami_control_event_unref(old);    /* -- unref old origin */
+            }
+
+            return;
         }
-        else
+    }
+
+    /* purge inactive overflow origins */
+    p = control->active_overflow;
+
+    while(p)
+    {
+        old = (SwamiControlEvent *)(p->data);
+        temp = p;
+        p = g_slist_next(p);
+
+        if(!old->active)
         {
-            p = g_list_next(p);
+            control->active_overflow
+                = g_slist_delete_link(control->active_overflow, temp);
+            swami_control_event_unref(old);  /* -- unref inactive origin */
         }
     }
 
-    return (TRUE);
+    /* ++ ref origin for overflow list */
+    control->active_overflow = g_slist_prepend(control->active_overflow,
+                               swami_control_event_ref(origin));
 }
 
 /**
@@ -1774,12 +1855,11 @@ swami_control_transmit_value(SwamiControl *control, const GValue *value)
     event = swami_control_new_event(control, NULL, value);  /* ++ ref new */
 
     swami_control_event_active_ref(event);  /* ++ active ref event */
-    swami_control_event_ref(event);  /* ++ ref event for control active list */
 
     SWAMI_LOCK_WRITE(control);
 
-    /* prepend the event origin to the active list */
-    control->active = g_list_prepend(control->active, event);
+    /* add the event to the recent origins */
+    swami_control_active_add(control, event);
 
     /* copy destination controls to an array under lock, which is then used
        outside of lock to avoid recursive dead locks */
@@ -1867,8 +1947,6 @@ swami_control_transmit_event(SwamiControl *control, SwamiControlEvent *event)
 
         origin = event->origin ? event->origin : event;
 
-        swami_control_event_ref(origin);  /* ++ ref event for active list */
-
         SWAMI_LOCK_WRITE(control);
 
         /* check for event looping (only if control can send) */
@@ -1879,7 +1957,7 @@ swami_control_transmit_event(SwamiControl *control, SwamiControlEvent *event)
             return;
         }
 
-        control->active = g_list_prepend(control->active, origin);
+        swami_control_active_add(control, origin);
 
         /* copy destination controls to an array under lock, which is then used
            outside of lock to avoid recursive dead locks */
@@ -1972,12 +2050,11 @@ swami_control_transmit_event_loop(SwamiControl *control,
 
         SWAMI_LOCK_WRITE(control);
 
-        /* check for event in active list (only if control can send) */
+        /* check for event in recent origins (only if control can send) */
         if(swami_control_loop_check(control, event))
         {
-            /* not already in list, prepend the event origin to the active list */
-            control->active = g_list_prepend(control->active, origin);
-            swami_control_event_ref(origin);  /* ++ ref event for active list */
+            /* not already in recent origins, add it */
+            swami_control_active_add(control, origin);
         }
 
         /* copy destination controls to an array under lock, which is then used
@@ -2040,50 +2117,14 @@ swami_control_transmit_event_loop(SwamiControl *control,
 /**
  * swami_control_do_event_expiration:
  *
- * Processes all controls in search of inactive expired events.  This should
- * be called periodically to expire events in controls that don't receive any
- * events for a long period after previous activity.  Note that currently this
- * is handled automatically if swami_init() is called.
+ * Does nothing.  Controls used to keep lists of active events which had to
+ * be expired periodically, event loops are now detected with a ring of recent
+ * event origins in each control, whose entries are replaced by newer origins
+ * once inactive.  Kept for API compatibility.
  */
 void
 swami_control_do_event_expiration(void)
 {
-    GList *cp, *ep, *temp;
-    SwamiControlEvent *ev;
-    SwamiControl *control;
-
-    G_LOCK(control_list);
-
-    for(cp = control_list; cp; cp = cp->next)  /* loop over controls */
-    {
-        control = (SwamiControl *)(cp->data);
-
-        SWAMI_LOCK_WRITE(control);
-
-        ep = control->active;
-
-        while(ep)		/* loop over active event list */
-        {
-            ev = (SwamiControlEvent *)(ep->data);
-
-            if(!ev->active)		/* event still active? */
-            {
-                /* no, remove from list */
-                temp = ep;
-                ep = g_list_next(ep);
-                control->active = g_list_delete_link(control->active, temp);
-                swami_control_event_unref(ev);  /* -- unref inactive event */
-            }
-            else
-            {
-                ep = g_list_next(ep);
-            }
-        }
-
-        SWAMI_UNLOCK_WRITE(control);
-    }
-
-    G_UNLOCK(control_list);
 }
 
 /**
@@ -2119,8 +2160,7 @@ swami_control_new_event(SwamiControl *control, SwamiControlEvent *origin,
 
     if(value)			/* if value supplied, use it */
     {
-        g_value_init(&event->value, G_VALUE_TYPE(value));
-        g_value_copy(value, &event->value);
+        swami_control_event_set_value(event, value);
     }
     else			    /* create a value change event */
     {
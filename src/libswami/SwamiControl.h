@@ -48,13 +48,19 @@ typedef struct _SwamiControlClass SwamiControlClass;
   (G_TYPE_INSTANCE_GET_CLASS (obj, SWAMI_TYPE_CONTROL, SwamiControlClass))
 
 
+/* size of the ring of recent event origins of a control */
+#define SWAMI_CONTROL_ACTIVE_RING_SIZE  32
+
 /* Swami control object */
 struct _SwamiControl
 {
     SwamiLock parent_instance;	/* derived from SwamiLock */
 
     guint flags;			/* flags field (SwamiControlFlags) */
-    GList *active;		/* active event propagations */
+    /* recent event origins (ref'd), in flight origins are never replaced */
+    SwamiControlEvent *active[SWAMI_CONTROL_ACTIVE_RING_SIZE];
+    guint active_pos;		/* next position to write in active */
+    GSList *active_overflow;	/* in flight origins which didn't fit (ref'd) */
     SwamiControlQueue *queue;	/* event queue or NULL if no queuing */
     SwamiControl *master;	/* control to slave parameter spec to or NULL */
     GType value_type;	  /* control value type (or 0 for wildcard) */
@@ -20,6 +20,8 @@
  * 02111-1307, USA or point your web browser to http://www.gnu.org.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <glib-object.h>
 
@@ -29,8 +31,52 @@
 #endif
 
 #include "SwamiControlEvent.h"
+#include "SwamiMidiEvent.h"
 #include "swami_priv.h"
 
+/* default max free events kept in the event pool of each thread */
+#define EVENT_POOL_MAX  256
+
+/* Event with inline storage for a MIDI event value, all events are
+ * allocated as PoolEvents */
+typedef struct
+{
+    SwamiControlEvent event;
+    SwamiMidiEvent midi;		/* MIDI event value (see event_set_value) */
+} PoolEvent;
+
+/* per thread list of free events (linked by origin field) */
+typedef struct
+{
+    SwamiControlEvent *free;	/* free event list */
+    int count;			/* count of events in free */
+} EventPool;
+
+static SwamiControlEvent *event_alloc(void);
+static void event_release(SwamiControlEvent *event);
+static void event_pool_destroy(gpointer data);
+
+/* event pool of the current thread, events are recycled without locking
+ * since they are only ever freed to the pool of the freeing thread */
+static GStaticPrivate event_pool_key = G_STATIC_PRIVATE_INIT;
+
+/* max free events per thread pool, 0 disables pooling (set at init only) */
+static int event_pool_max = EVENT_POOL_MAX;
+
+/* called by swami_init(), SWAMI_EVENT_POOL_MAX overrides the pool size,
+ * which makes it possible to measure the pool against plain g_slice */
+void
+_swami_control_event_init(void)
+{
+    const char *s;
+
+    s = g_getenv("SWAMI_EVENT_POOL_MAX");
+
+    if(s)
+    {
+        event_pool_max = MAX(atoi(s), 0);
+    }
+}
 
 GType
 swami_control_event_get_type(void)
@@ -62,7 +108,7 @@ swami_control_event_new(gboolean stamp)
 {
     SwamiControlEvent *event;
 
-    event = g_slice_new0(SwamiControlEvent);
+    event = event_alloc();
     event->refcount = 1;
 
     if(stamp)
@@ -100,8 +146,121 @@ swami_control_event_free(SwamiControlEvent *event)
         swami_control_event_unref(event->origin);
     }
 
-    g_value_unset(&event->value);
-    g_slice_free(SwamiControlEvent, event);
+    if(G_IS_VALUE(&event->value))
+    {
+        g_value_unset(&event->value);
+    }
+
+    event_release(event);
+}
+
+/* allocate a cleared event from the pool of the current thread */
+static SwamiControlEvent *
+event_alloc(void)
+{
+    EventPool *pool;
+    SwamiControlEvent *event;
+
+    pool = g_static_private_get(&event_pool_key);
+
+    if(!pool || !pool->free)
+    {
+        event = (SwamiControlEvent *)g_slice_new0(PoolEvent);
+    }
+    else
+    {
+        event = pool->free;
+        pool->free = event->origin;
+        pool->count--;
+
+        memset(event, 0, sizeof(PoolEvent));
+    }
+
+    return (event);
+}
+
+/* return a freed event to the pool of the current thread */
+static void
+event_release(SwamiControlEvent *event)
+{
+    EventPool *pool;
+
+    pool = g_static_private_get(&event_pool_key);
+
+    if(!pool)
+    {
+        pool = g_new0(EventPool, 1);
+        g_static_private_set(&event_pool_key, pool, event_pool_destroy);
+    }
+
+    if(pool->count >= event_pool_max)
+    {
+        g_slice_free(PoolEvent, (PoolEvent *)event);
+        return;
+    }
+
+    event->origin = pool->free;
+    pool->free = event;
+    pool->count++;
+}
+
+/* free the event pool of an exiting thread */
+static void
+event_pool_destroy(gpointer data)
+{
+    EventPool *pool = data;
+    SwamiControlEvent *event;
+
+    while(pool->free)
+    {
+        event = pool->free;
+        pool->free = event->origin;
+        g_slice_free(PoolEvent, (PoolEvent *)event);
+    }
+
+    g_free(pool);
+}
+
+/**
+ * swami_control_event_set_value:
+ * @event: Event with an uninitialized value
+ * @value: Value to copy
+ *
+ * Initialize the value of an event to a copy of @value.  Like
+ * g_value_init() and g_value_copy() but without type lookups or allocation
+ * for the most common control values (integers, floats, booleans and MIDI
+ * events).
+ */
+void
+swami_control_event_set_value(SwamiControlEvent *event, const GValue *value)
+{
+    GType type;
+    SwamiMidiEvent *midi;
+
+    g_return_if_fail(event != NULL);
+    g_return_if_fail(G_IS_VALUE(value));
+
+    type = G_VALUE_TYPE(value);
+
+    /* these types have no allocated contents, the value can be copied as is */
+    if(type == G_TYPE_INT || type == G_TYPE_UINT || type == G_TYPE_BOOLEAN
+            || type == G_TYPE_FLOAT || type == G_TYPE_DOUBLE)
+    {
+        event->value = *value;
+    }
+    else if(type == SWAMI_TYPE_MIDI_EVENT
+            && (midi = g_value_get_boxed(value)))
+    {
+        /* MIDI events are stored inline, the static boxed value isn't freed */
+        ((PoolEvent *)event)->midi = *midi;
+        g_value_init(&event->value, type);
+        g_value_set_static_boxed(&event->value, &((PoolEvent *)event)->midi);
+    }
+    else
+    {
+        g_value_init(&event->value, type);
+        g_value_copy(value, &event->value);
+    }
 }
 
 /**
@@ -120,7 +279,7 @@ swami_control_event_duplicate(const SwamiControlEvent *event)
 
     g_return_val_if_fail(event != NULL, NULL);
 
-    dup = g_slice_new0(SwamiControlEvent);
+    dup = event_alloc();
     dup->refcount = 1;
     dup->tick = event->tick;
 
@@ -129,7 +288,10 @@ swami_control_event_duplicate(const SwamiControlEvent *event)
         dup->origin = swami_control_event_ref(event->origin);
     }
 
-    g_value_copy(&event->value, &dup->value);
+    if(G_IS_VALUE(&event->value))
+    {
+        swami_control_event_set_value(dup, &event->value);
+    }
 
     return (dup);
 }
@@ -155,7 +317,7 @@ swami_control_event_transform(SwamiControlEvent *event, GType valtype,
     g_return_val_if_fail(event != NULL, NULL);
     g_return_val_if_fail(trans != NULL, NULL);
 
-    dup = g_slice_new0(SwamiControlEvent);
+    dup = event_alloc();
     dup->refcount = 1;
     dup->tick = event->tick;
 
@@ -55,6 +55,8 @@ struct _SwamiControlEvent
 GType swami_control_event_get_type(void);
 SwamiControlEvent *swami_control_event_new(gboolean stamp);
 void swami_control_event_free(SwamiControlEvent *event);
+void swami_control_event_set_value(SwamiControlEvent *event,
+                                   const GValue *value);
 SwamiControlEvent *
 swami_control_event_duplicate(const SwamiControlEvent *event);
 SwamiControlEvent *swami_control_event_transform
@@ -764,8 +764,7 @@ swami_control_prop_item_cb_notify(IpatchItemPropNotify *notify)
     /* copy changed value to a new event */
     ctrlevent = swami_control_event_new(TRUE);  /* ++ ref new event */
 
-    g_value_init(&ctrlevent->value, G_VALUE_TYPE(notify->new_value));
-    g_value_copy(notify->new_value, &ctrlevent->value);
+    swami_control_event_set_value(ctrlevent, notify->new_value);
 
     /* IpatchItem property loop prevention, get current IpatchItem
        property origin event for this thread (if any) */
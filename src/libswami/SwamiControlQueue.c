@@ -26,12 +26,34 @@
 #include "SwamiControlQueue.h"
 #include "swami_priv.h"
 
-/* queue item bag */
-typedef struct
+/* count of events run between checks of the run time budget */
+#define RUN_BATCH_SIZE  16
+
+/* Queue item bag.  The queue is an intrusive multi producer, single consumer
+ * linked list: producers atomically swap themselves in as the head and then
+ * link the previous head to themselves, the consumer runs items from the
+ * tail.  A stub item keeps the list non-empty.  Items of value controls
+ * (SWAMI_CONTROL_VALUE) are also in the queue's pending hash until they are
+ * run, so that newer events can replace their event. */
+typedef struct _QueueItem QueueItem;
+
+struct _QueueItem
 {
+    QueueItem *volatile next;	/* next (newer) item or NULL */
     SwamiControl *control;
-    SwamiControlEvent *event;
-} QueueItem;
+    SwamiControlEvent *event;	/* locked by queue if value is TRUE */
+    gboolean value;		/* TRUE if item is in the pending hash */
+};
+
+static void swami_control_queue_class_init(SwamiControlQueueClass *klass);
+static void swami_control_queue_init(SwamiControlQueue *queue);
+static void swami_control_queue_finalize(GObject *object);
+static void queue_push(SwamiControlQueue *queue, QueueItem *item);
+static QueueItem *queue_pop(SwamiControlQueue *queue);
+static void queue_item_run(SwamiControlQueue *queue, QueueItem *item,
+                           gboolean dispatch);
+
+static GObjectClass *parent_class = NULL;
 
 GType
 swami_control_queue_get_type(void)
@@ -43,9 +65,9 @@ swami_control_queue_get_type(void)
         static const GTypeInfo obj_info =
         {
             sizeof(SwamiControlQueueClass), NULL, NULL,
-            (GClassInitFunc) NULL, NULL, NULL,
+            (GClassInitFunc) swami_control_queue_class_init, NULL, NULL,
             sizeof(SwamiControlQueue), 0,
-            (GInstanceInitFunc) NULL
+            (GInstanceInitFunc) swami_control_queue_init
         };
 
         obj_type = g_type_register_static(SWAMI_TYPE_LOCK, "SwamiControlQueue",
@@ -55,6 +77,45 @@ swami_control_queue_get_type(void)
     return (obj_type);
 }
 
+static void
+swami_control_queue_class_init(SwamiControlQueueClass *klass)
+{
+    GObjectClass *obj_class = G_OBJECT_CLASS(klass);
+
+    parent_class = g_type_class_peek_parent(klass);
+    obj_class->finalize = swami_control_queue_finalize;
+}
+
+static void
+swami_control_queue_init(SwamiControlQueue *queue)
+{
+    queue->stub = g_slice_new0(QueueItem);
+    queue->head = queue->stub;
+    queue->tail = queue->stub;
+    queue->pending = g_hash_table_new(NULL, NULL);
+}
+
+static void
+swami_control_queue_finalize(GObject *object)
+{
+    SwamiControlQueue *queue = SWAMI_CONTROL_QUEUE(object);
+    QueueItem *item;
+
+    /* release events which were never run */
+    while((item = queue_pop(queue)))
+    {
+        queue_item_run(queue, item, FALSE);
+    }
+
+    g_slice_free(QueueItem, queue->stub);
+    g_hash_table_destroy(queue->pending);
+
+    if(parent_class->finalize)
+    {
+        parent_class->finalize(object);
+    }
+}
+
 /**
  * swami_control_queue_new:
  *
@@ -76,73 +137,218 @@ swami_control_queue_new(void)
  * @event: Control event to queue
  *
  * Adds a control event to a queue. Does not run queue test function this is
- * the responsibility of the caller (for added performance).
+ * the responsibility of the caller (for added performance).  If @control
+ * has the #SWAMI_CONTROL_VALUE flag set and already has an event in the
+ * queue, then @event replaces it (in its place in the queue), since only
+ * the latest value of a value control is of interest.
  */
 void
 swami_control_queue_add_event(SwamiControlQueue *queue, SwamiControl *control,
                               SwamiControlEvent *event)
 {
+    SwamiControlEvent *old_event;
     QueueItem *item;
 
     g_return_if_fail(SWAMI_IS_CONTROL_QUEUE(queue));
     g_return_if_fail(SWAMI_IS_CONTROL(control));
     g_return_if_fail(event != NULL);
 
-    item = g_slice_new(QueueItem);
-    item->control = g_object_ref(control);  /* ++ ref control */
-    item->event = swami_control_event_ref(event);  /* ++ ref event */
+    swami_control_event_ref(event);  /* ++ ref event */
 
     /* ++ increment active reference, gets removed in swami_control_queue_run */
     swami_control_event_active_ref(event);
 
-    SWAMI_LOCK_WRITE(queue);
-    queue->list = g_list_prepend(queue->list, item);
+    if(control->flags & SWAMI_CONTROL_VALUE)
+    {
+        SWAMI_LOCK_WRITE(queue);
+
+        item = g_hash_table_lookup(queue->pending, control);
+
+        if(item)	/* control has a pending event? - replace it */
+        {
+            old_event = item->event;
+            item->event = event;  /* !! takes over event refs */
+            SWAMI_UNLOCK_WRITE(queue);
+
+            swami_control_event_active_unref(old_event);  /* -- unref active */
+            swami_control_event_unref(old_event);  /* -- unref event */
 
-    if(!queue->tail)
+            g_atomic_int_inc(&queue->coalesced);
+            return;
+        }
+
+        item = g_slice_new(QueueItem);
+        item->control = g_object_ref(control);  /* ++ ref control */
+        item->event = event;	/* !! takes over event refs */
+        item->value = TRUE;
+
+        g_hash_table_insert(queue->pending, control, item);
+        SWAMI_UNLOCK_WRITE(queue);
+    }
+    else
     {
-        queue->tail = queue->list;
+        item = g_slice_new(QueueItem);
+        item->control = g_object_ref(control);  /* ++ ref control */
+        item->event = event;	/* !! takes over event refs */
+        item->value = FALSE;
     }
 
-    SWAMI_UNLOCK_WRITE(queue);
+    queue_push(queue, item);
+}
+
+/* add an item to the head of a queue, lock free for any number of threads */
+static void
+queue_push(SwamiControlQueue *queue, QueueItem *item)
+{
+    QueueItem *prev;
+
+    item->next = NULL;
+
+    /* swap in the item as the new head */
+    do
+    {
+        prev = g_atomic_pointer_get((gpointer *)&queue->head);
+    }
+    while(!g_atomic_pointer_compare_and_exchange((gpointer *)&queue->head,
+            prev, item));
+
+    /* link the previous head, item becomes visible to the consumer */
+    g_atomic_pointer_set((gpointer *)&prev->next, item);
+}
+
+/* Remove the item at the tail of a queue.  Returns NULL if the queue is
+ * empty or the next item is still being linked by a producer (it will be
+ * returned by a later call).
+ * MT-NOTE: Consumer only.
+ */
+static QueueItem *
+queue_pop(SwamiControlQueue *queue)
+{
+    QueueItem *tail = queue->tail, *next, *head;
+
+    next = g_atomic_pointer_get((gpointer *)&tail->next);
+
+    /* skip the stub item */
+    if(tail == queue->stub)
+    {
+        if(!next)
+        {
+            return (NULL);
+        }
+
+        queue->tail = next;
+        tail = next;
+        next = g_atomic_pointer_get((gpointer *)&tail->next);
+    }
+
+    if(next)
+    {
+        queue->tail = next;
+        return (tail);
+    }
+
+    /* tail is the last item? Only if a producer isn't between the swap and
+     * the link, in which case the item can't be taken yet */
+    head = g_atomic_pointer_get((gpointer *)&queue->head);
+
+    if(tail != head)
+    {
+        return (NULL);
+    }
+
+    /* re-add the stub, so the tail item can be taken */
+    queue_push(queue, queue->stub);
+
+    next = g_atomic_pointer_get((gpointer *)&tail->next);
+
+    if(next)
+    {
+        queue->tail = next;
+        return (tail);
+    }
+
+    return (NULL);
+}
+
+/* send a queued event to its control (if dispatch) and free the item
+ * MT-NOTE: Consumer only.
+ */
+static void
+queue_item_run(SwamiControlQueue *queue, QueueItem *item, gboolean dispatch)
+{
+    /* value control item? - remove it from pending hash, after which its
+     * event can't be replaced anymore and new events get a new item */
+    if(item->value)
+    {
+        SWAMI_LOCK_WRITE(queue);
+        g_hash_table_remove(queue->pending, item->control);
+        SWAMI_UNLOCK_WRITE(queue);
+    }
+
+    if(dispatch)
+    {
+        swami_control_set_event_no_queue_loop(item->control, item->event);
+    }
+
+    g_object_unref(item->control);  /* -- unref control */
+    swami_control_event_active_unref(item->event);  /* -- unref active ref */
+    swami_control_event_unref(item->event);  /* -- unref event */
+
+    g_slice_free(QueueItem, item);
 }
 
 /**
  * swami_control_queue_run:
  * @queue: Swami control queue object
  *
- * Process a control event queue by sending queued events to controls.
+ * Process a control event queue by sending queued events to controls, in the
+ * order they were added.  If a run budget is set (see
+ * swami_control_queue_set_run_budget()) then processing stops once it is
+ * used up and the remaining events are left for the next run.  Only one
+ * thread runs a queue at a time, calls while it is running return
+ * immediately.
  */
 void
 swami_control_queue_run(SwamiControlQueue *queue)
 {
-    GList *list, *p, *temp;
     QueueItem *item;
+    GTimeVal start, now;
+    guint budget;
+    int count = 0;
 
     g_return_if_fail(SWAMI_IS_CONTROL_QUEUE(queue));
 
-    SWAMI_LOCK_WRITE(queue);
-    list = queue->tail;		/* take over the list */
-    queue->list = NULL;
-    queue->tail = NULL;
-    SWAMI_UNLOCK_WRITE(queue);
+    if(!g_atomic_int_compare_and_exchange(&queue->running, FALSE, TRUE))
+    {
+        return;
+    }
 
-    /* process queue in reverse (since we prepended) */
-    p = list;
+    budget = queue->run_budget;
 
-    while(p)
+    if(budget)
     {
-        item = (QueueItem *)(p->data);
-        swami_control_set_event_no_queue_loop(item->control, item->event);
-        g_object_unref(item->control);  /* -- unref control */
-        swami_control_event_active_unref(item->event);  /* -- unref active ref */
-        swami_control_event_unref(item->event);  /* -- unref event */
+        g_get_current_time(&start);
+    }
+
+    while((item = queue_pop(queue)))
+    {
+        queue_item_run(queue, item, TRUE);
+        g_atomic_int_inc(&queue->delivered);
 
-        g_slice_free(QueueItem, item);
+        /* check time budget in batches of events */
+        if(budget && ++count % RUN_BATCH_SIZE == 0)
+        {
+            g_get_current_time(&now);
 
-        temp = p;
-        p = p->prev;
-        temp = g_list_delete_link(temp, temp);   /* assign to prevent gcc warning */
+            if((now.tv_sec - start.tv_sec) * G_USEC_PER_SEC
+                    + (now.tv_usec - start.tv_usec) >= (glong)budget)
+            {
+                break;
+            }
+        }
     }
+
+    g_atomic_int_set(&queue->running, FALSE);
 }
 
 /**
@@ -164,3 +370,50 @@ swami_control_queue_set_test_func(SwamiControlQueue *queue,
     g_return_if_fail(SWAMI_IS_CONTROL_QUEUE(queue));
     queue->test_func = test_func;
 }
+
+/**
+ * swami_control_queue_set_run_budget:
+ * @queue: Control queue object
+ * @budget: Max time in microseconds of a swami_control_queue_run() call, or
+ *   0 to run all queued events (the default)
+ *
+ * Limit the time spent sending queued events per swami_control_queue_run()
+ * call, so that a flood of events can't starve other processing in the
+ * thread running the queue (GUI redraws for instance).  The budget is
+ * checked every few events, so it can be exceeded by the time of a few
+ * events.
+ */
+void
+swami_control_queue_set_run_budget(SwamiControlQueue *queue, guint budget)
+{
+    g_return_if_fail(SWAMI_IS_CONTROL_QUEUE(queue));
+    queue->run_budget = budget;
+}
+
+/**
+ * swami_control_queue_get_stats:
+ * @queue: Control queue object
+ * @delivered: Location to store count of events sent to controls or %NULL
+ * @coalesced: Location to store count of events of value controls which
+ *   replaced a pending event (not sent separately) or %NULL
+ *
+ * Get event counts of a queue, since it was created.  Useful for checking
+ * how much work is saved by coalescing events of value controls
+ * (#SWAMI_CONTROL_VALUE flag).
+ */
+void
+swami_control_queue_get_stats(SwamiControlQueue *queue, guint *delivered,
+                              guint *coalesced)
+{
+    g_return_if_fail(SWAMI_IS_CONTROL_QUEUE(queue));
+
+    if(delivered)
+    {
+        *delivered = g_atomic_int_get(&queue->delivered);
+    }
+
+    if(coalesced)
+    {
+        *coalesced = g_atomic_int_get(&queue->coalesced);
+    }
+}
@@ -69,8 +69,15 @@ struct _SwamiControlQueue
 
     SwamiControlQueueTestFunc test_func;
 
-    GList *list; /* list of queued events (struct in SwamiControlQueue.c) */
-    GList *tail;			/* tail of the list */
+    /*< private >*/
+    gpointer volatile head;	/* last queued item, producers link to it */
+    gpointer tail;		/* next item to run (consumer only) */
+    gpointer stub;		/* stub item of empty queue */
+    volatile gint running;	/* TRUE while swami_control_queue_run() runs */
+    guint run_budget;		/* max microseconds per run or 0 for unlimited */
+    GHashTable *pending;		/* value control -> queued item (locked) */
+    volatile gint delivered;	/* count of events sent to controls */
+    volatile gint coalesced;	/* count of value events which replaced others */
 };
 
 /* control value change queue class */
@@ -88,5 +95,9 @@ void swami_control_queue_add_event(SwamiControlQueue *queue,
 void swami_control_queue_run(SwamiControlQueue *queue);
 void swami_control_queue_set_test_func(SwamiControlQueue *queue,
                                        SwamiControlQueueTestFunc test_func);
+void swami_control_queue_set_run_budget(SwamiControlQueue *queue,
+                                        guint budget);
+void swami_control_queue_get_stats(SwamiControlQueue *queue,
+                                   guint *delivered, guint *coalesced);
 
 #endif
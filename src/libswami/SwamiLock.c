@@ -28,14 +28,49 @@
 #include "SwamiLock.h"
 
 
+/* read lock record of a thread */
+typedef struct
+{
+    SwamiLock *lock;		/* lock object */
+    int depth;			/* read lock recursion depth */
+} LockRecord;
+
+/* contention statistics of a lock class */
+typedef struct
+{
+    guint count;			/* count of lock operations which had to wait */
+    guint64 wait_time;		/* total wait time in microseconds */
+} LockContention;
+
 /* --- private function prototypes --- */
 
 static void swami_lock_class_init(SwamiLockClass *klass);
 static void swami_lock_init(SwamiLock *lock);
 static void swami_lock_finalize(GObject *object);
 
+static LockRecord *lock_record_get(SwamiLock *lock, gboolean create);
+static void lock_record_remove(LockRecord *record);
+static void thread_locks_free(gpointer data);
+static void lock_slow_init(SwamiLock *lock);
+static void lock_wake(SwamiLock *lock);
+static void lock_write_release(SwamiLock *lock);
+static gint64 lock_time_usec(void);
+static void lock_contention_add(SwamiLock *lock, gint64 start);
+static void lock_dump_contention_GHFunc(gpointer key, gpointer value,
+                                        gpointer user_data);
+
 G_DEFINE_ABSTRACT_TYPE(SwamiLock, swami_lock, G_TYPE_OBJECT);
 
+/* read lock records of the current thread (GArray of LockRecord) */
+static GStaticPrivate thread_locks_key = G_STATIC_PRIVATE_INIT;
+
+/* lock for creating the mutex and cond of locks on demand */
+G_LOCK_DEFINE_STATIC(lock_slow_init);
+
+/* contention statistics by lock class (GType -> LockContention) */
+G_LOCK_DEFINE_STATIC(lock_contention);
+static GHashTable *lock_contention_hash = NULL;
+
 /* --- functions --- */
 
 
@@ -49,7 +84,6 @@ swami_lock_class_init(SwamiLockClass *klass)
 static void
 swami_lock_init(SwamiLock *lock)
 {
-    g_static_rec_mutex_init(&lock->mutex);
 }
 
 static void
@@ -57,7 +91,11 @@ swami_lock_finalize(GObject *object)
 {
     SwamiLock *lock = SWAMI_LOCK(object);
 
-    g_static_rec_mutex_free(&lock->mutex);
+    if(lock->mutex)
+    {
+        g_mutex_free(lock->mutex);
+        g_cond_free(lock->cond);
+    }
 
     if(G_OBJECT_CLASS(swami_lock_parent_class)->finalize)
     {
@@ -65,6 +103,420 @@ swami_lock_finalize(GObject *object)
     }
 }
 
+/**
+ * swami_lock_read_lock:
+ * @lock: Lock object
+ *
+ * Take a shared read lock, use SWAMI_LOCK_READ() instead.  Readers don't
+ * block each other, the uncontended case is a single atomic operation.
+ * Recursive read locks and read locks inside a write lock of the same thread
+ * never wait.
+ */
+void
+swami_lock_read_lock(SwamiLock *lock)
+{
+    GThread *self = g_thread_self();
+    LockRecord *record;
+    gint64 start;
+    int state;
+
+    /* nested in a write lock of this thread? */
+    if(g_atomic_pointer_get((gpointer *)&lock->owner) == self)
+    {
+        lock->write_depth++;
+        return;
+    }
+
+    record = lock_record_get(lock, TRUE);
+
+    /* already holds a read share? (don't wait for pending writers) */
+    if(record->depth > 0)
+    {
+        record->depth++;
+        return;
+    }
+
+    /* fast path: not write locked and no writers waiting */
+    while((state = g_atomic_int_get(&lock->state)) >= 0
+            && g_atomic_int_get(&lock->writers) == 0)
+    {
+        if(g_atomic_int_compare_and_exchange(&lock->state, state, state + 1))
+        {
+            record->depth = 1;
+            return;
+        }
+    }
+
+    start = lock_time_usec();
+    lock_slow_init(lock);
+
+    g_mutex_lock(lock->mutex);
+    g_atomic_int_inc(&lock->waiters);
+
+    while(TRUE)
+    {
+        state = g_atomic_int_get(&lock->state);
+
+        if(state >= 0 && g_atomic_int_get(&lock->writers) == 0)
+        {
+            if(g_atomic_int_compare_and_exchange(&lock->state, state, state + 1))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        g_cond_wait(lock->cond, lock->mutex);
+    }
+
+    g_atomic_int_add(&lock->waiters, -1);
+    g_mutex_unlock(lock->mutex);
+
+    record->depth = 1;
+    lock_contention_add(lock, start);
+}
+
+/**
+ * swami_lock_read_unlock:
+ * @lock: Lock object
+ *
+ * Release a read lock, use SWAMI_UNLOCK_READ() instead.
+ */
+void
+swami_lock_read_unlock(SwamiLock *lock)
+{
+    LockRecord *record;
+
+    /* nested in a write lock of this thread? */
+    if(g_atomic_pointer_get((gpointer *)&lock->owner) == g_thread_self())
+    {
+        if(--lock->write_depth == 0)
+        {
+            lock_write_release(lock);
+        }
+
+        return;
+    }
+
+    record = lock_record_get(lock, FALSE);
+    g_return_if_fail(record != NULL && record->depth > 0);
+
+    if(--record->depth > 0)
+    {
+        return;
+    }
+
+    lock_record_remove(record);
+
+    g_atomic_int_add(&lock->state, -1);
+
+    if(g_atomic_int_get(&lock->waiters) > 0)
+    {
+        lock_wake(lock);
+    }
+}
+
+/**
+ * swami_lock_write_lock:
+ * @lock: Lock object
+ *
+ * Take the exclusive write lock, use SWAMI_LOCK_WRITE() instead.  The lock
+ * is recursive.  Upgrading a read lock of the same thread is not supported,
+ * see SWAMI_LOCK_WRITE().
+ */
+void
+swami_lock_write_lock(SwamiLock *lock)
+{
+    GThread *self = g_thread_self();
+    LockRecord *record;
+    gint64 start;
+    int depth;
+
+    if(g_atomic_pointer_get((gpointer *)&lock->owner) == self)
+    {
+        lock->write_depth++;
+        return;
+    }
+
+    /* read shares held by this thread */
+    record = lock_record_get(lock, FALSE);
+    depth = record ? record->depth : 0;
+
+    /* Upgrade from read lock?  Not supported, since two upgrading readers
+     * would wait for each other.  The read shares are released while waiting
+     * and restored on write unlock, the caller must not rely on anything it
+     * read under the read lock. */
+    if(depth > 0)
+    {
+        g_critical("%s: Write lock of %s %p taken while holding a read lock,"
+                   " read lock is released while waiting", G_STRLOC,
+                   G_OBJECT_TYPE_NAME(lock), lock);
+    }
+
+    /* fast path: no other readers or writers */
+    if(g_atomic_int_get(&lock->writers) == 0
+            && g_atomic_int_compare_and_exchange(&lock->state, depth, -1))
+    {
+        g_atomic_pointer_set((gpointer *)&lock->owner, self);
+        lock->write_depth = 1;
+        return;
+    }
+
+    start = lock_time_usec();
+    lock_slow_init(lock);
+
+    g_mutex_lock(lock->mutex);
+    g_atomic_int_inc(&lock->waiters);
+    g_atomic_int_inc(&lock->writers);
+
+    /* release read shares of this thread while waiting (see above) */
+    if(depth > 0)
+    {
+        g_atomic_int_add(&lock->state, -depth);
+        g_cond_broadcast(lock->cond);
+    }
+
+    while(!g_atomic_int_compare_and_exchange(&lock->state, 0, -1))
+    {
+        g_cond_wait(lock->cond, lock->mutex);
+    }
+
+    g_atomic_int_add(&lock->writers, -1);
+    g_atomic_int_add(&lock->waiters, -1);
+    g_mutex_unlock(lock->mutex);
+
+    g_atomic_pointer_set((gpointer *)&lock->owner, self);
+    lock->write_depth = 1;
+
+    lock_contention_add(lock, start);
+}
+
+/**
+ * swami_lock_write_unlock:
+ * @lock: Lock object
+ *
+ * Release a write lock, use SWAMI_UNLOCK_WRITE() instead.
+ */
+void
+swami_lock_write_unlock(SwamiLock *lock)
+{
+    g_return_if_fail(g_atomic_pointer_get((gpointer *)&lock->owner)
+                     == g_thread_self());
+
+    if(--lock->write_depth == 0)
+    {
+        lock_write_release(lock);
+    }
+}
+
+/* release the write lock, read shares of the owner thread are restored */
+static void
+lock_write_release(SwamiLock *lock)
+{
+    LockRecord *record;
+
+    record = lock_record_get(lock, FALSE);
+
+    g_atomic_pointer_set((gpointer *)&lock->owner, NULL);
+    g_atomic_int_set(&lock->state, record ? record->depth : 0);
+
+    if(g_atomic_int_get(&lock->waiters) > 0)
+    {
+        lock_wake(lock);
+    }
+}
+
+/* get the read lock record of the current thread for a lock */
+static LockRecord *
+lock_record_get(SwamiLock *lock, gboolean create)
+{
+    GArray *records;
+    LockRecord *record;
+    int i;
+
+    records = g_static_private_get(&thread_locks_key);
+
+    if(!records)
+    {
+        if(!create)
+        {
+            return (NULL);
+        }
+
+        records = g_array_new(FALSE, FALSE, sizeof(LockRecord));
+        g_static_private_set(&thread_locks_key, records, thread_locks_free);
+    }
+
+    /* most recently taken locks are at the end */
+    for(i = records->len - 1; i >= 0; i--)
+    {
+        record = &g_array_index(records, LockRecord, i);
+
+        if(record->lock == lock)
+        {
+            return (record);
+        }
+    }
+
+    if(!create)
+    {
+        return (NULL);
+    }
+
+    g_array_set_size(records, records->len + 1);
+    record = &g_array_index(records, LockRecord, records->len - 1);
+    record->lock = lock;
+    record->depth = 0;
+
+    return (record);
+}
+
+/* remove a read lock record of the current thread */
+static void
+lock_record_remove(LockRecord *record)
+{
+    GArray *records;
+
+    records = g_static_private_get(&thread_locks_key);
+    g_array_remove_index_fast(records, record - (LockRecord *)(records->data));
+}
+
+/* free the read lock records of an exiting thread */
+static void
+thread_locks_free(gpointer data)
+{
+    g_array_free((GArray *)data, TRUE);
+}
+
+/* create the mutex and cond of a lock, only needed once it is contended */
+static void
+lock_slow_init(SwamiLock *lock)
+{
+    G_LOCK(lock_slow_init);
+
+    if(!lock->mutex)
+    {
+        lock->cond = g_cond_new();
+        lock->mutex = g_mutex_new();
+    }
+
+    G_UNLOCK(lock_slow_init);
+}
+
+/* wake threads waiting for a lock */
+static void
+lock_wake(SwamiLock *lock)
+{
+    lock_slow_init(lock);
+
+    g_mutex_lock(lock->mutex);
+    g_cond_broadcast(lock->cond);
+    g_mutex_unlock(lock->mutex);
+}
+
+/* current time in microseconds for contention statistics */
+static gint64
+lock_time_usec(void)
+{
+    GTimeVal now;
+
+    g_get_current_time(&now);
+
+    return ((gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec);
+}
+
+/* add a lock operation which waited since start to the contention stats */
+static void
+lock_contention_add(SwamiLock *lock, gint64 start)
+{
+    LockContention *contention;
+    GType type = G_OBJECT_TYPE(lock);
+
+    G_LOCK(lock_contention);
+
+    if(!lock_contention_hash)
+    {
+        lock_contention_hash = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    }
+
+    contention = g_hash_table_lookup(lock_contention_hash, GSIZE_TO_POINTER(type));
+
+    if(!contention)
+    {
+        contention = g_new0(LockContention, 1);
+        g_hash_table_insert(lock_contention_hash, GSIZE_TO_POINTER(type),
+                            contention);
+    }
+
+    contention->count++;
+    contention->wait_time += MAX(lock_time_usec() - start, 0);
+
+    G_UNLOCK(lock_contention);
+}
+
+/**
+ * swami_lock_get_contention:
+ * @type: SwamiLock derived type
+ * @count: Location to store count of lock operations which had to wait
+ *   or %NULL
+ * @wait_time: Location to store total wait time in microseconds or %NULL
+ *
+ * Get lock contention statistics of objects of a SwamiLock derived class.
+ * Only objects of exactly @type are counted, not of derived types.
+ */
+void
+swami_lock_get_contention(GType type, guint *count, guint64 *wait_time)
+{
+    LockContention *contention = NULL;
+
+    G_LOCK(lock_contention);
+
+    if(lock_contention_hash)
+        contention = g_hash_table_lookup(lock_contention_hash,
+                                         GSIZE_TO_POINTER(type));
+
+    if(count)
+    {
+        *count = contention ? contention->count : 0;
+    }
+
+    if(wait_time)
+    {
+        *wait_time = contention ? contention->wait_time : 0;
+    }
+
+    G_UNLOCK(lock_contention);
+}
+
+/**
+ * swami_lock_dump_contention:
+ *
+ * Print lock contention statistics of all SwamiLock derived classes which
+ * had to wait for a lock, for debugging.
+ */
+void
+swami_lock_dump_contention(void)
+{
+    G_LOCK(lock_contention);
+
+    if(lock_contention_hash)
+        g_hash_table_foreach(lock_contention_hash, lock_dump_contention_GHFunc,
+                             NULL);
+
+    G_UNLOCK(lock_contention);
+}
+
+static void
+lock_dump_contention_GHFunc(gpointer key, gpointer value, gpointer user_data)
+{
+    LockContention *contention = value;
+
+    g_message("%s: %u waits, %" G_GUINT64_FORMAT " usecs",
+              g_type_name(GPOINTER_TO_SIZE(key)), contention->count,
+              contention->wait_time);
+}
+
 /**
  * swami_lock_set_atomic:
  * @lock: SwamiLock derived object to set properties of
@@ -121,9 +573,9 @@ swami_lock_get_atomic(gpointer lock, const char *first_property_name, ...)
 
     va_start(args, first_property_name);
 
-    SWAMI_LOCK_WRITE(lock);
+    SWAMI_LOCK_READ(lock);
     g_object_get_valist(G_OBJECT(lock), first_property_name, args);
-    SWAMI_UNLOCK_WRITE(lock);
+    SWAMI_UNLOCK_READ(lock);
 
     va_end(args);
 }
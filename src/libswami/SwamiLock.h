@@ -41,7 +41,15 @@ typedef struct _SwamiLockClass SwamiLockClass;
 struct _SwamiLock
 {
     GObject parent_instance;
-    GStaticRecMutex mutex;
+
+    /*< private >*/
+    volatile gint state;		/* count of read shares or -1 if write locked */
+    volatile gint writers;	/* count of threads waiting for write lock */
+    volatile gint waiters;	/* count of threads waiting on cond */
+    GThread *volatile owner;	/* thread holding write lock or NULL */
+    guint write_depth;		/* write (and nested read) depth of owner */
+    GMutex *mutex;		/* lock for slow paths (created on demand) */
+    GCond *cond;			/* signaled when waiters can proceed */
 };
 
 struct _SwamiLockClass
@@ -49,16 +57,24 @@ struct _SwamiLockClass
     GObjectClass parent_class;
 };
 
-/* Multi-thread locking macros. For now there is no distinction between
-   write and read locking since GStaticRWLock is not recursive. */
-#define SWAMI_LOCK_WRITE(lock)	\
-    g_static_rec_mutex_lock (&((SwamiLock *)(lock))->mutex)
-#define SWAMI_UNLOCK_WRITE(lock) \
-    g_static_rec_mutex_unlock (&((SwamiLock *)(lock))->mutex)
-#define SWAMI_LOCK_READ(lock)	SWAMI_LOCK_WRITE(lock)
-#define SWAMI_UNLOCK_READ(lock)	SWAMI_UNLOCK_WRITE(lock)
+/* Multi-thread locking macros.  Locks are recursive, read locks are shared
+   and write locks are exclusive.  Read locks can be taken inside a write
+   lock, but upgrading a read lock to a write lock is not supported: it logs
+   a critical and the read lock is released while waiting for the write lock,
+   so state read before must be checked again.  Locks must be released in
+   the reverse order they were taken. */
+#define SWAMI_LOCK_WRITE(lock)	swami_lock_write_lock ((SwamiLock *)(lock))
+#define SWAMI_UNLOCK_WRITE(lock) swami_lock_write_unlock ((SwamiLock *)(lock))
+#define SWAMI_LOCK_READ(lock)	swami_lock_read_lock ((SwamiLock *)(lock))
+#define SWAMI_UNLOCK_READ(lock)	swami_lock_read_unlock ((SwamiLock *)(lock))
 
 GType swami_lock_get_type(void);
+void swami_lock_read_lock(SwamiLock *lock);
+void swami_lock_read_unlock(SwamiLock *lock);
+void swami_lock_write_lock(SwamiLock *lock);
+void swami_lock_write_unlock(SwamiLock *lock);
+void swami_lock_get_contention(GType type, guint *count, guint64 *wait_time);
+void swami_lock_dump_contention(void);
 void swami_lock_set_atomic(gpointer lock,
                            const char *first_property_name, ...);
 void swami_lock_get_atomic(gpointer lock,
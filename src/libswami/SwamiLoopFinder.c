@@ -38,22 +38,92 @@
  * the absolute differences of the sample points surrounding the loop
  * points (analysis window size) multiplied individually by values in the
  * analysis_window[] array.
+ *
+ * The search space is split into tiles (a run of loop end candidates for a
+ * single loop start position).  Tiles can be scored by a pool of worker
+ * threads ("threads" property), but are always merged into the result list
+ * by the calling thread in serial search order, since the result grouping
+ * depends on the order in which candidates are added.  Results are therefore
+ * identical to a single threaded search.
+ *
+ * The hierarchical search mode ("search-mode" property) searches a moving
+ * average of the sample data with loop start positions and analysis window
+ * taps spaced by a decimation factor, then refines the best candidate
+ * regions at full resolution.  It is much faster for large search windows,
+ * but may miss the best loops of an exhaustive search.
+ *
+ * The correlation search mode (only available with FFTW) splits the loop
+ * start window into blocks and calculates the cross-correlation of each block
+ * with the whole loop end window using FFTs.  The squared difference of each
+ * block and the end window at every loop size is derived from it, and the loop
+ * sizes with the least difference are then scored with the analysis window
+ * for every loop start position of the block.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <libinstpatch/libinstpatch.h>
 
+/* SIMD quality kernels (x86 kernels are selected at runtime).  Not used on
+ * i386, where the scalar kernel may be computed with x87 excess precision. */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define QUALITY_KERNEL_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define QUALITY_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
 #include "SwamiLoopFinder.h"
 #include "SwamiLog.h"
+#include "util.h"
+#include "builtin_enums.h"
 #include "i18n.h"
 
+#ifdef FFTW_SUPPORT
+#include <fftw3.h>
+#endif
+
 #define DEFAULT_MAX_RESULTS	200
 #define MAX_MAX_RESULTS		4000
 #define DEFAULT_ANALYSIS_WINDOW	17
 #define DEFAULT_MIN_LOOP_SIZE	10
 #define DEFAULT_GROUP_POS_DIFF	20
 #define DEFAULT_GROUP_SIZE_DIFF	5
+#define DEFAULT_THREADS		1
+#define MAX_THREADS		64
+
+/* Number of loop end candidates per search tile */
+#define TILE_SIZE		4096
+
+/* Tile slots per worker thread (scored tiles which can be pending merge) */
+#define TILE_SLOTS_PER_THREAD	4
+
+/* Hierarchical search: maximum decimation factor (as a power of 2), maximum
+ * candidates to search at the coarse level, minimum coarse analysis window,
+ * loop size radius refined around each candidate region and count of
+ * candidate regions kept (times max results) */
+#define HIERARCHY_MAX_SHIFT	10
+#define HIERARCHY_MAX_COARSE	(1 << 24)
+#define HIERARCHY_MIN_WINDOW	5
+#define HIERARCHY_SIZE_RADIUS	4
+#define HIERARCHY_REGIONS	16
+
+/* Progress range of the coarse level search of hierarchical search */
+#define HIERARCHY_PROGRESS	0.9
+
+/* Correlation search: minimum candidates for which it is used (smaller
+ * searches are exhaustive), loop start positions per correlation block,
+ * loop sizes scored per block and loop size radius scored around each */
+#define CORRELATION_MIN_SEARCH	(1 << 24)
+#define CORRELATION_BLOCK	8192
+#define CORRELATION_PEAKS	32
+#define CORRELATION_SIZE_RADIUS	1
+
+/* Quality value assigned to candidates which aren't valid loops */
+#define INVALID_QUALITY		2.0
 
 /* Sample format used by loop finder */
 #define SAMPLE_FORMAT   IPATCH_SAMPLE_FLOAT | IPATCH_SAMPLE_MONO | IPATCH_SAMPLE_ENDIAN_HOST
@@ -75,9 +145,122 @@ enum
     PROP_WINDOW2_END,		/* window2 end position in samples */
     PROP_GROUP_POS_DIFF,		/* min pos diff of loops for separate groups */
     PROP_GROUP_SIZE_DIFF,		/* min size diff of loops for separate groups */
-    PROP_EXEC_TIME		/* execution time in milliseconds of find */
+    PROP_EXEC_TIME,		/* execution time in milliseconds of find */
+    PROP_THREADS,			/* number of threads to use for search */
+    PROP_SEARCH_MODE,		/* search mode (SwamiLoopFinderSearchMode) */
+    PROP_CANDIDATES		/* count of candidates evaluated by last find */
+};
+
+typedef struct _MatchEntry MatchEntry;
+typedef struct _MatchBucket MatchBucket;
+
+/* A loop match in the result heap and group bucket index */
+struct _MatchEntry
+{
+    SwamiLoopMatch match;         /* loop match values */
+    guint64 seq;                  /* add sequence number, orders equal quality */
+    int heap_index;               /* index of entry in heap */
+    MatchBucket *bucket;          /* group bucket entry belongs to */
+    MatchEntry *prev, *next;      /* bucket list links (next also for free list) */
+};
+
+/* Group bucket of matches with close loop start and loop size */
+struct _MatchBucket
+{
+    int pos;                      /* loop start / group_pos_diff */
+    int size;                     /* loop size / group_size_diff */
+    MatchEntry *entries;          /* list of matches in bucket */
+};
+
+/* Best loop matches found so far.  A bounded max-heap (worst match at the
+ * top) provides the worst match for eviction, and matches are indexed by
+ * group buckets of (start / group_pos_diff, size / group_size_diff), so
+ * only the 9 neighboring buckets need to be checked for group conflicts. */
+typedef struct
+{
+    MatchEntry *entries;          /* allocated pool of max_results entries */
+    MatchEntry *free_entries;     /* list of unused entries in pool */
+    MatchEntry **heap;            /* max-heap of matches by quality and seq */
+    GHashTable *buckets;          /* MatchBucket -> MatchBucket */
+    guint64 seq;                  /* next add sequence number */
+    int count;                    /* count of matches */
+    float worst;                  /* quality of worst match (if count > 0) */
+    int max_results;              /* Maximum results to return */
+    int group_pos_diff;           /* Minimum result group position diff */
+    int group_size_diff;          /* Minimum result group size diff */
+} MatchList;
+
+/* Tile slot states */
+enum
+{
+    TILE_FREE,                    /* slot is free to be scored into */
+    TILE_BUSY,                    /* a worker is scoring the tile */
+    TILE_READY                    /* tile is scored and waiting to be merged */
 };
 
+/* A tile slot of scored loop end candidates */
+typedef struct
+{
+    guint64 index;                /* index of tile in search order */
+    int state;                    /* TILE_FREE, TILE_BUSY or TILE_READY */
+    int scored;                   /* count of valid candidates scored */
+    float *qualities;             /* quality of each candidate in tile */
+} FindTile;
+
+/* State of an active find */
+typedef struct
+{
+    SwamiLoopFinder *finder;
+    const float *sample_data;     /* Pointer to sample data */
+    const float *anwin_factors;   /* Analysis window factors */
+    int analysis_window;          /* Analysis window size */
+    int half_window;              /* First half of analysis window */
+    int min_loop_size;            /* Minimum loop size */
+    int step;                     /* Loop start and analysis window tap spacing */
+    int win1start, win1size, win2start, win2size;  /* Search window parameters */
+    int tiles_per_row;            /* Tiles per loop start position */
+    guint64 tile_count;           /* Total count of tiles */
+    guint64 progress_step, progress_count;       /* Progress update vars */
+    float progress_base;          /* progress value at start of search */
+    float progress_range;         /* progress range of search */
+    guint64 candidates;           /* count of candidates scored */
+
+    /* Worker thread state, only used if finder->threads > 1 */
+    GMutex *mutex;                /* lock for fields below and tile states */
+    GCond *ready_cond;            /* signaled when a tile has been scored */
+    GCond *free_cond;             /* signaled when a tile slot has been freed */
+    guint64 next_tile;            /* next tile index to be scored */
+    gboolean abort;               /* set to TRUE to stop workers */
+    FindTile *tiles;              /* tile slots */
+    int slot_count;               /* count of tile slots */
+} FindState;
+
+/* Calculates the quality of count consecutive loop end candidates (starting
+ * at end) for a single loop start position (start), analysis window taps are
+ * stride samples apart */
+typedef void (*QualityKernel)(const float *start, const float *end,
+                              const float *anwin_factors, int analysis_window,
+                              int stride, float *qualities, int count);
+
+/* Coarse level parameters of a hierarchical search */
+typedef struct
+{
+    int shift;                    /* decimation factor is 2^shift */
+    int analysis_window;          /* analysis window size (in taps) */
+    int win1start, win1end, win2start, win2end;  /* search windows */
+} CoarseLevel;
+
+#ifdef FFTW_SUPPORT
+
+/* A loop size of a correlation block to score */
+typedef struct
+{
+    int size;                     /* loop size */
+    double diff;                  /* mean squared difference at loop size */
+} CorrelationPeak;
+
+#endif
+
 static void swami_loop_finder_set_property(GObject *object,
         guint property_id,
         const GValue *value,
@@ -90,11 +273,91 @@ static void swami_loop_finder_init(SwamiLoopFinder *editor);
 static void swami_loop_finder_finalize(GObject *object);
 static void swami_loop_finder_real_set_sample(SwamiLoopFinder *finder,
         IpatchSample *sample);
+static guint match_bucket_hash(gconstpointer key);
+static gboolean match_bucket_equal(gconstpointer a, gconstpointer b);
+static void match_bucket_free(gpointer data);
+static inline gboolean match_entry_worse(MatchEntry *a, MatchEntry *b);
+static void match_heap_up(MatchList *list, int index);
+static void match_heap_down(MatchList *list, int index);
+static void match_list_remove(MatchList *list, MatchEntry *entry);
+static int match_entry_compare(const void *a, const void *b);
+static void match_list_init(MatchList *list, int max_results,
+                            int group_pos_diff, int group_size_diff);
+static void match_list_clear(MatchList *list);
+static void match_list_add(MatchList *list, int startpos, int endpos,
+                           float quality);
+static void match_list_finish(MatchList *list, SwamiLoopMatch *matches);
+static inline float quality_scalar(const float *start, const float *end,
+                                   const float *anwin_factors,
+                                   int analysis_window, int stride);
+static void quality_kernel_scalar(const float *start, const float *end,
+                                  const float *anwin_factors,
+                                  int analysis_window, int stride,
+                                  float *qualities, int count);
+#ifdef QUALITY_KERNEL_X86
+static void quality_kernel_sse2(const float *start, const float *end,
+                                const float *anwin_factors,
+                                int analysis_window, int stride,
+                                float *qualities, int count);
+static void quality_kernel_avx2(const float *start, const float *end,
+                                const float *anwin_factors,
+                                int analysis_window, int stride,
+                                float *qualities, int count);
+#endif
+#ifdef QUALITY_KERNEL_NEON
+static void quality_kernel_neon(const float *start, const float *end,
+                                const float *anwin_factors,
+                                int analysis_window, int stride,
+                                float *qualities, int count);
+#endif
+static gboolean quality_kernel_check(QualityKernel kernel);
+static QualityKernel quality_kernel_select(void);
+static int score_tile(FindState *state, guint64 index, float *qualities);
+static gboolean merge_tile(FindState *state, MatchList *list, guint64 index,
+                           const float *qualities);
+static gpointer find_loop_worker(gpointer data);
+static gboolean find_loop_threaded(FindState *state, MatchList *list,
+                                   int threads);
+static float *anwin_factors_new(int analysis_window);
+static void find_state_init(FindState *state, SwamiLoopFinder *finder,
+                            const float *sample_data,
+                            const float *anwin_factors, int analysis_window,
+                            int min_loop_size, int step, int win1start,
+                            int win1end, int win2start, int win2end);
+static gboolean search_tiles(FindState *state, MatchList *list);
+static gboolean coarse_level_init(CoarseLevel *level, SwamiLoopFinder *finder,
+                                  int shift, int win1start, int win1end,
+                                  int win2start, int win2end);
+static int hierarchy_shift(SwamiLoopFinder *finder, int win1start,
+                           int win1end, int win2start, int win2end);
+static gint64 refine_regions(SwamiLoopFinder *finder, int factor,
+                             SwamiLoopMatch *regions, int count,
+                             MatchList *list, const float *anwin_factors,
+                             int win1start, int win1end,
+                             int win2start, int win2end);
+static gboolean find_loop_hierarchical(FindState *state, MatchList *list,
+                                       int shift, int win1start, int win1end,
+                                       int win2start, int win2end);
+#ifdef FFTW_SUPPORT
+static void correlation_peak_add(CorrelationPeak *peaks, int *count,
+                                 int size, double diff);
+static gint64 score_correlation_block(SwamiLoopFinder *finder,
+                                      MatchList *list,
+                                      const float *anwin_factors, int blockstart,
+                                      int blocksize, CorrelationPeak *peaks,
+                                      int count, int win2start, int win2end);
+static gboolean find_loop_correlation(FindState *state, MatchList *list,
+                                      int win1start, int win1end,
+                                      int win2start, int win2end);
+#endif
 static void find_loop(SwamiLoopFinder *finder, SwamiLoopMatch *matches);
 
 
 G_DEFINE_TYPE(SwamiLoopFinder, swami_loop_finder, SWAMI_TYPE_LOCK);
 
+/* Quality kernel for this CPU, assigned in class init */
+static QualityKernel quality_kernel = quality_kernel_scalar;
+
 
 static void
 swami_loop_finder_class_init(SwamiLoopFinderClass *klass)
@@ -105,6 +368,8 @@ swami_loop_finder_class_init(SwamiLoopFinderClass *klass)
     obj_class->get_property = swami_loop_finder_get_property;
     obj_class->finalize = swami_loop_finder_finalize;
 
+    quality_kernel = quality_kernel_select();
+
     g_object_class_install_property(obj_class, PROP_RESULTS,
                                     g_param_spec_object("results", _("Results"),
                                             _("Loop results object"),
@@ -170,6 +435,21 @@ swami_loop_finder_class_init(SwamiLoopFinderClass *klass)
                                     g_param_spec_uint("exec-time", _("Exec time"),
                                             _("Execution time in milliseconds"),
                                             0, G_MAXUINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_THREADS,
+                                    g_param_spec_int("threads", _("Threads"),
+                                            _("Number of threads to use for search"),
+                                            1, MAX_THREADS, DEFAULT_THREADS,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_SEARCH_MODE,
+                                    g_param_spec_enum("search-mode", _("Search mode"),
+                                            _("Loop search mode"),
+                                            SWAMI_TYPE_LOOP_FINDER_SEARCH_MODE,
+                                            SWAMI_LOOP_FINDER_SEARCH_EXHAUSTIVE,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_CANDIDATES,
+                                    g_param_spec_uint64("candidates", _("Candidates"),
+                                            _("Count of loop candidates evaluated by last find"),
+                                            0, G_MAXUINT64, 0, G_PARAM_READABLE));
 }
 
 static void
@@ -234,6 +514,14 @@ swami_loop_finder_set_property(GObject *object, guint property_id,
         finder->group_size_diff = g_value_get_int(value);
         break;
 
+    case PROP_THREADS:
+        finder->threads = g_value_get_int(value);
+        break;
+
+    case PROP_SEARCH_MODE:
+        finder->search_mode = g_value_get_enum(value);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
@@ -310,6 +598,18 @@ swami_loop_finder_get_property(GObject *object, guint property_id,
         g_value_set_int(value, finder->group_size_diff);
         break;
 
+    case PROP_THREADS:
+        g_value_set_int(value, finder->threads);
+        break;
+
+    case PROP_SEARCH_MODE:
+        g_value_set_enum(value, finder->search_mode);
+        break;
+
+    case PROP_CANDIDATES:
+        g_value_set_uint64(value, finder->candidates);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
@@ -324,6 +624,8 @@ swami_loop_finder_init(SwamiLoopFinder *finder)
     finder->min_loop_size = DEFAULT_MIN_LOOP_SIZE;
     finder->group_pos_diff = DEFAULT_GROUP_POS_DIFF;
     finder->group_size_diff = DEFAULT_GROUP_SIZE_DIFF;
+    finder->threads = DEFAULT_THREADS;
+    finder->search_mode = SWAMI_LOOP_FINDER_SEARCH_EXHAUSTIVE;
 }
 
 static void
@@ -617,6 +919,10 @@ swami_loop_finder_verify_params(SwamiLoopFinder *finder, gboolean nudge,
  * thread to call this function will be OK.  The results can only be accessed
  * up until the next call to this function.
  *
+ * If the "threads" property is greater than 1, the search is split across
+ * that many worker threads.  The "progress" property is still only updated
+ * from the calling thread and results are identical to a single threaded find.
+ *
  * Returns: TRUE on success, FALSE if the find parameter values are invalid
  *   or operation was cancelled (in which case @err may be set).
  */
@@ -774,355 +1080,1613 @@ swami_loop_finder_get_results(SwamiLoopFinder *finder)
     return (results);
 }
 
-/* the loop finder algorithm, parameters should be varified before calling. */
+
+static guint
+match_bucket_hash(gconstpointer key)
+{
+    const MatchBucket *bucket = key;
+
+    return ((guint)bucket->pos * 31 + (guint)bucket->size);
+}
+
+static gboolean
+match_bucket_equal(gconstpointer a, gconstpointer b)
+{
+    const MatchBucket *bucket_a = a, *bucket_b = b;
+
+    return (bucket_a->pos == bucket_b->pos && bucket_a->size == bucket_b->size);
+}
+
 static void
-find_loop(SwamiLoopFinder *finder, SwamiLoopMatch *matches)
+match_bucket_free(gpointer data)
 {
-    float *sample_data = finder->sample_data;             /* Pointer to sample data */
-    int max_results = finder->max_results;                /* Maximum results to return */
-    int analysis_window = finder->analysis_window;        /* Analysis window size */
-    int min_loop_size = finder->min_loop_size;            /* Minimum loop size */
-    int win1start, win1end, win1size, win2start, win2end, win2size;  /* Search window parameters */
-    int group_pos_diff = finder->group_pos_diff;          /* Minimum result group position diff */
-    int group_size_diff = finder->group_size_diff;        /* Minimum result group size diff */
-    int half_window = analysis_window / 2;                /* First half of analysis window */
-    guint64 progress_step, progress_count;                /* Progress update vars */
-    SwamiLoopMatch *match, *cmpmatch;
-    float *anwin_factors;
-    GList *match_list = NULL;
-    GList *match_list_last = NULL;
-    int match_list_size = 0;
-    float match_list_worst = 1.0;
-    int win1, win2;
-    int startpos, endpos;
-    int pos_diff, size_diff, loop_diff;
-    float quality, diff;
-    GList *p, *link, *insert, *tmp;
-    int fract, pow2;
-    int i;
+    g_slice_free(MatchBucket, data);
+}
 
-    /* Swap start/ends as needed */
-    win1start = MIN(finder->window1_start, finder->window1_end);
-    win1end = MAX(finder->window1_start, finder->window1_end);
-    win2start = MIN(finder->window2_start, finder->window2_end);
-    win2end = MAX(finder->window2_start, finder->window2_end);
+/* Check if match a is worse than b.  Matches of equal quality are ordered
+ * by the sequence they were added in (earlier first). */
+static inline gboolean
+match_entry_worse(MatchEntry *a, MatchEntry *b)
+{
+    return (a->match.quality > b->match.quality
+            || (a->match.quality == b->match.quality && a->seq > b->seq));
+}
 
-    /* Swap ranges if needed, so that window1 is loop start search */
-    if(win1start > win2start)
+/* Move a heap entry up until its parent is worse */
+static void
+match_heap_up(MatchList *list, int index)
+{
+    MatchEntry *entry = list->heap[index];
+    int parent;
+
+    while(index > 0)
     {
-        int tmp;
+        parent = (index - 1) / 2;
 
-        tmp = win1start;
-        win1start = win2start;
-        win2start = tmp;
+        if(!match_entry_worse(entry, list->heap[parent]))
+        {
+            break;
+        }
 
-        tmp = win1end;
-        win1end = win2end;
-        win2end = tmp;
+        list->heap[index] = list->heap[parent];
+        list->heap[index]->heap_index = index;
+        index = parent;
     }
 
-    win1size = win1end - win1start + 1;
-    win2size = win2end - win2start + 1;
-
-    /* Control of progress update */
-    progress_step = (guint64)(((float)win1size * (float)win2size) / 1000.0);      /* Max. 1000 progress callbacks */
-    progress_count = progress_step;
-
-    finder->progress = 0.0;
-    g_object_notify((GObject *)finder, "progress");
+    list->heap[index] = entry;
+    entry->heap_index = index;
+}
 
-    /* Create analysis window factors array.  All values in array add up to
-     * 0.5 which when multiplied times maximum sample value difference of
-     * 2.0 (1 - -1), gives a maximum quality value (worse quality) of 1.0.
-     * Each neighboring factor towards the center point is twice the value of
-     * it's outer neighbor. */
-    anwin_factors = g_new(float, analysis_window);
+/* Move a heap entry down until it is worse than both children */
+static void
+match_heap_down(MatchList *list, int index)
+{
+    MatchEntry *entry = list->heap[index];
+    int child;
 
-    /* Calculate fraction divisor */
-    for(i = 0, fract = 0, pow2 = 1; i <= half_window; i++, pow2 *= 2)
+    while((child = index * 2 + 1) < list->count)
     {
-        fract += pow2;
+        if(child + 1 < list->count
+                && match_entry_worse(list->heap[child + 1], list->heap[child]))
+        {
+            child++;
+        }
 
-        if(i < half_window)
+        if(!match_entry_worse(list->heap[child], entry))
         {
-            fract += pow2;
+            break;
         }
-    }
 
-    /* Even windows are asymetrical, subtract 1 */
-    if(!(analysis_window & 1))
-    {
-        fract--;
+        list->heap[index] = list->heap[child];
+        list->heap[index]->heap_index = index;
+        index = child;
     }
 
-    /* Calculate values for 1st half of window and center of window */
-    for(i = 0, pow2 = 1; i <= half_window; i++, pow2 *= 2)
-    {
-        anwin_factors[i] = (float)(pow2 * 0.5 / fract);
-    }
+    list->heap[index] = entry;
+    entry->heap_index = index;
+}
 
-    /* Copy values for 2nd half of window */
-    for(i = 0; half_window + i + 1 < analysis_window; i++)
+/* Initialize a match list */
+static void
+match_list_init(MatchList *list, int max_results, int group_pos_diff,
+                int group_size_diff)
+{
+    int i;
+
+    list->max_results = max_results;
+    list->group_pos_diff = group_pos_diff;
+    list->group_size_diff = group_size_diff;
+
+    list->entries = g_new(MatchEntry, list->max_results);  /* ++ alloc */
+    list->heap = g_new(MatchEntry *, list->max_results);   /* ++ alloc */
+    list->free_entries = NULL;
+
+    for(i = list->max_results - 1; i >= 0; i--)
     {
-        anwin_factors[half_window + i + 1] = anwin_factors[half_window - i - 1];
+        list->entries[i].next = list->free_entries;
+        list->free_entries = &list->entries[i];
     }
 
-    for(win1 = 0; win1 < win1size; win1++)
-    {
-        startpos = win1start + win1;
+    /* ++ alloc hash of group buckets */
+    list->buckets = g_hash_table_new_full(match_bucket_hash, match_bucket_equal,
+                                          NULL, match_bucket_free);
+    list->seq = 0;
+    list->count = 0;
+    list->worst = 1.0;
+}
 
-        for(win2 = 0; win2 < win2size; win2++)
-        {
-            endpos = win2start + win2;
+/* Free all resources of a match list */
+static void
+match_list_clear(MatchList *list)
+{
+    g_hash_table_destroy(list->buckets);      /* -- free buckets */
+    g_free(list->heap);                       /* -- free heap */
+    g_free(list->entries);                    /* -- free entries */
+
+    list->buckets = NULL;
+    list->heap = NULL;
+    list->entries = NULL;
+    list->free_entries = NULL;
+    list->count = 0;
+}
 
-            if(finder->cancel)   /* if cancel flag has been set, return */
-            {
-                for(p = match_list; p; p = g_list_delete_link(p, p))
-                {
-                    g_slice_free(SwamiLoopMatch, p->data);
-                }
+/* Remove a match from the heap and its group bucket */
+static void
+match_list_remove(MatchList *list, MatchEntry *entry)
+{
+    MatchEntry *last;
+    int index = entry->heap_index;
 
-                g_free(anwin_factors);
-                return;
-            }
+    list->count--;
 
-            /* progress management */
-            progress_count--;
+    if(index < list->count)     /* Move last heap entry to the hole */
+    {
+        last = list->heap[list->count];
+        list->heap[index] = last;
+        last->heap_index = index;
 
-            if(progress_count == 0)
-            {
-                progress_count = progress_step;
+        if(index > 0 && match_entry_worse(last, list->heap[(index - 1) / 2]))
+        {
+            match_heap_up(list, index);
+        }
+        else
+        {
+            match_heap_down(list, index);
+        }
+    }
 
-                finder->progress = ((float)win1 * win2size + win2) / ((float)win1size * win2size);
-                g_object_notify((GObject *)finder, "progress");
-            }
+    if(entry->bucket)
+    {
+        if(entry->prev)
+        {
+            entry->prev->next = entry->next;
+        }
+        else
+        {
+            entry->bucket->entries = entry->next;
+        }
 
-            if(startpos >= endpos || endpos - startpos + 1 < min_loop_size)
-            {
-                continue;
-            }
+        if(entry->next)
+        {
+            entry->next->prev = entry->prev;
+        }
 
-            for(i = 0, quality = 0.0; i < analysis_window; i++)
-            {
-                diff = sample_data[startpos + i - half_window]
-                       - sample_data[endpos + i - half_window];
+        if(!entry->bucket->entries)     /* Remove bucket if empty */
+        {
+            g_hash_table_remove(list->buckets, entry->bucket);
+        }
+    }
 
-                if(diff < 0)
-                {
-                    diff = -diff;
-                }
+    entry->next = list->free_entries;
+    list->free_entries = entry;
 
-                quality += diff * anwin_factors[i];
-            }
+    if(list->count > 0)
+    {
+        list->worst = list->heap[0]->match.quality;
+    }
+}
 
-            /* Skip if worse than the worst and result list already full */
-            if(quality >= match_list_worst && match_list_size == max_results)
-            {
-                continue;
-            }
+/* Add a loop candidate to the match list, if it qualifies.  A candidate
+ * which belongs to the same group as an existing match of equal or better
+ * quality is discarded, otherwise it replaces any matches of its group. */
+static void
+match_list_add(MatchList *list, int startpos, int endpos, float quality)
+{
+    MatchBucket key, *bucket;
+    MatchEntry *entry, *next;
+    int pos_diff, size_diff, loop_diff;
+    gboolean grouping, found = FALSE;
+    int pos = 0, size = 0;
 
-            loop_diff = endpos - startpos;
-            insert = NULL;
-            link = NULL;
+    /* Skip if worse than the worst and result list already full */
+    if(quality >= list->worst && list->count == list->max_results)
+    {
+        return;
+    }
 
-            /* Look through existing matches for insert position, check if new
-             * match is a part of an existing group and discard new match if worse
-             * than existing group match or remove old group matches if worse quality */
-            for(p = match_list; p;)
-            {
-                cmpmatch = (SwamiLoopMatch *)(p->data);
+    loop_diff = endpos - startpos;
 
-                /* Calculate position and size differences of new match and cmpmatch */
-                pos_diff = startpos - cmpmatch->start;
-                size_diff = loop_diff - (cmpmatch->end - cmpmatch->start);
+    /* Matches can only be in the same group if both diffs are non-zero */
+    grouping = list->group_pos_diff > 0 && list->group_size_diff > 0;
 
-                if(pos_diff < 0)
-                {
-                    pos_diff = -pos_diff;
-                }
+    if(grouping)
+    {
+        pos = startpos / list->group_pos_diff;
+        size = loop_diff / list->group_size_diff;
+
+        /* Discard new match if an existing match of the same group is better
+         * or equal, then remove any (worse) matches of the same group */
+        for(key.pos = pos - 1; key.pos <= pos + 1; key.pos++)
+        {
+            for(key.size = size - 1; key.size <= size + 1; key.size++)
+            {
+                bucket = g_hash_table_lookup(list->buckets, &key);
 
-                if(size_diff < 0)
+                if(!bucket)
                 {
-                    size_diff = -size_diff;
+                    continue;
                 }
 
-                /* Same match group? */
-                if(pos_diff < group_pos_diff && size_diff < group_size_diff)
+                for(entry = bucket->entries; entry; entry = entry->next)
                 {
-                    /* New match is worse? - Discard new */
-                    if(quality >= cmpmatch->quality)
-                    {
-                        break;
-                    }
-
-                    /* New match is better - Discard old */
+                    pos_diff = ABS(startpos - (int)entry->match.start);
+                    size_diff = ABS(loop_diff - (int)(entry->match.end
+                                                      - entry->match.start));
 
-                    if(p == match_list_last)
+                    /* Same match group? */
+                    if(pos_diff < list->group_pos_diff
+                            && size_diff < list->group_size_diff)
                     {
-                        match_list_last = p->prev;
-
-                        if(match_list_last)
+                        /* New match is worse? - Discard new */
+                        if(quality >= entry->match.quality)
                         {
-                            match = (SwamiLoopMatch *)(match_list_last->data);
-                            match_list_worst = match->quality;
+                            return;
                         }
-                    }
 
-                    if(!link)
-                    {
-                        /* Re-use list nodes */
-                        link = p;
-                        p = p->next;
-                        match_list = g_list_remove_link(match_list, link);
-                    }
-                    else
-                    {
-                        tmp = p;
-                        p = p->next;
-                        g_slice_free(SwamiLoopMatch, tmp->data);
-                        match_list = g_list_delete_link(match_list, tmp);
+                        found = TRUE;
                     }
-
-                    match_list_size--;
-                    continue;
-                }
-
-                if(!insert && quality < cmpmatch->quality)
-                {
-                    insert = p;
                 }
-
-                p = p->next;
             }
+        }
 
-            /* Discard new match? */
-            if(p)
+        /* New match is better - Discard old */
+        for(key.pos = pos - 1; found && key.pos <= pos + 1; key.pos++)
+        {
+            for(key.size = size - 1; key.size <= size + 1; key.size++)
             {
-                continue;
-            }
+                bucket = g_hash_table_lookup(list->buckets, &key);
 
-            /* max results reached? */
-            if(match_list_size == max_results)
-            {
-                if(insert == match_list_last)
+                for(entry = bucket ? bucket->entries : NULL; entry; entry = next)
                 {
-                    insert = NULL;
-                }
+                    next = entry->next;
 
-                if(!link)
-                {
-                    /* Re-use list nodes */
-                    link = match_list_last;
-                    match_list_last = match_list_last->prev;
-                    match_list = g_list_remove_link(match_list, link);
-                }
-                else
-                {
-                    tmp = match_list_last;
-                    match_list_last = match_list_last->prev;
-                    g_slice_free(SwamiLoopMatch, tmp->data);
-                    match_list = g_list_delete_link(match_list, tmp);
-                }
+                    pos_diff = ABS(startpos - (int)entry->match.start);
+                    size_diff = ABS(loop_diff - (int)(entry->match.end
+                                                      - entry->match.start));
 
-                match = (SwamiLoopMatch *)(match_list_last->data);
-                match_list_worst = match->quality;
-                match_list_size--;
+                    if(pos_diff < list->group_pos_diff
+                            && size_diff < list->group_size_diff)
+                    {
+                        /* may free bucket, if this was the last entry */
+                        match_list_remove(list, entry);
+                    }
+                }
             }
+        }
+    }
 
-            if(!link)
-            {
-                match = g_slice_new(SwamiLoopMatch);
-                link = g_list_append(NULL, match);
-            }
-            else
-            {
-                match = link->data;
-            }
+    /* max results reached? - Discard worst */
+    if(list->count == list->max_results)
+    {
+        match_list_remove(list, list->heap[0]);
+    }
 
-            match_list_size++;
+    entry = list->free_entries;
+    list->free_entries = entry->next;
 
-            match->start = startpos;
-            match->end = endpos;
-            match->quality = quality;
+    entry->match.start = startpos;
+    entry->match.end = endpos;
+    entry->match.quality = quality;
+    entry->seq = list->seq++;
+    entry->bucket = NULL;
+    entry->prev = NULL;
+    entry->next = NULL;
 
-            if(insert)
-            {
-                link->prev = insert->prev;
-                link->next = insert;
+    if(grouping)        /* Add to group bucket */
+    {
+        key.pos = pos;
+        key.size = size;
+        bucket = g_hash_table_lookup(list->buckets, &key);
 
-                if(insert->prev)
-                {
-                    insert->prev->next = link;
-                }
-                else
-                {
-                    match_list = link;
-                }
+        if(!bucket)
+        {
+            bucket = g_slice_new(MatchBucket);
+            bucket->pos = pos;
+            bucket->size = size;
+            bucket->entries = NULL;
+            g_hash_table_insert(list->buckets, bucket, bucket);
+        }
 
-                insert->prev = link;
-            }
-            else      /* Append */
-            {
-                if(match_list_last)
-                {
-                    match_list_last->next = link;
-                    link->prev = match_list_last;
-                }
-                else
-                {
-                    match_list = link;
-                }
+        entry->bucket = bucket;
+        entry->next = bucket->entries;
 
-                match_list_last = link;
-                match = (SwamiLoopMatch *)(match_list_last->data);
-                match_list_worst = match->quality;
-            }
+        if(bucket->entries)
+        {
+            bucket->entries->prev = entry;
         }
-    }
 
-    for(p = match_list, i = 0; p; p = g_list_delete_link(p, p), i++)
-    {
-        match = (SwamiLoopMatch *)(p->data);
+        bucket->entries = entry;
+    }
 
-#if 0   // Debugging output of results
-        printf("Quality: %0.4f start: %d end: %d\n", match->quality,
-               match->start, match->end);
+    list->heap[list->count] = entry;
+    list->count++;
+    match_heap_up(list, list->count - 1);
 
-        for(i2 = 0; i2 < analysis_window; i2++)
-        {
-            float f;
+    list->worst = list->heap[0]->match.quality;
+}
 
-            diff = sample_data[match->start - half_window + i2]
-                   - sample_data[match->end - half_window + i2];
+/* qsort() function to sort matches from best to worst */
+static int
+match_entry_compare(const void *a, const void *b)
+{
+    MatchEntry *entry_a = *(MatchEntry **)a, *entry_b = *(MatchEntry **)b;
 
-            if(diff < 0.0)
-            {
-                diff = -diff;
-            }
+    if(match_entry_worse(entry_a, entry_b))
+    {
+        return (1);
+    }
 
-            f = (float)diff * anwin_factors[i2];
-            printf("  %d diff:%0.8f * factor:%0.8f = %0.8f\n",
-                   i2, diff, anwin_factors[i2], f);
-        }
+    return (match_entry_worse(entry_b, entry_a) ? -1 : 0);
+}
 
-#endif
+/* Copy matches to the results array (best first) and free the match list.
+ * Unused result slots are zeroed out. */
+static void
+match_list_finish(MatchList *list, SwamiLoopMatch *matches)
+{
+    int i;
 
-        matches[i].start = match->start;
-        matches[i].end = match->end;
-        matches[i].quality = match->quality;
+    qsort(list->heap, list->count, sizeof(MatchEntry *), match_entry_compare);
 
-        g_slice_free(SwamiLoopMatch, match);
+    for(i = 0; i < list->count; i++)
+    {
+        matches[i] = list->heap[i]->match;
     }
 
-    for(; i < max_results; i++)
+    for(; i < list->max_results; i++)
     {
         matches[i].start = 0;
         matches[i].end = 0;
         matches[i].quality = 1.0;
     }
 
-    finder->progress = 1.0;
-    g_object_notify((GObject *)finder, "progress");
+    match_list_clear(list);
+}
 
-    g_free(anwin_factors);
+/* Quality of a single loop start/end candidate, see top of file */
+static inline float
+quality_scalar(const float *start, const float *end,
+               const float *anwin_factors, int analysis_window, int stride)
+{
+    float quality, diff;
+    int i;
+
+    for(i = 0, quality = 0.0; i < analysis_window;
+            i++, start += stride, end += stride)
+    {
+        diff = *start - *end;
+
+        if(diff < 0)
+        {
+            diff = -diff;
+        }
+
+        quality += diff * anwin_factors[i];
+    }
+
+    return (quality);
+}
+
+/* Scalar quality kernel, also handles the remainder of the SIMD kernels */
+static void
+quality_kernel_scalar(const float *start, const float *end,
+                      const float *anwin_factors, int analysis_window,
+                      int stride, float *qualities, int count)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        qualities[i] = quality_scalar(start, end + i, anwin_factors,
+                                      analysis_window, stride);
+    }
+}
+
+/* The SIMD kernels keep a running quality sum per loop end candidate in each
+ * vector lane and evaluate several vectors of consecutive candidates per pass,
+ * so each start sample and window factor is loaded once and reused across all
+ * of them.  Summation order per candidate is the same as quality_scalar() and
+ * this file is compiled with -ffp-contract=off (no fused multiply-add in
+ * either), so results are identical to the scalar kernel.  This is verified
+ * by quality_kernel_check() before a SIMD kernel is used. */
+
+#ifdef QUALITY_KERNEL_X86
+
+__attribute__((target("sse2")))
+static void
+quality_kernel_sse2(const float *start, const float *end,
+                    const float *anwin_factors, int analysis_window,
+                    int stride, float *qualities, int count)
+{
+    const __m128 signmask = _mm_set1_ps(-0.0f);
+    __m128 s, f, q0, q1, q2, q3;
+    const float *sp, *e;
+    int i, j;
+
+    /* 16 candidates per pass */
+    for(j = 0; j + 16 <= count; j += 16)
+    {
+        q0 = q1 = q2 = q3 = _mm_setzero_ps();
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = _mm_set1_ps(*sp);
+            f = _mm_set1_ps(anwin_factors[i]);
+
+            q0 = _mm_add_ps(q0, _mm_mul_ps(_mm_andnot_ps(signmask,
+                                           _mm_sub_ps(s, _mm_loadu_ps(e))), f));
+            q1 = _mm_add_ps(q1, _mm_mul_ps(_mm_andnot_ps(signmask,
+                                           _mm_sub_ps(s, _mm_loadu_ps(e + 4))), f));
+            q2 = _mm_add_ps(q2, _mm_mul_ps(_mm_andnot_ps(signmask,
+                                           _mm_sub_ps(s, _mm_loadu_ps(e + 8))), f));
+            q3 = _mm_add_ps(q3, _mm_mul_ps(_mm_andnot_ps(signmask,
+                                           _mm_sub_ps(s, _mm_loadu_ps(e + 12))), f));
+        }
+
+        _mm_storeu_ps(qualities + j, q0);
+        _mm_storeu_ps(qualities + j + 4, q1);
+        _mm_storeu_ps(qualities + j + 8, q2);
+        _mm_storeu_ps(qualities + j + 12, q3);
+    }
+
+    /* 4 candidates per pass */
+    for(; j + 4 <= count; j += 4)
+    {
+        q0 = _mm_setzero_ps();
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = _mm_set1_ps(*sp);
+            f = _mm_set1_ps(anwin_factors[i]);
+
+            q0 = _mm_add_ps(q0, _mm_mul_ps(_mm_andnot_ps(signmask,
+                                           _mm_sub_ps(s, _mm_loadu_ps(e))), f));
+        }
+
+        _mm_storeu_ps(qualities + j, q0);
+    }
+
+    quality_kernel_scalar(start, end + j, anwin_factors, analysis_window,
+                          stride, qualities + j, count - j);
+}
+
+__attribute__((target("avx2")))
+static void
+quality_kernel_avx2(const float *start, const float *end,
+                    const float *anwin_factors, int analysis_window,
+                    int stride, float *qualities, int count)
+{
+    const __m256 signmask = _mm256_set1_ps(-0.0f);
+    __m256 s, f, q0, q1, q2, q3;
+    const float *sp, *e;
+    int i, j;
+
+    /* 32 candidates per pass */
+    for(j = 0; j + 32 <= count; j += 32)
+    {
+        q0 = q1 = q2 = q3 = _mm256_setzero_ps();
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = _mm256_set1_ps(*sp);
+            f = _mm256_set1_ps(anwin_factors[i]);
+
+            q0 = _mm256_add_ps(q0, _mm256_mul_ps(_mm256_andnot_ps(signmask,
+                                                 _mm256_sub_ps(s, _mm256_loadu_ps(e))), f));
+            q1 = _mm256_add_ps(q1, _mm256_mul_ps(_mm256_andnot_ps(signmask,
+                                                 _mm256_sub_ps(s, _mm256_loadu_ps(e + 8))), f));
+            q2 = _mm256_add_ps(q2, _mm256_mul_ps(_mm256_andnot_ps(signmask,
+                                                 _mm256_sub_ps(s, _mm256_loadu_ps(e + 16))), f));
+            q3 = _mm256_add_ps(q3, _mm256_mul_ps(_mm256_andnot_ps(signmask,
+                                                 _mm256_sub_ps(s, _mm256_loadu_ps(e + 24))), f));
+        }
+
+        _mm256_storeu_ps(qualities + j, q0);
+        _mm256_storeu_ps(qualities + j + 8, q1);
+        _mm256_storeu_ps(qualities + j + 16, q2);
+        _mm256_storeu_ps(qualities + j + 24, q3);
+    }
+
+    /* 8 candidates per pass */
+    for(; j + 8 <= count; j += 8)
+    {
+        q0 = _mm256_setzero_ps();
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = _mm256_set1_ps(*sp);
+            f = _mm256_set1_ps(anwin_factors[i]);
+
+            q0 = _mm256_add_ps(q0, _mm256_mul_ps(_mm256_andnot_ps(signmask,
+                                                 _mm256_sub_ps(s, _mm256_loadu_ps(e))), f));
+        }
+
+        _mm256_storeu_ps(qualities + j, q0);
+    }
+
+    quality_kernel_scalar(start, end + j, anwin_factors, analysis_window,
+                          stride, qualities + j, count - j);
+}
+
+#endif  /* QUALITY_KERNEL_X86 */
+
+#ifdef QUALITY_KERNEL_NEON
+
+static void
+quality_kernel_neon(const float *start, const float *end,
+                    const float *anwin_factors, int analysis_window,
+                    int stride, float *qualities, int count)
+{
+    float32x4_t s, f, q0, q1, q2, q3;
+    const float *sp, *e;
+    int i, j;
+
+    /* 16 candidates per pass */
+    for(j = 0; j + 16 <= count; j += 16)
+    {
+        q0 = q1 = q2 = q3 = vdupq_n_f32(0.0f);
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = vdupq_n_f32(*sp);
+            f = vdupq_n_f32(anwin_factors[i]);
+
+            q0 = vaddq_f32(q0, vmulq_f32(vabdq_f32(s, vld1q_f32(e)), f));
+            q1 = vaddq_f32(q1, vmulq_f32(vabdq_f32(s, vld1q_f32(e + 4)), f));
+            q2 = vaddq_f32(q2, vmulq_f32(vabdq_f32(s, vld1q_f32(e + 8)), f));
+            q3 = vaddq_f32(q3, vmulq_f32(vabdq_f32(s, vld1q_f32(e + 12)), f));
+        }
+
+        vst1q_f32(qualities + j, q0);
+        vst1q_f32(qualities + j + 4, q1);
+        vst1q_f32(qualities + j + 8, q2);
+        vst1q_f32(qualities + j + 12, q3);
+    }
+
+    /* 4 candidates per pass */
+    for(; j + 4 <= count; j += 4)
+    {
+        q0 = vdupq_n_f32(0.0f);
+
+        for(i = 0, sp = start, e = end + j; i < analysis_window;
+                i++, sp += stride, e += stride)
+        {
+            s = vdupq_n_f32(*sp);
+            f = vdupq_n_f32(anwin_factors[i]);
+
+            q0 = vaddq_f32(q0, vmulq_f32(vabdq_f32(s, vld1q_f32(e)), f));
+        }
+
+        vst1q_f32(qualities + j, q0);
+    }
+
+    quality_kernel_scalar(start, end + j, anwin_factors, analysis_window,
+                          stride, qualities + j, count - j);
+}
+
+#endif  /* QUALITY_KERNEL_NEON */
+
+/* Compare the results of a SIMD quality kernel against the scalar kernel on
+ * pseudo random data, with candidate counts which exercise all code paths.
+ * Returns: TRUE if results are identical, FALSE otherwise */
+static gboolean
+quality_kernel_check(QualityKernel kernel)
+{
+    float data[256], expected[80], qualities[80];
+    float *anwin_factors;
+    guint32 seed = 1;
+    int i, stride, count;
+    gboolean retval = TRUE;
+
+    for(i = 0; i < (int)G_N_ELEMENTS(data); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (float)(seed >> 8) / (float)(1 << 24) * 2.0f - 1.0f;
+    }
+
+    anwin_factors = anwin_factors_new(17);        /* ++ alloc */
+
+    for(stride = 1; stride <= 2 && retval; stride++)
+    {
+        for(count = 1; count <= (int)G_N_ELEMENTS(qualities); count += 13)
+        {
+            quality_kernel_scalar(data, data + 40, anwin_factors, 17, stride,
+                                  expected, count);
+            (*kernel)(data, data + 40, anwin_factors, 17, stride,
+                      qualities, count);
+
+            if(memcmp(expected, qualities, count * sizeof(float)) != 0)
+            {
+                retval = FALSE;
+                break;
+            }
+        }
+    }
+
+    g_free(anwin_factors);        /* -- free */
+
+    return (retval);
+}
+
+/* Select the fastest quality kernel supported by the running CPU, which gives
+ * the same results as the scalar kernel */
+static QualityKernel
+quality_kernel_select(void)
+{
+    QualityKernel kernel = quality_kernel_scalar;
+
+#if defined(QUALITY_KERNEL_X86)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+        kernel = quality_kernel_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        kernel = quality_kernel_sse2;
+    }
+
+#elif defined(QUALITY_KERNEL_NEON)
+    kernel = quality_kernel_neon;
+#endif
+
+    if(kernel != quality_kernel_scalar && !quality_kernel_check(kernel))
+    {
+        g_critical("Loop finder SIMD quality kernel doesn't match scalar"
+                   " kernel, using scalar kernel");
+        kernel = quality_kernel_scalar;
+    }
+
+    return (kernel);
+}
+
+/* Calculate the quality of loop end candidates for a single tile.
+ * Candidates which are not valid loops are assigned INVALID_QUALITY.
+ * Returns count of valid candidates scored. */
+static int
+score_tile(FindState *state, guint64 index, float *qualities)
+{
+    const float *sample_data = state->sample_data;
+    const float *anwin_factors = state->anwin_factors;
+    int analysis_window = state->analysis_window;
+    int offset = state->half_window * state->step;
+    int startpos, endpos, first_end, count;
+    int col, i;
+
+    startpos = state->win1start
+               + (int)(index / state->tiles_per_row) * state->step;
+    col = (int)(index % state->tiles_per_row) * TILE_SIZE;
+    count = MIN(TILE_SIZE, state->win2size - col);
+    endpos = state->win2start + col;
+
+    /* First loop end position which is a valid loop (after loop start and
+     * satisfies minimum loop size) */
+    first_end = startpos + MAX(1, state->min_loop_size - 1);
+
+    for(i = 0; i < count && endpos < first_end; i++, endpos++)
+    {
+        qualities[i] = INVALID_QUALITY;
+    }
+
+    if(i < count)
+    {
+        quality_kernel(sample_data + startpos - offset,
+                       sample_data + endpos - offset,
+                       anwin_factors, analysis_window, state->step,
+                       qualities + i, count - i);
+    }
+
+    return (count - i);
+}
+
+/* Merge the scored candidates of a tile into the match list, in the same
+ * order as a serial search would. Returns FALSE if find was canceled. */
+static gboolean
+merge_tile(FindState *state, MatchList *list, guint64 index,
+           const float *qualities)
+{
+    SwamiLoopFinder *finder = state->finder;
+    int win1, win2, count, i;
+    float quality, worst;
+    gboolean full;
+
+    if(finder->cancel)          /* if cancel flag has been set, return */
+    {
+        return (FALSE);
+    }
+
+    win1 = (int)(index / state->tiles_per_row);
+    win2 = (int)(index % state->tiles_per_row) * TILE_SIZE;
+    count = MIN(TILE_SIZE, state->win2size - win2);
+
+    /* progress management, updated every progress_step candidates */
+    for(i = 0; state->progress_step
+            && state->progress_count <= (guint64)(count - i);)
+    {
+        i += (int)state->progress_count;
+        state->progress_count = state->progress_step;
+
+        finder->progress = state->progress_base + state->progress_range
+                           * (((float)win1 * state->win2size + win2 + i - 1)
+                              / ((float)state->win1size * state->win2size));
+        g_object_notify((GObject *)finder, "progress");
+    }
+
+    state->progress_count -= count - i;
+
+    worst = list->worst;
+    full = list->count == list->max_results;
+
+    for(i = 0; i < count; i++)
+    {
+        quality = qualities[i];
+
+        /* Skip if worse than the worst and result list already full (also
+         * checked by match_list_add(), but this avoids the call overhead) */
+        if(full && quality >= worst)
+        {
+            continue;
+        }
+
+        if(quality == INVALID_QUALITY)
+        {
+            continue;
+        }
+
+        match_list_add(list, state->win1start + win1 * state->step,
+                       state->win2start + win2 + i, quality);
+
+        worst = list->worst;
+        full = list->count == list->max_results;
+    }
+
+    return (TRUE);
+}
+
+/* Loop finder worker thread, scores tiles in order into free tile slots */
+static gpointer
+find_loop_worker(gpointer data)
+{
+    FindState *state = (FindState *)data;
+    FindTile *tile;
+    guint64 index;
+
+    g_mutex_lock(state->mutex);
+
+    while(!state->abort && state->next_tile < state->tile_count)
+    {
+        index = state->next_tile;
+        tile = &state->tiles[index % state->slot_count];
+
+        /* Wait for merge of the tile previously assigned to this slot */
+        if(tile->state != TILE_FREE)
+        {
+            g_cond_wait(state->free_cond, state->mutex);
+            continue;
+        }
+
+        state->next_tile++;
+        tile->state = TILE_BUSY;
+        tile->index = index;
+        g_mutex_unlock(state->mutex);
+
+        tile->scored = score_tile(state, index, tile->qualities);
+
+        g_mutex_lock(state->mutex);
+        tile->state = TILE_READY;
+        g_cond_broadcast(state->ready_cond);
+    }
+
+    g_mutex_unlock(state->mutex);
+
+    return (NULL);
+}
+
+/* Run the search with a pool of worker threads scoring tiles, while the
+ * calling thread merges them in order.  Returns FALSE if canceled. */
+static gboolean
+find_loop_threaded(FindState *state, MatchList *list, int threads)
+{
+    GThread **workers;
+    FindTile *tile;
+    GError *err = NULL;
+    guint64 index;
+    gboolean retval = TRUE;
+    int count, i;
+
+    state->mutex = g_mutex_new();
+    state->ready_cond = g_cond_new();
+    state->free_cond = g_cond_new();
+    state->next_tile = 0;
+    state->abort = FALSE;
+    state->slot_count = threads * TILE_SLOTS_PER_THREAD;
+    state->tiles = g_new0(FindTile, state->slot_count);
+
+    for(i = 0; i < state->slot_count; i++)
+    {
+        state->tiles[i].qualities = g_new(float, TILE_SIZE);
+    }
+
+    workers = g_new(GThread *, threads);
+
+    for(count = 0; count < threads; count++)
+    {
+        workers[count] = g_thread_create(find_loop_worker, state, TRUE, &err);
+
+        if(!workers[count])
+        {
+            g_warning("Failed to create loop finder thread: %s",
+                      ipatch_gerror_message(err));
+            g_clear_error(&err);
+            break;
+        }
+    }
+
+    for(index = 0; index < state->tile_count; index++)
+    {
+        tile = &state->tiles[index % state->slot_count];
+
+        if(count > 0)
+        {
+            g_mutex_lock(state->mutex);
+
+            while(tile->state != TILE_READY || tile->index != index)
+            {
+                g_cond_wait(state->ready_cond, state->mutex);
+            }
+
+            g_mutex_unlock(state->mutex);
+        }
+        else    /* No worker threads could be created, score it ourselves */
+        {
+            tile->scored = score_tile(state, index, tile->qualities);
+        }
+
+        state->candidates += tile->scored;
+
+        if(!merge_tile(state, list, index, tile->qualities))
+        {
+            retval = FALSE;
+            break;
+        }
+
+        g_mutex_lock(state->mutex);
+        tile->state = TILE_FREE;
+        g_cond_broadcast(state->free_cond);
+        g_mutex_unlock(state->mutex);
+    }
+
+    /* Stop workers (only matters if canceled) and wait for them to finish */
+    g_mutex_lock(state->mutex);
+    state->abort = TRUE;
+    g_cond_broadcast(state->free_cond);
+    g_mutex_unlock(state->mutex);
+
+    for(i = 0; i < count; i++)
+    {
+        g_thread_join(workers[i]);
+    }
+
+    g_free(workers);
+
+    for(i = 0; i < state->slot_count; i++)
+    {
+        g_free(state->tiles[i].qualities);
+    }
+
+    g_free(state->tiles);
+    g_cond_free(state->free_cond);
+    g_cond_free(state->ready_cond);
+    g_mutex_free(state->mutex);
+
+    return (retval);
+}
+
+/* Create analysis window factors array.  All values in array add up to
+ * 0.5 which when multiplied times maximum sample value difference of
+ * 2.0 (1 - -1), gives a maximum quality value (worse quality) of 1.0.
+ * Each neighboring factor towards the center point is twice the value of
+ * it's outer neighbor. */
+static float *
+anwin_factors_new(int analysis_window)
+{
+    int half_window = analysis_window / 2;                /* First half of analysis window */
+    float *anwin_factors;
+    int fract, pow2;
+    int i;
+
+    anwin_factors = g_new(float, analysis_window);        /* ++ alloc */
+
+    /* Calculate fraction divisor */
+    for(i = 0, fract = 0, pow2 = 1; i <= half_window; i++, pow2 *= 2)
+    {
+        fract += pow2;
+
+        if(i < half_window)
+        {
+            fract += pow2;
+        }
+    }
+
+    /* Even windows are asymetrical, subtract 1 */
+    if(!(analysis_window & 1))
+    {
+        fract--;
+    }
+
+    /* Calculate values for 1st half of window and center of window */
+    for(i = 0, pow2 = 1; i <= half_window; i++, pow2 *= 2)
+    {
+        anwin_factors[i] = (float)(pow2 * 0.5 / fract);
+    }
+
+    /* Copy values for 2nd half of window */
+    for(i = 0; half_window + i + 1 < analysis_window; i++)
+    {
+        anwin_factors[half_window + i + 1] = anwin_factors[half_window - i - 1];
+    }
+
+    return (anwin_factors);       /* !! caller takes over allocation */
+}
+
+/* Initialize the state of an exhaustive search of the given windows, loop
+ * start positions and analysis window taps are step samples apart */
+static void
+find_state_init(FindState *state, SwamiLoopFinder *finder,
+                const float *sample_data, const float *anwin_factors,
+                int analysis_window, int min_loop_size, int step,
+                int win1start, int win1end, int win2start, int win2end)
+{
+    state->finder = finder;
+    state->sample_data = sample_data;
+    state->anwin_factors = anwin_factors;
+    state->analysis_window = analysis_window;
+    state->half_window = analysis_window / 2;
+    state->min_loop_size = min_loop_size;
+    state->step = step;
+    state->win1start = win1start;
+    state->win1size = (win1end - win1start) / step + 1;
+    state->win2start = win2start;
+    state->win2size = win2end - win2start + 1;
+
+    /* Search space is split into tiles of up to TILE_SIZE loop end candidates
+     * for a single loop start position, in row major order */
+    state->tiles_per_row = (state->win2size + TILE_SIZE - 1) / TILE_SIZE;
+    state->tile_count = (guint64)state->win1size * state->tiles_per_row;
+
+    /* Control of progress update */
+    state->progress_step = (guint64)(((float)state->win1size * (float)state->win2size) / 1000.0);      /* Max. 1000 progress callbacks */
+    state->progress_count = state->progress_step;
+    state->progress_base = 0.0;
+    state->progress_range = 1.0;
+}
+
+/* Exhaustively search all tiles of a search state.  Returns FALSE if
+ * canceled. */
+static gboolean
+search_tiles(FindState *state, MatchList *list)
+{
+    SwamiLoopFinder *finder = state->finder;
+    float *qualities;
+    guint64 index;
+    gboolean finished = TRUE;
+
+    /* Scoring is split across worker threads, merging is always done in
+     * serial search order, so results are identical regardless of threads */
+    if(finder->threads > 1 && state->tile_count > 1)
+    {
+        return (find_loop_threaded(state, list,
+                                   (int)MIN((guint64)finder->threads,
+                                            state->tile_count)));
+    }
+
+    qualities = g_new(float, TILE_SIZE);          /* ++ alloc */
+
+    for(index = 0; index < state->tile_count; index++)
+    {
+        state->candidates += score_tile(state, index, qualities);
+
+        if(!merge_tile(state, list, index, qualities))
+        {
+            finished = FALSE;
+            break;
+        }
+    }
+
+    g_free(qualities);            /* -- free */
+
+    return (finished);
+}
+
+/* Initialize the parameters of the coarse level of a hierarchical search,
+ * with a decimation factor of 2^shift.  Returns FALSE if the search windows
+ * are empty at this level. */
+static gboolean
+coarse_level_init(CoarseLevel *level, SwamiLoopFinder *finder, int shift,
+                  int win1start, int win1end, int win2start, int win2end)
+{
+    int factor = 1 << shift;
+    int size, before, after;
+
+    level->shift = shift;
+    level->analysis_window = MIN(finder->analysis_window,
+                                 MAX(HIERARCHY_MIN_WINDOW,
+                                     finder->analysis_window >> shift));
+
+    /* Size of moving average data and extent of analysis window around a
+     * loop point (window taps are spaced by the decimation factor) */
+    size = (int)finder->sample_size - factor + 1;
+    before = (level->analysis_window / 2) * factor;
+    after = (level->analysis_window - level->analysis_window / 2 - 1) * factor;
+
+    level->win1start = MAX(win1start, before);
+    level->win1end = MIN(win1end, size - 1 - after);
+    level->win2start = MAX(win2start, before);
+    level->win2end = MIN(win2end, size - 1 - after);
+
+    return (level->win1start <= level->win1end
+            && level->win2start <= level->win2end);
+}
+
+/* Get the decimation shift to use for a hierarchical search, 0 if the search
+ * space is small enough to be searched exhaustively. */
+static int
+hierarchy_shift(SwamiLoopFinder *finder, int win1start, int win1end,
+                int win2start, int win2end)
+{
+    CoarseLevel level;
+    int shift;
+
+    if((guint64)(win1end - win1start + 1) * (win2end - win2start + 1)
+            <= HIERARCHY_MAX_COARSE)
+    {
+        return (0);
+    }
+
+    for(shift = 1; shift <= HIERARCHY_MAX_SHIFT; shift++)
+    {
+        /* Search windows empty at this level? - Use previous level */
+        if(!coarse_level_init(&level, finder, shift, win1start, win1end,
+                              win2start, win2end))
+        {
+            return (shift - 1);
+        }
+
+        if((guint64)(((level.win1end - level.win1start) >> shift) + 1)
+                * (level.win2end - level.win2start + 1) <= HIERARCHY_MAX_COARSE)
+        {
+            break;
+        }
+    }
+
+    return (MIN(shift, HIERARCHY_MAX_SHIFT));
+}
+
+/* Refine the candidate regions found by the coarse search, by scoring all full
+ * resolution candidates within 1 decimation factor of loop start and
+ * HIERARCHY_SIZE_RADIUS of loop size of each region.  Regions are refined one
+ * at a time, they never overlap since the coarse result list keeps only one
+ * match per group of (2 * factor) starts and (2 * HIERARCHY_SIZE_RADIUS + 1)
+ * sizes.  Progress is updated from HIERARCHY_PROGRESS to 1.0.  Returns count
+ * of candidates scored or -1 if canceled. */
+static gint64
+refine_regions(SwamiLoopFinder *finder, int factor, SwamiLoopMatch *regions,
+               int count, MatchList *list, const float *anwin_factors,
+               int win1start, int win1end, int win2start, int win2end)
+{
+    int half_window = finder->analysis_window / 2;
+    float qualities[HIERARCHY_SIZE_RADIUS * 2 + 1];
+    int i, j, n, startpos, size, lo, hi, percent, last_percent = 0;
+    gint64 scored = 0;
+
+    for(i = 0; i < count; i++)
+    {
+        if(finder->cancel)
+        {
+            return (-1);
+        }
+
+        size = (int)regions[i].end - (int)regions[i].start;
+
+        for(startpos = MAX((int)regions[i].start - factor + 1, win1start);
+                startpos <= MIN((int)regions[i].start + factor - 1, win1end);
+                startpos++)
+        {
+            lo = MAX(startpos + size - HIERARCHY_SIZE_RADIUS, win2start);
+            lo = MAX(lo, startpos + MAX(1, finder->min_loop_size - 1));
+            hi = MIN(startpos + size + HIERARCHY_SIZE_RADIUS, win2end);
+
+            if(lo > hi)
+            {
+                continue;
+            }
+
+            n = hi - lo + 1;
+
+            quality_kernel(finder->sample_data + startpos - half_window,
+                           finder->sample_data + lo - half_window,
+                           anwin_factors, finder->analysis_window, 1,
+                           qualities, n);
+
+            for(j = 0; j < n; j++)
+            {
+                match_list_add(list, startpos, lo + j, qualities[j]);
+            }
+
+            scored += n;
+        }
+
+        /* update progress every percent of the regions */
+        percent = (int)((gint64)(i + 1) * 100 / count);
+
+        if(percent != last_percent)
+        {
+            last_percent = percent;
+            finder->progress = HIERARCHY_PROGRESS
+                               + (1.0 - HIERARCHY_PROGRESS) * percent / 100;
+            g_object_notify((GObject *)finder, "progress");
+        }
+    }
+
+    return (scored);
+}
+
+/* Coarse to fine hierarchical search.  A moving average (box filter the size
+ * of the decimation factor) of the sample data is searched at the coarse
+ * level, with loop start positions and analysis window taps spaced by the
+ * decimation factor, but at every loop end position.  Loop sizes are therefore
+ * searched at full resolution and low frequency content of the loop points is
+ * compared at the correct phase.  The best candidate regions are then refined
+ * at full resolution.  Returns FALSE if canceled. */
+static gboolean
+find_loop_hierarchical(FindState *state, MatchList *list, int shift,
+                       int win1start, int win1end, int win2start, int win2end)
+{
+    SwamiLoopFinder *finder = state->finder;
+    CoarseLevel level;
+    MatchList region_list;
+    SwamiLoopMatch *regions;
+    float *avg_data, *coarse_factors, *anwin_factors;
+    int factor = 1 << shift;
+    int size, region_count, count = 0, i;
+    gboolean finished = TRUE;
+    gint64 scored;
+    double sum;
+
+    coarse_level_init(&level, finder, shift, win1start, win1end,
+                      win2start, win2end);
+
+    /* Moving average of factor samples at every sample position */
+    size = (int)finder->sample_size - factor + 1;
+    avg_data = g_new(float, size);                /* ++ alloc */
+
+    for(i = 0, sum = 0.0; i < factor - 1; i++)
+    {
+        sum += finder->sample_data[i];
+    }
+
+    for(i = 0; i < size; i++)
+    {
+        sum += finder->sample_data[i + factor - 1];
+        avg_data[i] = (float)(sum / factor);
+        sum -= finder->sample_data[i];
+    }
+
+    coarse_factors = anwin_factors_new(level.analysis_window);   /* ++ alloc */
+
+    region_count = finder->max_results * HIERARCHY_REGIONS;
+    regions = g_new(SwamiLoopMatch, region_count);             /* ++ alloc */
+
+    /* Search the coarse level, neighboring candidates are grouped so the
+     * regions are distinct (refinement covers the neighborhood of each) */
+    find_state_init(state, finder, avg_data, coarse_factors,
+                    level.analysis_window, finder->min_loop_size, factor,
+                    level.win1start, level.win1end,
+                    level.win2start, level.win2end);
+    state->progress_range = HIERARCHY_PROGRESS;
+
+    match_list_init(&region_list, region_count, factor * 2,
+                    HIERARCHY_SIZE_RADIUS * 2 + 1);
+
+    if(!search_tiles(state, &region_list))
+    {
+        match_list_clear(&region_list);
+        finished = FALSE;
+    }
+    else
+    {
+        count = region_list.count;
+        match_list_finish(&region_list, regions);
+    }
+
+    g_free(coarse_factors);       /* -- free */
+    g_free(avg_data);             /* -- free */
+
+    /* Refine candidate regions at full resolution */
+    if(finished)
+    {
+        anwin_factors = anwin_factors_new(finder->analysis_window);   /* ++ alloc */
+
+        scored = refine_regions(finder, factor, regions, count, list,
+                                anwin_factors, win1start, win1end,
+                                win2start, win2end);
+        g_free(anwin_factors);    /* -- free */
+
+        if(scored < 0)
+        {
+            finished = FALSE;
+        }
+        else
+        {
+            state->candidates += scored;
+        }
+    }
+
+    g_free(regions);              /* -- free */
+
+    return (finished);
+}
+
+#ifdef FFTW_SUPPORT
+
+/* Add a loop size to the list of peaks (sorted by difference, best first),
+ * if it is better than the worst one or the list isn't full yet */
+static void
+correlation_peak_add(CorrelationPeak *peaks, int *count, int size, double diff)
+{
+    int i;
+
+    if(*count == CORRELATION_PEAKS && diff >= peaks[*count - 1].diff)
+    {
+        return;
+    }
+
+    i = (*count < CORRELATION_PEAKS) ? (*count)++ : *count - 1;
+
+    for(; i > 0 && peaks[i - 1].diff > diff; i--)
+    {
+        peaks[i] = peaks[i - 1];
+    }
+
+    peaks[i].size = size;
+    peaks[i].diff = diff;
+}
+
+/* Score the loop sizes found for a correlation block with the analysis window,
+ * for every loop start position of the block.  The size radius around
+ * neighboring peaks can overlap, overlapping sizes are only scored once so
+ * no candidate is added to the match list twice.  Returns count of
+ * candidates scored. */
+static gint64
+score_correlation_block(SwamiLoopFinder *finder, MatchList *list,
+                        const float *anwin_factors, int blockstart,
+                        int blocksize, CorrelationPeak *peaks, int count,
+                        int win2start, int win2end)
+{
+    int half_window = finder->analysis_window / 2;
+    int min_size = MAX(1, finder->min_loop_size - 1);
+    float qualities[2 * CORRELATION_SIZE_RADIUS + 1];
+    int sizes[CORRELATION_PEAKS];
+    int i, j, n, startpos, endpos, end, lowsize, highsize, prevsize;
+    gint64 scored = 0;
+
+    /* peak loop sizes in ascending order */
+    for(i = 0; i < count; i++)
+    {
+        for(j = i; j > 0 && sizes[j - 1] > peaks[i].size; j--)
+        {
+            sizes[j] = sizes[j - 1];
+        }
+
+        sizes[j] = peaks[i].size;
+    }
+
+    for(i = 0, prevsize = G_MININT; i < count; i++)
+    {
+        /* sizes up to prevsize were already scored for the previous peak */
+        lowsize = MAX(sizes[i] - CORRELATION_SIZE_RADIUS, min_size);
+        lowsize = MAX(lowsize, prevsize + 1);
+        highsize = sizes[i] + CORRELATION_SIZE_RADIUS;
+
+        if(lowsize > highsize)
+        {
+            continue;
+        }
+
+        prevsize = highsize;
+
+        for(startpos = blockstart; startpos < blockstart + blocksize; startpos++)
+        {
+            endpos = MAX(startpos + lowsize, win2start);
+            end = MIN(startpos + highsize, win2end);
+
+            if(endpos > end)
+            {
+                continue;
+            }
+
+            n = end - endpos + 1;
+
+            quality_kernel(finder->sample_data + startpos - half_window,
+                           finder->sample_data + endpos - half_window,
+                           anwin_factors, finder->analysis_window, 1,
+                           qualities, n);
+
+            for(j = 0; j < n; j++)
+            {
+                match_list_add(list, startpos, endpos + j, qualities[j]);
+            }
+
+            scored += n;
+        }
+    }
+
+    return (scored);
+}
+
+/* FFT cross-correlation search.  The loop start window is split into blocks
+ * of CORRELATION_BLOCK positions.  For each block the mean squared difference
+ * of the block (including the analysis window around each position) and the
+ * loop end window is calculated at every loop size from the cross-correlation,
+ * the transform of the loop end window is only calculated once.  The
+ * CORRELATION_PEAKS local minima of the difference are then scored.
+ * Returns FALSE if canceled. */
+static gboolean
+find_loop_correlation(FindState *state, MatchList *list, int win1start,
+                      int win1end, int win2start, int win2end)
+{
+    SwamiLoopFinder *finder = state->finder;
+    const float *sample_data = finder->sample_data;
+    int analysis_window = finder->analysis_window;
+    int half_window = analysis_window / 2;
+    int min_size = MAX(1, finder->min_loop_size - 1);
+    CorrelationPeak peaks[CORRELATION_PEAKS];
+    float *anwin_factors, *block, *corr;
+    fftwf_complex *wspec, *bspec;
+    fftwf_plan block_plan, corr_plan;
+    double *wenergy, *benergy;
+    int win1size, win2size, blocks, blocklen, winlen, fftsize, bins;
+    int b, blockstart, blocksize, size, m, mstart, mend, t1, t2, count, i;
+    double diff, prevdiff, nextdiff, c;
+    gboolean finished = TRUE;
+    float re, im;
+
+    win1size = win1end - win1start + 1;
+    win2size = win2end - win2start + 1;
+    blocks = (win1size + CORRELATION_BLOCK - 1) / CORRELATION_BLOCK;
+
+    /* Block and loop end window data include the analysis window around each
+     * position, FFT size is large enough for a linear correlation */
+    blocklen = MIN(CORRELATION_BLOCK, win1size) + analysis_window - 1;
+    winlen = win2size + analysis_window - 1;
+
+    for(fftsize = 1; fftsize < blocklen + winlen - 1; fftsize *= 2);
+
+    bins = fftsize / 2 + 1;
+
+    block = fftwf_malloc(sizeof(float) * fftsize);                /* ++ alloc */
+    corr = fftwf_malloc(sizeof(float) * fftsize);                 /* ++ alloc */
+    wspec = fftwf_malloc(sizeof(fftwf_complex) * bins);           /* ++ alloc */
+    bspec = fftwf_malloc(sizeof(fftwf_complex) * bins);           /* ++ alloc */
+
+    swami_fftw_planner_lock();
+    block_plan = fftwf_plan_dft_r2c_1d(fftsize, block, bspec, FFTW_ESTIMATE);
+    corr_plan = fftwf_plan_dft_c2r_1d(fftsize, bspec, corr, FFTW_ESTIMATE);
+    swami_fftw_planner_unlock();
+
+    /* Transform of loop end window (block plan is used, with new arrays) */
+    memset(block, 0, sizeof(float) * fftsize);
+    memcpy(block, sample_data + win2start - half_window, sizeof(float) * winlen);
+    fftwf_execute_dft_r2c(block_plan, block, wspec);
+
+    /* Cumulative energy of loop end window and blocks */
+    wenergy = g_new(double, winlen + 1);                          /* ++ alloc */
+    benergy = g_new(double, blocklen + 1);                        /* ++ alloc */
+
+    for(i = 0, wenergy[0] = 0.0; i < winlen; i++)
+    {
+        wenergy[i + 1] = wenergy[i] + (double)block[i] * block[i];
+    }
+
+    anwin_factors = anwin_factors_new(analysis_window);           /* ++ alloc */
+
+    for(b = 0; b < blocks; b++)
+    {
+        if(finder->cancel)
+        {
+            finished = FALSE;
+            break;
+        }
+
+        blockstart = win1start + b * CORRELATION_BLOCK;
+        blocksize = MIN(CORRELATION_BLOCK, win1end - blockstart + 1);
+        blocklen = blocksize + analysis_window - 1;
+
+        memset(block, 0, sizeof(float) * fftsize);
+        memcpy(block, sample_data + blockstart - half_window,
+               sizeof(float) * blocklen);
+
+        for(i = 0, benergy[0] = 0.0; i < blocklen; i++)
+        {
+            benergy[i + 1] = benergy[i] + (double)block[i] * block[i];
+        }
+
+        /* Cross-correlation: inverse transform of conj(block) * window */
+        fftwf_execute(block_plan);
+
+        for(i = 0; i < bins; i++)
+        {
+            re = bspec[i][0] * wspec[i][0] + bspec[i][1] * wspec[i][1];
+            im = bspec[i][0] * wspec[i][1] - bspec[i][1] * wspec[i][0];
+            bspec[i][0] = re;
+            bspec[i][1] = im;
+        }
+
+        fftwf_execute(corr_plan);
+
+        /* Offset m of block in loop end window, for loop sizes with at least
+         * one valid loop in the block */
+        mstart = MAX(1 - blocksize, blockstart + min_size - win2start);
+        mend = win2size - 1;
+        count = 0;
+        prevdiff = G_MAXDOUBLE;
+        diff = G_MAXDOUBLE;
+
+        for(m = mstart; m <= mend + 1; m++)
+        {
+            /* Mean squared difference of overlapping part of block and
+             * window, from correlation and energies */
+            if(m <= mend)
+            {
+                t1 = MAX(0, -m);
+                t2 = MIN(blocklen, winlen - m);
+                c = corr[(m + fftsize) % fftsize] / (double)fftsize;
+                nextdiff = (benergy[t2] - benergy[t1]
+                            + wenergy[m + t2] - wenergy[m + t1] - 2.0 * c)
+                           / (t2 - t1);
+            }
+            else
+            {
+                nextdiff = G_MAXDOUBLE;
+            }
+
+            /* Local minimum at previous offset? */
+            if(m > mstart && diff <= prevdiff && diff < nextdiff)
+            {
+                size = win2start + m - 1 - blockstart;
+                correlation_peak_add(peaks, &count, size, diff);
+            }
+
+            prevdiff = diff;
+            diff = nextdiff;
+        }
+
+        state->candidates += score_correlation_block(finder, list,
+                             anwin_factors, blockstart, blocksize,
+                             peaks, count, win2start, win2end);
+
+        finder->progress = (float)(b + 1) / blocks;
+        g_object_notify((GObject *)finder, "progress");
+    }
+
+    g_free(anwin_factors);                                        /* -- free */
+    g_free(benergy);                                              /* -- free */
+    g_free(wenergy);                                              /* -- free */
+
+    swami_fftw_planner_lock();
+    fftwf_destroy_plan(corr_plan);
+    fftwf_destroy_plan(block_plan);
+    swami_fftw_planner_unlock();
+
+    fftwf_free(bspec);                                            /* -- free */
+    fftwf_free(wspec);                                            /* -- free */
+    fftwf_free(corr);                                             /* -- free */
+    fftwf_free(block);                                            /* -- free */
+
+    return (finished);
+}
+
+#endif  /* FFTW_SUPPORT */
+
+/* the loop finder algorithm, parameters should be varified before calling. */
+static void
+find_loop(SwamiLoopFinder *finder, SwamiLoopMatch *matches)
+{
+    FindState state;
+    MatchList list;
+    int win1start, win1end, win2start, win2end;           /* Search window parameters */
+    float *anwin_factors;
+    gboolean finished;
+    int shift = 0;
+#ifdef FFTW_SUPPORT
+    gboolean correlation = FALSE;
+#endif
+
+    /* Swap start/ends as needed */
+    win1start = MIN(finder->window1_start, finder->window1_end);
+    win1end = MAX(finder->window1_start, finder->window1_end);
+    win2start = MIN(finder->window2_start, finder->window2_end);
+    win2end = MAX(finder->window2_start, finder->window2_end);
+
+    /* Swap ranges if needed, so that window1 is loop start search */
+    if(win1start > win2start)
+    {
+        int tmp;
+
+        tmp = win1start;
+        win1start = win2start;
+        win2start = tmp;
+
+        tmp = win1end;
+        win1end = win2end;
+        win2end = tmp;
+    }
+
+    finder->progress = 0.0;
+    g_object_notify((GObject *)finder, "progress");
+
+    state.candidates = 0;
+
+    match_list_init(&list, finder->max_results, finder->group_pos_diff,
+                    finder->group_size_diff);
+
+    if(finder->search_mode == SWAMI_LOOP_FINDER_SEARCH_HIERARCHICAL)
+    {
+        shift = hierarchy_shift(finder, win1start, win1end, win2start, win2end);
+    }
+
+#ifdef FFTW_SUPPORT
+    /* Correlation search is only worth it for large search spaces */
+    if(finder->search_mode == SWAMI_LOOP_FINDER_SEARCH_CORRELATION)
+    {
+        correlation = (guint64)(win1end - win1start + 1)
+                      * (win2end - win2start + 1) > CORRELATION_MIN_SEARCH;
+    }
+#endif
+
+    if(shift > 0)
+    {
+        state.finder = finder;
+        finished = find_loop_hierarchical(&state, &list, shift, win1start,
+                                          win1end, win2start, win2end);
+    }
+#ifdef FFTW_SUPPORT
+    else if(correlation)
+    {
+        state.finder = finder;
+        finished = find_loop_correlation(&state, &list, win1start, win1end,
+                                         win2start, win2end);
+    }
+#endif
+    else
+    {
+        anwin_factors = anwin_factors_new(finder->analysis_window);   /* ++ alloc */
+
+        find_state_init(&state, finder, finder->sample_data, anwin_factors,
+                        finder->analysis_window, finder->min_loop_size, 1,
+                        win1start, win1end, win2start, win2end);
+
+        finished = search_tiles(&state, &list);
+
+        g_free(anwin_factors);      /* -- free */
+    }
+
+    finder->candidates = state.candidates;
+
+    if(!finished)
+    {
+        match_list_clear(&list);
+        return;
+    }
+
+    match_list_finish(&list, matches);
+
+    finder->progress = 1.0;
+    g_object_notify((GObject *)finder, "progress");
 }
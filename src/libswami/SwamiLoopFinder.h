@@ -36,6 +36,14 @@ typedef struct _SwamiLoopFinderClass SwamiLoopFinderClass;
 #define SWAMI_IS_LOOP_FINDER(obj) \
   (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SWAMI_TYPE_LOOP_FINDER))
 
+/* Loop finder search modes */
+typedef enum
+{
+    SWAMI_LOOP_FINDER_SEARCH_EXHAUSTIVE,	/* compare all start/end candidates */
+    SWAMI_LOOP_FINDER_SEARCH_HIERARCHICAL,	/* coarse search, refined at full resolution */
+    SWAMI_LOOP_FINDER_SEARCH_CORRELATION	/* FFT cross-correlation loop sizes (FFTW) */
+} SwamiLoopFinderSearchMode;
+
 /* Loop finder object */
 struct _SwamiLoopFinder
 {
@@ -59,6 +67,9 @@ struct _SwamiLoopFinder
     int group_pos_diff;		/* min pos diff of loops for separate groups */
     int group_size_diff;		/* min size diff of loops for separate groups */
     guint exectime;		/* execution time in milliseconds */
+    int threads;			/* number of threads to use for search */
+    int search_mode;		/* SwamiLoopFinderSearchMode */
+    guint64 candidates;		/* count of candidates evaluated by last find */
 
     SwamiLoopResults *results;	/* results object */
 };
@@ -0,0 +1,667 @@
+/*
+ * SwamiLoopFinderBatch.c - Batch loop finder for multiple samples
+ *
+ * Swami
+ * Copyright (C) 1999-2014 Element Green <element@elementsofsound.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA or point your web browser to http://www.gnu.org.
+ */
+/*
+ * Runs loop finds on a list of samples, spread across a number of worker
+ * threads.  Each worker takes the next pending sample, creates a
+ * SwamiLoopFinder for it with the parameters of the "params" loop finder
+ * (loop search windows cover the whole sample) and emits "sample-done" with
+ * the results once the find is complete.
+ */
+#include <stdio.h>
+
+#include <libinstpatch/libinstpatch.h>
+
+#include "SwamiLoopFinderBatch.h"
+#include "SwamiLog.h"
+#include "marshals.h"
+#include "i18n.h"
+
+#define DEFAULT_THREADS		2
+#define MAX_THREADS		64
+
+enum
+{
+    PROP_0,
+    PROP_PARAMS,			/* SwamiLoopFinder with search parameters */
+    PROP_THREADS,			/* number of worker threads */
+    PROP_ACTIVE,			/* TRUE if batch is in progress */
+    PROP_CANCEL,			/* set to TRUE to cancel in progress batch */
+    PROP_PROGRESS,		/* aggregate progress of batch (0.0 - 1.0) */
+    PROP_TOTAL,			/* total count of samples */
+    PROP_COMPLETED,		/* count of completed samples */
+    PROP_FAILED,			/* count of failed samples */
+    PROP_THROUGHPUT		/* completed samples per second */
+};
+
+enum
+{
+    SAMPLE_DONE,
+    LAST_SIGNAL
+};
+
+static void swami_loop_finder_batch_set_property(GObject *object,
+        guint property_id,
+        const GValue *value,
+        GParamSpec *pspec);
+static void swami_loop_finder_batch_get_property(GObject *object,
+        guint property_id,
+        GValue *value,
+        GParamSpec *pspec);
+static void swami_loop_finder_batch_init(SwamiLoopFinderBatch *batch);
+static void swami_loop_finder_batch_finalize(GObject *object);
+static SwamiLoopFinder *batch_finder_new(SwamiLoopFinderBatch *batch,
+        IpatchSample *sample);
+static gboolean batch_find_sample(SwamiLoopFinderBatch *batch,
+                                  IpatchSample *sample,
+                                  SwamiLoopResults **results,
+                                  gboolean *canceled);
+static gpointer batch_worker(gpointer data);
+
+static guint batch_signals[LAST_SIGNAL] = { 0 };
+
+
+G_DEFINE_TYPE(SwamiLoopFinderBatch, swami_loop_finder_batch, G_TYPE_OBJECT);
+
+
+static void
+swami_loop_finder_batch_class_init(SwamiLoopFinderBatchClass *klass)
+{
+    GObjectClass *obj_class = G_OBJECT_CLASS(klass);
+
+    obj_class->set_property = swami_loop_finder_batch_set_property;
+    obj_class->get_property = swami_loop_finder_batch_get_property;
+    obj_class->finalize = swami_loop_finder_batch_finalize;
+
+    /* emitted from a worker thread, results is NULL if find failed (also
+     * counted by "failed" property) or there were no results, not emitted
+     * for samples whose find was canceled */
+    batch_signals[SAMPLE_DONE] =
+        g_signal_new("sample-done", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_FIRST,
+                     G_STRUCT_OFFSET(SwamiLoopFinderBatchClass, sample_done),
+                     NULL, NULL,
+                     swami_marshal_VOID__OBJECT_OBJECT, G_TYPE_NONE,
+                     2, IPATCH_TYPE_SAMPLE, SWAMI_TYPE_LOOP_RESULTS);
+
+    g_object_class_install_property(obj_class, PROP_PARAMS,
+                                    g_param_spec_object("params", _("Parameters"),
+                                            _("Loop finder with search parameters"),
+                                            SWAMI_TYPE_LOOP_FINDER, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_THREADS,
+                                    g_param_spec_int("threads", _("Threads"),
+                                            _("Number of worker threads"),
+                                            1, MAX_THREADS, DEFAULT_THREADS,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_ACTIVE,
+                                    g_param_spec_boolean("active", _("Active"), _("Active"),
+                                            FALSE, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_CANCEL,
+                                    g_param_spec_boolean("cancel", _("Cancel"), _("Cancel"),
+                                            FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_PROGRESS,
+                                    g_param_spec_float("progress", _("Progress"), _("Progress"),
+                                            0.0, 1.0, 0.0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_TOTAL,
+                                    g_param_spec_int("total", _("Total"),
+                                            _("Total count of samples"),
+                                            0, G_MAXINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_COMPLETED,
+                                    g_param_spec_int("completed", _("Completed"),
+                                            _("Count of completed samples"),
+                                            0, G_MAXINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_FAILED,
+                                    g_param_spec_int("failed", _("Failed"),
+                                            _("Count of samples which failed"),
+                                            0, G_MAXINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_THROUGHPUT,
+                                    g_param_spec_float("throughput", _("Throughput"),
+                                            _("Completed samples per second"),
+                                            0.0, G_MAXFLOAT, 0.0, G_PARAM_READABLE));
+}
+
+static void
+swami_loop_finder_batch_set_property(GObject *object, guint property_id,
+                                     const GValue *value, GParamSpec *pspec)
+{
+    SwamiLoopFinderBatch *batch = SWAMI_LOOP_FINDER_BATCH(object);
+    SwamiLoopFinder *params;
+
+    switch(property_id)
+    {
+    case PROP_PARAMS:
+        params = g_value_dup_object(value);     /* ++ ref new params */
+
+        g_mutex_lock(batch->mutex);
+
+        if(batch->params)
+        {
+            g_object_unref(batch->params);    /* -- unref old params */
+        }
+
+        batch->params = params;
+        g_mutex_unlock(batch->mutex);
+        break;
+
+    case PROP_THREADS:
+        batch->threads = g_value_get_int(value);
+        break;
+
+    case PROP_CANCEL:
+        if(g_value_get_boolean(value))
+        {
+            swami_loop_finder_batch_cancel(batch);
+        }
+
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+swami_loop_finder_batch_get_property(GObject *object, guint property_id,
+                                     GValue *value, GParamSpec *pspec)
+{
+    SwamiLoopFinderBatch *batch = SWAMI_LOOP_FINDER_BATCH(object);
+
+    switch(property_id)
+    {
+    case PROP_PARAMS:
+        g_mutex_lock(batch->mutex);
+        g_value_set_object(value, batch->params);
+        g_mutex_unlock(batch->mutex);
+        break;
+
+    case PROP_THREADS:
+        g_value_set_int(value, batch->threads);
+        break;
+
+    case PROP_ACTIVE:
+        g_value_set_boolean(value, batch->active);
+        break;
+
+    case PROP_CANCEL:
+        g_value_set_boolean(value, batch->cancel);
+        break;
+
+    case PROP_PROGRESS:
+        g_value_set_float(value, swami_loop_finder_batch_get_progress(batch));
+        break;
+
+    case PROP_TOTAL:
+        g_value_set_int(value, batch->total);
+        break;
+
+    case PROP_COMPLETED:
+        g_value_set_int(value, batch->completed);
+        break;
+
+    case PROP_FAILED:
+        g_value_set_int(value, batch->failed);
+        break;
+
+    case PROP_THROUGHPUT:
+        g_value_set_float(value, swami_loop_finder_batch_get_throughput(batch));
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+swami_loop_finder_batch_init(SwamiLoopFinderBatch *batch)
+{
+    batch->mutex = g_mutex_new();
+    batch->done_cond = g_cond_new();
+    batch->threads = DEFAULT_THREADS;
+    batch->timer = g_timer_new();
+    g_timer_stop(batch->timer);
+}
+
+static void
+swami_loop_finder_batch_finalize(GObject *object)
+{
+    SwamiLoopFinderBatch *batch = SWAMI_LOOP_FINDER_BATCH(object);
+    GList *p;
+
+    for(p = batch->samples; p; p = p->next)
+    {
+        g_object_unref(p->data);
+    }
+
+    g_list_free(batch->samples);
+
+    if(batch->params)
+    {
+        g_object_unref(batch->params);
+    }
+
+    g_timer_destroy(batch->timer);
+    g_cond_free(batch->done_cond);
+    g_mutex_free(batch->mutex);
+
+    if(G_OBJECT_CLASS(swami_loop_finder_batch_parent_class)->finalize)
+    {
+        G_OBJECT_CLASS(swami_loop_finder_batch_parent_class)->finalize(object);
+    }
+}
+
+/**
+ * swami_loop_finder_batch_new:
+ * @samples: List of samples to find loops for (non #IpatchSample items are
+ *   ignored, finds of samples without sample data fail)
+ * @params: Loop finder whose parameters ("max-results", "analysis-window",
+ *   "min-loop-size", "group-pos-diff", "group-size-diff", "threads" and
+ *   "search-mode") are used for every sample or %NULL to use defaults
+ *
+ * Create a new batch loop finder object.  The loop search windows of
+ * @params are not used, each sample is searched completely.
+ *
+ * Returns: New object of type #SwamiLoopFinderBatch
+ */
+SwamiLoopFinderBatch *
+swami_loop_finder_batch_new(IpatchList *samples, SwamiLoopFinder *params)
+{
+    SwamiLoopFinderBatch *batch;
+    GList *p;
+
+    g_return_val_if_fail(IPATCH_IS_LIST(samples), NULL);
+    g_return_val_if_fail(!params || SWAMI_IS_LOOP_FINDER(params), NULL);
+
+    batch = g_object_new(SWAMI_TYPE_LOOP_FINDER_BATCH, "params", params, NULL);
+
+    for(p = samples->items; p; p = p->next)
+    {
+        if(IPATCH_IS_SAMPLE(p->data))
+        {
+            batch->samples = g_list_prepend(batch->samples,
+                                            g_object_ref(p->data));  /* ++ ref */
+            batch->total++;
+        }
+    }
+
+    batch->samples = g_list_reverse(batch->samples);
+
+    return (batch);
+}
+
+/**
+ * swami_loop_finder_batch_start:
+ * @batch: Batch loop finder object
+ * @err: Location to store error info or %NULL to ignore
+ *
+ * Start a batch loop find.  This function returns immediately, the samples
+ * are searched by "threads" worker threads.  The "sample-done" signal is
+ * emitted, from the worker thread, for each sample as its find completes.
+ * The "active" property is set to %FALSE (and notified from the last worker
+ * thread) once all samples have been searched or the batch was canceled.
+ * A batch can be started again once it is no longer active.
+ *
+ * Returns: %TRUE on success, %FALSE if batch is already active or no worker
+ *   threads could be created (in which case @err may be set)
+ */
+gboolean
+swami_loop_finder_batch_start(SwamiLoopFinderBatch *batch, GError **err)
+{
+    int i, threads;
+
+    g_return_val_if_fail(SWAMI_IS_LOOP_FINDER_BATCH(batch), FALSE);
+    g_return_val_if_fail(!err || !*err, FALSE);
+
+    g_mutex_lock(batch->mutex);
+
+    if(batch->active)
+    {
+        g_mutex_unlock(batch->mutex);
+        g_set_error(err, SWAMI_ERROR, SWAMI_ERROR_FAIL,
+                    _("Batch loop find is already active"));
+        return (FALSE);
+    }
+
+    batch->pending = batch->samples;
+    batch->cancel = FALSE;
+    batch->completed = 0;
+    batch->failed = 0;
+    batch->active = TRUE;
+    threads = MAX(1, MIN(batch->threads, batch->total));
+    g_timer_start(batch->timer);
+    g_mutex_unlock(batch->mutex);
+
+    g_object_notify(G_OBJECT(batch), "active");
+
+    g_mutex_lock(batch->mutex);
+
+    /* each worker holds a reference to the batch until it exits */
+    for(i = 0; i < threads; i++)
+    {
+        g_object_ref(batch);      /* ++ ref for worker */
+
+        if(!g_thread_create(batch_worker, batch, FALSE, i == 0 ? err : NULL))
+        {
+            g_object_unref(batch);        /* -- unref for worker */
+            break;
+        }
+
+        batch->running++;
+    }
+
+    if(i == 0)    /* no worker threads could be created? */
+    {
+        batch->active = FALSE;
+        g_timer_stop(batch->timer);
+        g_cond_broadcast(batch->done_cond);
+        g_mutex_unlock(batch->mutex);
+
+        g_object_notify(G_OBJECT(batch), "active");
+        return (FALSE);
+    }
+
+    g_mutex_unlock(batch->mutex);
+
+    return (TRUE);
+}
+
+/**
+ * swami_loop_finder_batch_cancel:
+ * @batch: Batch loop finder object
+ *
+ * Cancel an active batch loop find.  Finds which are in progress are
+ * canceled and no further samples are searched.  Does nothing if batch is
+ * not active.  Use swami_loop_finder_batch_wait() to wait for the worker
+ * threads to finish.
+ */
+void
+swami_loop_finder_batch_cancel(SwamiLoopFinderBatch *batch)
+{
+    GList *p;
+
+    g_return_if_fail(SWAMI_IS_LOOP_FINDER_BATCH(batch));
+
+    g_mutex_lock(batch->mutex);
+
+    if(batch->active)
+    {
+        batch->cancel = TRUE;
+
+        for(p = batch->finders; p; p = p->next)
+        {
+            g_object_set(p->data, "cancel", TRUE, NULL);
+        }
+    }
+
+    g_mutex_unlock(batch->mutex);
+}
+
+/**
+ * swami_loop_finder_batch_wait:
+ * @batch: Batch loop finder object
+ *
+ * Wait for an active batch loop find to finish.  Returns immediately if
+ * @batch is not active.  Should not be called from a "sample-done" signal
+ * handler.
+ */
+void
+swami_loop_finder_batch_wait(SwamiLoopFinderBatch *batch)
+{
+    g_return_if_fail(SWAMI_IS_LOOP_FINDER_BATCH(batch));
+
+    g_mutex_lock(batch->mutex);
+
+    while(batch->active)
+    {
+        g_cond_wait(batch->done_cond, batch->mutex);
+    }
+
+    g_mutex_unlock(batch->mutex);
+}
+
+/**
+ * swami_loop_finder_batch_get_progress:
+ * @batch: Batch loop finder object
+ *
+ * Get the aggregate progress of a batch loop find, which includes the
+ * progress of the finds currently in progress.  Same as the "progress"
+ * property.
+ *
+ * Returns: Progress value between 0.0 and 1.0
+ */
+float
+swami_loop_finder_batch_get_progress(SwamiLoopFinderBatch *batch)
+{
+    float progress;
+    GList *p;
+
+    g_return_val_if_fail(SWAMI_IS_LOOP_FINDER_BATCH(batch), 0.0);
+
+    if(batch->total == 0)
+    {
+        return (batch->completed > 0 ? 1.0 : 0.0);
+    }
+
+    g_mutex_lock(batch->mutex);
+
+    progress = batch->completed;
+
+    for(p = batch->finders; p; p = p->next)
+    {
+        progress += ((SwamiLoopFinder *)(p->data))->progress;
+    }
+
+    g_mutex_unlock(batch->mutex);
+
+    return (CLAMP(progress / batch->total, 0.0, 1.0));
+}
+
+/**
+ * swami_loop_finder_batch_get_throughput:
+ * @batch: Batch loop finder object
+ *
+ * Get the throughput of the current or last batch loop find, in completed
+ * samples per second.  Same as the "throughput" property.
+ *
+ * Returns: Samples per second
+ */
+float
+swami_loop_finder_batch_get_throughput(SwamiLoopFinderBatch *batch)
+{
+    double elapsed;
+    int completed;
+
+    g_return_val_if_fail(SWAMI_IS_LOOP_FINDER_BATCH(batch), 0.0);
+
+    g_mutex_lock(batch->mutex);
+    completed = batch->completed;
+    elapsed = g_timer_elapsed(batch->timer, NULL);
+    g_mutex_unlock(batch->mutex);
+
+    return (elapsed > 0.0 ? (float)(completed / elapsed) : 0.0);
+}
+
+/* Create a loop finder for a sample, with the batch parameters */
+static SwamiLoopFinder *
+batch_finder_new(SwamiLoopFinderBatch *batch, IpatchSample *sample)
+{
+    SwamiLoopFinder *finder, *params;
+
+    finder = swami_loop_finder_new();     /* ++ ref new finder */
+
+    g_mutex_lock(batch->mutex);
+    params = batch->params ? g_object_ref(batch->params) : NULL;  /* ++ ref */
+    g_mutex_unlock(batch->mutex);
+
+    if(params)
+    {
+        g_object_set(finder,
+                     "max-results", params->max_results,
+                     "analysis-window", params->analysis_window,
+                     "min-loop-size", params->min_loop_size,
+                     "group-pos-diff", params->group_pos_diff,
+                     "group-size-diff", params->group_size_diff,
+                     "threads", params->threads,
+                     "search-mode", params->search_mode,
+                     NULL);
+        g_object_unref(params);   /* -- unref params */
+    }
+
+    /* assigning the sample also sets the search windows to the whole sample */
+    g_object_set(finder, "sample", sample, NULL);
+
+    return (finder);      /* !! caller takes over reference */
+}
+
+/* Find loops for a single sample of a batch.  Results are stored to results
+ * (caller owns a reference) or NULL if there were none.  Returns FALSE on
+ * error or if canceled, in which case canceled is set to TRUE. */
+static gboolean
+batch_find_sample(SwamiLoopFinderBatch *batch, IpatchSample *sample,
+                  SwamiLoopResults **results, gboolean *canceled)
+{
+    SwamiLoopFinder *finder;
+    GError *err = NULL;
+    gboolean retval = FALSE;
+
+    *results = NULL;
+
+    finder = batch_finder_new(batch, sample);     /* ++ ref new finder */
+
+    g_mutex_lock(batch->mutex);
+    *canceled = batch->cancel;
+
+    if(!*canceled)
+    {
+        batch->finders = g_list_prepend(batch->finders, finder);
+    }
+
+    g_mutex_unlock(batch->mutex);
+
+    if(*canceled)
+    {
+        g_object_unref(finder);   /* -- unref finder */
+        return (FALSE);
+    }
+
+    if(!finder->sample
+            || !swami_loop_finder_verify_params(finder, TRUE, &err)
+            || !swami_loop_finder_find(finder, &err))
+    {
+        if(err && err->code == SWAMI_ERROR_CANCELED)
+        {
+            *canceled = TRUE;
+        }
+        else if(err)
+        {
+            g_warning("Batch loop find failed: %s", ipatch_gerror_message(err));
+        }
+
+        g_clear_error(&err);
+    }
+    else
+    {
+        *results = swami_loop_finder_get_results(finder);     /* ++ ref */
+        retval = TRUE;
+    }
+
+    g_mutex_lock(batch->mutex);
+    batch->finders = g_list_remove(batch->finders, finder);
+    g_mutex_unlock(batch->mutex);
+
+    g_object_unref(finder);       /* -- unref finder */
+
+    return (retval);
+}
+
+/* Batch worker thread, searches pending samples until there are none left or
+ * the batch is canceled */
+static gpointer
+batch_worker(gpointer data)
+{
+    SwamiLoopFinderBatch *batch = SWAMI_LOOP_FINDER_BATCH(data);
+    SwamiLoopResults *results;
+    IpatchSample *sample;
+    gboolean success, canceled, done;
+
+    while(TRUE)
+    {
+        g_mutex_lock(batch->mutex);
+
+        if(batch->cancel || !batch->pending)
+        {
+            g_mutex_unlock(batch->mutex);
+            break;
+        }
+
+        sample = batch->pending->data;
+        batch->pending = batch->pending->next;
+        g_mutex_unlock(batch->mutex);
+
+        success = batch_find_sample(batch, sample, &results,  /* ++ ref results */
+                                    &canceled);
+
+        /* canceled finds aren't counted, finds which completed before the
+         * batch was canceled are */
+        if(!canceled)
+        {
+            g_mutex_lock(batch->mutex);
+            batch->completed++;
+
+            if(!success)
+            {
+                batch->failed++;
+            }
+
+            g_mutex_unlock(batch->mutex);
+
+            g_signal_emit(batch, batch_signals[SAMPLE_DONE], 0, sample, results);
+        }
+
+        if(results)
+        {
+            g_object_unref(results);      /* -- unref results */
+        }
+    }
+
+    /* last worker to exit deactivates the batch */
+    g_mutex_lock(batch->mutex);
+    done = (--batch->running == 0);
+
+    if(done)
+    {
+        batch->active = FALSE;
+        g_timer_stop(batch->timer);
+        g_cond_broadcast(batch->done_cond);
+    }
+
+    g_mutex_unlock(batch->mutex);
+
+    if(done)
+    {
+        g_object_notify(G_OBJECT(batch), "active");
+    }
+
+    g_object_unref(batch);        /* -- unref for worker */
+
+    return (NULL);
+}
@@ -0,0 +1,83 @@
+/*
+ * SwamiLoopFinderBatch.h - Batch loop finder for multiple samples
+ *
+ * Swami
+ * Copyright (C) 1999-2014 Element Green <element@elementsofsound.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA or point your web browser to http://www.gnu.org.
+ */
+#ifndef __SWAMI_LOOP_FINDER_BATCH_H__
+#define __SWAMI_LOOP_FINDER_BATCH_H__
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libinstpatch/libinstpatch.h>
+#include <libswami/SwamiLoopFinder.h>
+#include <libswami/SwamiLoopResults.h>
+
+typedef struct _SwamiLoopFinderBatch SwamiLoopFinderBatch;
+typedef struct _SwamiLoopFinderBatchClass SwamiLoopFinderBatchClass;
+
+#define SWAMI_TYPE_LOOP_FINDER_BATCH   (swami_loop_finder_batch_get_type ())
+#define SWAMI_LOOP_FINDER_BATCH(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), SWAMI_TYPE_LOOP_FINDER_BATCH, \
+   SwamiLoopFinderBatch))
+#define SWAMI_IS_LOOP_FINDER_BATCH(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), SWAMI_TYPE_LOOP_FINDER_BATCH))
+
+/* Batch loop finder object */
+struct _SwamiLoopFinderBatch
+{
+    GObject parent_instance;
+
+    /*< private >*/
+    GMutex *mutex;		/* lock for fields below */
+    GCond *done_cond;		/* signaled when batch becomes inactive */
+    GList *samples;		/* list of IpatchSample objects (++ ref) */
+    GList *pending;		/* next sample to search (link in samples) */
+    GList *finders;		/* SwamiLoopFinder objects of active searches */
+    SwamiLoopFinder *params;	/* finder with search parameters (++ ref) */
+    int threads;			/* number of worker threads */
+    int running;			/* number of running worker threads */
+    gboolean active;		/* TRUE if batch is currently active */
+    gboolean cancel;		/* set to TRUE to cancel batch */
+    int total;			/* total count of samples */
+    int completed;		/* count of samples searched (or failed) */
+    int failed;			/* count of samples which failed */
+    GTimer *timer;		/* time since batch was started */
+};
+
+/* Batch loop finder class */
+struct _SwamiLoopFinderBatchClass
+{
+    GObjectClass parent_class;
+
+    /* signals */
+    void (*sample_done)(SwamiLoopFinderBatch *batch, IpatchSample *sample,
+                        SwamiLoopResults *results);
+};
+
+GType swami_loop_finder_batch_get_type(void);
+SwamiLoopFinderBatch *swami_loop_finder_batch_new(IpatchList *samples,
+        SwamiLoopFinder *params);
+gboolean swami_loop_finder_batch_start(SwamiLoopFinderBatch *batch,
+                                       GError **err);
+void swami_loop_finder_batch_cancel(SwamiLoopFinderBatch *batch);
+void swami_loop_finder_batch_wait(SwamiLoopFinderBatch *batch);
+float swami_loop_finder_batch_get_progress(SwamiLoopFinderBatch *batch);
+float swami_loop_finder_batch_get_throughput(SwamiLoopFinderBatch *batch);
+
+#endif
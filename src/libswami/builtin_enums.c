@@ -36,6 +36,7 @@
 */
 
 #include "libswami.h"
+#include "SwamiLoopFinder.h"
 #include "swami_priv.h"
 
 /* enumerations from "SwamiControl.h" */
@@ -126,6 +127,27 @@ swami_error_get_type(void)
     return etype;
 }
 
+/* enumerations from "SwamiLoopFinder.h" */
+GType
+swami_loop_finder_search_mode_get_type(void)
+{
+    static GType etype = 0;
+
+    if(etype == 0)
+    {
+        static const GEnumValue values[] =
+        {
+            { SWAMI_LOOP_FINDER_SEARCH_EXHAUSTIVE, "SWAMI_LOOP_FINDER_SEARCH_EXHAUSTIVE", "exhaustive" },
+            { SWAMI_LOOP_FINDER_SEARCH_HIERARCHICAL, "SWAMI_LOOP_FINDER_SEARCH_HIERARCHICAL", "hierarchical" },
+            { SWAMI_LOOP_FINDER_SEARCH_CORRELATION, "SWAMI_LOOP_FINDER_SEARCH_CORRELATION", "correlation" },
+            { 0, NULL, NULL }
+        };
+        etype = g_enum_register_static("SwamiLoopFinderSearchMode", values);
+    }
+
+    return etype;
+}
+
 /* enumerations from "SwamiMidiEvent.h" */
 GType
 swami_midi_event_type_get_type(void)
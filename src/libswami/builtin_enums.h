@@ -26,6 +26,9 @@ GType swami_control_conn_flags_get_type(void);
 /* enumerations from "SwamiLog.h" */
 GType swami_error_get_type(void);
 #define SWAMI_TYPE_ERROR (swami_error_get_type())
+/* enumerations from "SwamiLoopFinder.h" */
+GType swami_loop_finder_search_mode_get_type(void);
+#define SWAMI_TYPE_LOOP_FINDER_SEARCH_MODE (swami_loop_finder_search_mode_get_type())
 /* enumerations from "SwamiMidiEvent.h" */
 GType swami_midi_event_type_get_type(void);
 #define SWAMI_TYPE_MIDI_EVENT_TYPE (swami_midi_event_type_get_type())
@@ -0,0 +1,263 @@
+/*
+ * control_event_bench.c - Control event throughput benchmark
+ *
+ * Swami
+ * Copyright (C) 1999-2014 Element Green <element@elementsofsound.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ * of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA or point your web browser to http://www.gnu.org.
+ */
+/*
+ * Measures how many MIDI control events per second get through a chain of
+ * controls, on a single thread and from a producer thread to a queue run by
+ * the main thread (the MIDI driver to GUI path).  Not installed.
+ *
+ * Usage: control-event-bench [EVENT_COUNT] [CHAIN_LENGTH]
+ *
+ * Run it once normally and once with SWAMI_EVENT_POOL_MAX=0 in the
+ * environment to compare the per-thread event pool against plain g_slice.
+ * The cross thread case frees events on a different thread than the one
+ * which allocated them, so the pool is not expected to help there.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <glib-object.h>
+
+#include <libswami/libswami.h>
+
+#define DEFAULT_EVENT_COUNT     200000
+#define DEFAULT_CHAIN_LENGTH    4
+#define MAX_CHAIN_LENGTH        32
+
+static void relay_callback(SwamiControl *control, SwamiControlEvent *event,
+                           const GValue *value);
+static void count_callback(SwamiControl *control, SwamiControlEvent *event,
+                           const GValue *value);
+static SwamiControlMidi *chain_new(SwamiControlMidi **chain, int length);
+static void chain_free(SwamiControlMidi **chain, int length);
+static void send_events(SwamiControlMidi *midi, int count);
+static gpointer producer_thread(gpointer data);
+static double bench_same_thread(int count, int length);
+static double bench_cross_thread(int count, int length);
+
+/* events received by the last control of the chain */
+static volatile gint received = 0;
+
+/* producer thread parameters */
+static SwamiControlMidi *producer_midi = NULL;
+static int producer_count = 0;
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *poolmax;
+    int count = DEFAULT_EVENT_COUNT;
+    int length = DEFAULT_CHAIN_LENGTH;
+
+    if(argc > 1)
+    {
+        count = atoi(argv[1]);
+    }
+
+    if(argc > 2)
+    {
+        length = atoi(argv[2]);
+    }
+
+    if(count <= 0 || length < 1 || length > MAX_CHAIN_LENGTH)
+    {
+        fprintf(stderr, "Usage: %s [EVENT_COUNT] [CHAIN_LENGTH (1-%d)]\n",
+                argv[0], MAX_CHAIN_LENGTH);
+        return (1);
+    }
+
+    if(!g_thread_supported())
+    {
+        g_thread_init(NULL);
+    }
+
+    swami_init();
+
+    poolmax = g_getenv("SWAMI_EVENT_POOL_MAX");
+
+    printf("events: %d, chain length: %d, event pool max: %s\n",
+           count, length, poolmax ? poolmax : "default");
+
+    /* warm up the allocator and the pool of the main thread */
+    bench_same_thread(MIN(count, 10000), length);
+
+    printf("same thread:  %12.0f events/sec\n",
+           bench_same_thread(count, length));
+    printf("cross thread: %12.0f events/sec\n",
+           bench_cross_thread(count, length));
+
+    return (0);
+}
+
+/* re-transmit each received event as a new event, so every hop of the chain
+ * allocates (and later frees) a control event */
+static void
+relay_callback(SwamiControl *control, SwamiControlEvent *event,
+               const GValue *value)
+{
+    swami_control_transmit_value(control, value);
+}
+
+/* last control of the chain, just counts events */
+static void
+count_callback(SwamiControl *control, SwamiControlEvent *event,
+               const GValue *value)
+{
+    g_atomic_int_inc(&received);
+}
+
+/* create a chain of connected MIDI controls, returns the last control */
+static SwamiControlMidi *
+chain_new(SwamiControlMidi **chain, int length)
+{
+    int i;
+
+    for(i = 0; i <= length; i++)
+    {
+        chain[i] = swami_control_midi_new();	/* ++ ref new control */
+
+        swami_control_midi_set_callback(chain[i], i < length
+                                        ? relay_callback : count_callback,
+                                        NULL);
+        if(i > 0)
+        {
+            swami_control_connect(SWAMI_CONTROL(chain[i - 1]),
+                                  SWAMI_CONTROL(chain[i]), 0);
+        }
+    }
+
+    return (chain[length]);
+}
+
+static void
+chain_free(SwamiControlMidi **chain, int length)
+{
+    int i;
+
+    for(i = 0; i <= length; i++)
+    {
+        swami_control_disconnect_all(SWAMI_CONTROL(chain[i]));
+        g_object_unref(chain[i]);	/* -- unref control */
+    }
+}
+
+static void
+send_events(SwamiControlMidi *midi, int count)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        swami_control_midi_send(midi, (i & 1) ? SWAMI_MIDI_NOTE_OFF
+                                : SWAMI_MIDI_NOTE_ON, 0, 60 + (i & 15), 100);
+    }
+}
+
+static gpointer
+producer_thread(gpointer data)
+{
+    send_events(producer_midi, producer_count);
+    return (NULL);
+}
+
+/* send events through the chain, all on the calling thread */
+static double
+bench_same_thread(int count, int length)
+{
+    SwamiControlMidi *chain[MAX_CHAIN_LENGTH + 1];
+    GTimer *timer;
+    double secs;
+
+    chain_new(chain, length);
+    g_atomic_int_set(&received, 0);
+
+    timer = g_timer_new();
+    send_events(chain[0], count);
+    secs = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    if(g_atomic_int_get(&received) != count)
+    {
+        g_warning("Same thread: expected %d events, got %d", count,
+                  g_atomic_int_get(&received));
+    }
+
+    chain_free(chain, length);
+
+    return (secs > 0.0 ? count / secs : 0.0);
+}
+
+/* send events through the chain from a producer thread, the last control is
+ * queued and its queue is run by the calling thread (like the GUI does) */
+static double
+bench_cross_thread(int count, int length)
+{
+    SwamiControlMidi *chain[MAX_CHAIN_LENGTH + 1];
+    SwamiControlQueue *queue;
+    SwamiControlMidi *last;
+    GThread *thread;
+    GError *err = NULL;
+    GTimer *timer;
+    double secs;
+
+    last = chain_new(chain, length);
+
+    queue = swami_control_queue_new();	/* ++ ref new queue */
+    swami_control_set_queue(SWAMI_CONTROL(last), queue);
+
+    g_atomic_int_set(&received, 0);
+    producer_midi = chain[0];
+    producer_count = count;
+
+    timer = g_timer_new();
+
+    thread = g_thread_create(producer_thread, NULL, TRUE, &err);
+
+    if(!thread)
+    {
+        g_critical("Failed to start producer thread: %s",
+                   err ? err->message : "<no details>");
+        g_clear_error(&err);
+        g_timer_destroy(timer);
+        swami_control_set_queue(SWAMI_CONTROL(last), NULL);
+        g_object_unref(queue);	/* -- unref queue */
+        chain_free(chain, length);
+        return (0.0);
+    }
+
+    while(g_atomic_int_get(&received) < count)
+    {
+        swami_control_queue_run(queue);
+        g_thread_yield();
+    }
+
+    secs = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    g_thread_join(thread);
+
+    swami_control_set_queue(SWAMI_CONTROL(last), NULL);
+    g_object_unref(queue);	/* -- unref queue */
+    chain_free(chain, length);
+
+    return (secs > 0.0 ? count / secs : 0.0);
+}
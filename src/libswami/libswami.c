@@ -33,13 +33,8 @@
 #include "i18n.h"
 
 
-/* inactive control event expiration interval in milliseconds */
-#define SWAMI_CONTROL_EVENT_EXPIRE_INTERVAL 10000
-
-
 /* --- private function prototypes --- */
 
-static gboolean swami_control_event_expire_timeout(gpointer data);
 static void container_add_notify(IpatchContainer *container, IpatchItem *item,
                                  gpointer user_data);
 static void container_remove_notify(IpatchContainer *container,
@@ -54,6 +49,7 @@ void _swami_plugin_deinitialize(void); /* SwamiPlugin.c */
 void _swami_value_transform_init(void);  /* value_transform.c */
 void _swami_control_prop_init(void);   /* SwamiControlProp.c */
 void _swami_control_prop_deinit(void); /* SwamiControlProp.c */
+void _swami_control_event_init(void);  /* SwamiControlEvent.c */
 
 /* indicates that the librarie is initialized */
 static gboolean initialized = FALSE;
@@ -65,8 +61,6 @@ SwamiControl *swami_patch_prop_title_control;
 SwamiControl *swami_patch_add_control;
 SwamiControl *swami_patch_remove_control;
 
-static guint event_timeout_id;
-
 /*
  Getter function returning swami_patch_prop_title_control.
  Useful when libswami library is used as a shared library linked at load time.
@@ -144,6 +138,9 @@ swami_init(void)
     /* initialize SwamiControlProp cache */
     _swami_control_prop_init();
 
+    /* initialize SwamiControlEvent pool settings */
+    _swami_control_event_init();
+
     /* initialize libswami types */
     g_type_class_ref(SWAMI_TYPE_CONTROL);
     g_type_class_ref(SWAMI_TYPE_CONTROL_FUNC);
@@ -174,10 +171,6 @@ swami_init(void)
     ipatch_container_remove_connect(NULL, NULL, container_remove_notify,
                                     NULL, NULL);
 
-    /* install periodic control event expiration process */
-    event_timeout_id = g_timeout_add (SWAMI_CONTROL_EVENT_EXPIRE_INTERVAL,
-                                      swami_control_event_expire_timeout, NULL);
-
     swap_dir = g_build_filename(g_get_user_cache_dir(), "swami", NULL);	/* ++ alloc */
 
     /* Construct Swami directory name for swap file
@@ -216,9 +209,6 @@ swami_deinit()
     }
     initialized = FALSE;
 
-    /* cancel SwamiControl event queuing timer */
-    g_source_remove (event_timeout_id);
-
     /* disconnect notify from container */
     ipatch_container_add_disconnect_matched (NULL, container_add_notify, NULL);
     ipatch_container_remove_disconnect_matched (NULL, NULL, container_remove_notify, NULL);
@@ -241,13 +231,6 @@ swami_deinit()
     ipatch_close();
 }
 
-static gboolean
-swami_control_event_expire_timeout(gpointer data)
-{
-    swami_control_do_event_expiration();
-    return (TRUE);
-}
-
 
 #if 0
 /**
@@ -30,6 +30,9 @@
 
 static void recurse_types(GType type, GArray *array);
 
+/* lock for the FFTW planner, which is global to the process */
+G_LOCK_DEFINE_STATIC(fftw_planner);
+
 /*----------------------------------------------------------------------------
  Ancestry gObject type related functions
 -----------------------------------------------------------------------------*/
@@ -245,3 +248,28 @@ swami_util_midi_str_to_note(const char *str)
         return (-1);
     }
 }
+
+/**
+ * swami_fftw_planner_lock:
+ *
+ * Lock the FFTW planner.  Creating and destroying FFTW plans and importing or
+ * exporting wisdom are not thread safe and the planner is shared by the whole
+ * process, so libswami and plugins which use FFTW must hold this lock while
+ * calling them.  Executing a plan does not require it.
+ */
+void
+swami_fftw_planner_lock(void)
+{
+    G_LOCK(fftw_planner);
+}
+
+/**
+ * swami_fftw_planner_unlock:
+ *
+ * Unlock the FFTW planner locked with swami_fftw_planner_lock().
+ */
+void
+swami_fftw_planner_unlock(void)
+{
+    G_UNLOCK(fftw_planner);
+}
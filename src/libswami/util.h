@@ -27,5 +27,7 @@ GValue *swami_util_new_value(void);
 void swami_util_free_value(GValue *value);
 void swami_util_midi_note_to_str(int note, char *str);
 int swami_util_midi_str_to_note(const char *str);
+void swami_fftw_planner_lock(void);
+void swami_fftw_planner_unlock(void);
 
 #endif /* __SWAMI_UTIL_H__ */
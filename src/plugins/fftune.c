@@ -22,6 +22,8 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <math.h>
 
 #include <glib.h>
@@ -32,6 +34,7 @@
 #include <libinstpatch/libinstpatch.h>
 
 #include <libswami/SwamiPlugin.h>
+#include <libswami/util.h>
 #include <libswami/version.h>
 
 #include "fftune_i18n.h"
@@ -46,6 +49,11 @@
 
 #define MAX_ALLOWED_TUNINGS 1024	/* absolute max tunings allowed */
 
+#define PLAN_CACHE_SIZE     8   /* max FFTW plans kept in plan cache */
+
+/* FFTW wisdom file name (in Swami XDG cache directory) */
+#define WISDOM_FILE_NAME    "fftwf_wisdom"
+
 /* Sample format used internally */
 #define SAMPLE_FORMAT   IPATCH_SAMPLE_FLOAT | IPATCH_SAMPLE_MONO | IPATCH_SAMPLE_ENDIAN_HOST
 
@@ -53,7 +61,9 @@ enum
 {
     PROP_0,
     PROP_ACTIVE,	/* when TRUE: spectrum and tuning suggestions are calculated
-		   any changes in parameters cause recalc of tuning suggestions */
+		   any changes in parameters cause recalc of tuning suggestions
+		   (spectrum is calculated in a worker thread, signals are
+		   emitted from the main loop) */
     PROP_SAMPLE,		/* sample object to calculate spectrum on */
     PROP_SAMPLE_MODE,	/* sample calculation mode enum */
     PROP_SAMPLE_START,	/* start position in sample */
@@ -71,8 +81,16 @@ enum
     PROP_TUNE_INDEX,	/* index in spectrum data for this tuning suggestion */
     PROP_TUNE_POWER,	/* power of current tuning (0.0 if no more suggestions) */
     PROP_TUNE_FREQ,	/* frequency of current tuning */
-    PROP_ENABLE_WINDOW,   /* Enable Hann window of sample data */
-    PROP_ELLAPSED_TIME    /* Ellapsed time of last execution in seconds */
+    PROP_ENABLE_WINDOW,   /* Enable window of sample data */
+    PROP_ELLAPSED_TIME,   /* Ellapsed time of last execution in seconds */
+    PROP_CALC_TIME,       /* Time from last update request to result in seconds */
+    PROP_CALCULATING,     /* TRUE while a spectrum calculation is pending */
+    PROP_PLANNER,         /* FFTW planner effort (FFTUNE_PLANNER_*) */
+    PROP_FFT_SIZE,        /* FFT size policy (FFTUNE_FFT_SIZE_*) */
+    PROP_MAX_FFT_SIZE,    /* maximum FFT size or 0 for unlimited */
+    PROP_WINDOW,          /* window function (FFTUNE_WINDOW_*) */
+    PROP_SEGMENT_SIZE,    /* averaged spectrum segment size or 0 to disable */
+    PROP_SEGMENT_HOP      /* averaged spectrum segment hop or 0 for half */
 };
 
 enum
@@ -84,26 +102,108 @@ enum
 
 #define ERRMSG_MALLOC_1  "Failed to allocate %u bytes in FFTune plugin"
 
+/* A cached FFTW plan, with the arrays it was planned for */
+typedef struct
+{
+    int size;             /* transform size */
+    unsigned flags;       /* FFTW planner flags */
+    fftwf_plan plan;      /* real to half complex plan */
+    float *in;            /* input array (fftwf_malloc) */
+    float *out;           /* output array (fftwf_malloc) */
+} FFTunePlan;
+
+/* Spectrum calculation job.  Parameters are copied from the FFTuneSpectra
+ * object when the job is queued, so it can run in the calc_pool worker thread
+ * while the object keeps changing.  Only the main thread accesses spectra. */
+typedef struct
+{
+    FFTuneSpectra *spectra;       /* spectra object or NULL if superseded */
+    IpatchSample *sample;         /* sample to calculate spectrum on (++ ref) */
+    guint sample_size;            /* size of sample */
+    guint loop_start;             /* sample loop start */
+    guint loop_end;               /* sample loop end */
+    int sample_mode;              /* FFTUNE_MODE_* */
+    guint sample_start;           /* start of selection */
+    guint sample_end;             /* end of selection */
+    guint limit;                  /* maximum number of samples or 0 */
+    int enable_window;            /* enable windowing of sample data */
+    int window;                   /* window function (FFTUNE_WINDOW_*) */
+    int planner;                  /* FFTW planner effort (FFTUNE_PLANNER_*) */
+    int fft_size_mode;            /* FFT size policy (FFTUNE_FFT_SIZE_*) */
+    guint max_fft_size;           /* maximum FFT size or 0 for unlimited */
+    guint segment_size;           /* averaged spectrum segment size or 0 */
+    guint segment_hop;            /* samples between segments or 0 */
+    GTimer *timer;                /* time since job was queued */
+    volatile gint cancel;         /* set to TRUE if job was superseded */
+
+    double *spectrum;             /* resulting spectrum or NULL on failure */
+    int spectrum_size;            /* size of spectrum array */
+    guint fft_size;               /* FFT size of spectrum */
+    float ellapsed_time;          /* FFT execution time in seconds */
+} FFTuneJob;
+
 static gboolean plugin_fftune_init(SwamiPlugin *plugin, GError **err);
+static void plugin_fftune_exit(SwamiPlugin *plugin);
 static GType sample_mode_register_type(SwamiPlugin *plugin);
+static GType planner_register_type(SwamiPlugin *plugin);
+static GType fft_size_register_type(SwamiPlugin *plugin);
+static GType window_register_type(SwamiPlugin *plugin);
+static void fftune_wisdom_load(void);
+static void fftune_wisdom_save(void);
+static void fftune_plan_free(FFTunePlan *plan);
+static FFTunePlan *fftune_plan_get(int size, unsigned flags);
 static void fftune_spectra_finalize(GObject *object);
 static void fftune_spectra_set_property(GObject *object, guint property_id,
                                         const GValue *value, GParamSpec *pspec);
 static void fftune_spectra_get_property(GObject *object, guint property_id,
                                         GValue *value, GParamSpec *pspec);
-static gboolean fftune_spectra_calc_spectrum(FFTuneSpectra *spectra);
-static double *fftune_spectra_run_fftw(void *data, int *dsize);
+static void fftune_spectra_queue_job(FFTuneSpectra *spectra);
+static void fftune_spectra_cancel_job(FFTuneSpectra *spectra);
+static void fftune_job_run(gpointer data, gpointer user_data);
+static gboolean fftune_job_done(gpointer data);
+static void fftune_job_free(FFTuneJob *job);
+static gboolean fft_size_is_fast(guint size);
+static guint fft_size_round(guint size, int mode, gboolean up);
+static guint fftune_job_fft_size(FFTuneJob *job, guint *count,
+                                 gboolean truncate);
+static double fftune_window_value(int window, guint i, guint size);
+static gboolean fftune_job_calc_spectrum(FFTuneJob *job);
+static gboolean fftune_job_calc_averaged(FFTuneJob *job, guint start,
+        guint count);
+static gboolean fftune_job_run_fftw(FFTuneJob *job, const float *data,
+                                    int size, double *power,
+                                    gboolean accumulate);
 static gboolean fftune_spectra_calc_tunings(FFTuneSpectra *spectra);
 static gint tuneval_compare_func(gconstpointer a, gconstpointer b);
 
 /* set plugin information */
-SWAMI_PLUGIN_INFO(plugin_fftune_init, NULL);
+SWAMI_PLUGIN_INFO(plugin_fftune_init, plugin_fftune_exit);
 
 /* define FFTuneSpectra type */
 G_DEFINE_TYPE(FFTuneSpectra, fftune_spectra, G_TYPE_OBJECT);
 
 
 static GType sample_mode_enum_type;
+static GType planner_enum_type;
+static GType fft_size_enum_type;
+static GType window_enum_type;
+
+/* FFTW plan cache (most recently used first), plans are reused for
+ * transforms of the same size and planner flags */
+static GList *plan_cache = NULL;
+G_LOCK_DEFINE_STATIC(plan_cache);
+
+/* FFTW wisdom file name and TRUE if wisdom was gained since it was saved */
+static char *wisdom_filename = NULL;
+static gboolean wisdom_changed = FALSE;
+
+/* Spectrum calculation worker thread (a single thread, so superseded jobs
+ * still queued are skipped rather than run in parallel) */
+static GThreadPool *calc_pool = NULL;
+
+/* Jobs which have not been freed yet, queued, running or with a pending
+ * fftune_job_done() idle callback (main thread only) */
+static GList *calc_jobs = NULL;
 
 static guint obj_signals[SIGNAL_COUNT];
 
@@ -131,11 +231,93 @@ plugin_fftune_init(SwamiPlugin *plugin, GError **err)
         sample_mode_enum_type = sample_mode_register_type(plugin);
     }
 
+    if(!planner_enum_type)
+    {
+        planner_enum_type = planner_register_type(plugin);
+    }
+
+    if(!fft_size_enum_type)
+    {
+        fft_size_enum_type = fft_size_register_type(plugin);
+    }
+
+    if(!window_enum_type)
+    {
+        window_enum_type = window_register_type(plugin);
+    }
+
     fftune_spectra_get_type();
 
+    if(!calc_pool)
+    {
+        calc_pool = g_thread_pool_new(fftune_job_run, NULL, 1, FALSE, err);
+
+        if(!calc_pool)
+        {
+            return (FALSE);
+        }
+    }
+
+    fftune_wisdom_load();
+
     return (TRUE);
 }
 
+/* plugin exit function called when the plugin module is unloaded */
+static void
+plugin_fftune_exit(SwamiPlugin *plugin)
+{
+    FFTuneJob *job;
+    GList *p;
+
+    /* cancel all jobs, queued ones are then skipped by the worker */
+    for(p = calc_jobs; p; p = p->next)
+    {
+        job = (FFTuneJob *)(p->data);
+
+        if(job->spectra)
+        {
+            fftune_spectra_cancel_job(job->spectra);
+        }
+    }
+
+    /* wait for the worker to finish with all jobs, so that each has its
+     * fftune_job_done() idle callback added */
+    if(calc_pool)
+    {
+        g_thread_pool_free(calc_pool, FALSE, TRUE);
+        calc_pool = NULL;
+    }
+
+    /* remove the idle callbacks which didn't run yet and free their jobs */
+    for(p = calc_jobs; p; p = p->next)
+    {
+        job = (FFTuneJob *)(p->data);
+        g_source_remove_by_user_data(job);
+        fftune_job_free(job);
+    }
+
+    g_list_free(calc_jobs);
+    calc_jobs = NULL;
+
+    G_LOCK(plan_cache);
+
+    for(p = plan_cache; p; p = p->next)
+    {
+        fftune_plan_free((FFTunePlan *)(p->data));
+    }
+
+    g_list_free(plan_cache);
+    plan_cache = NULL;
+
+    fftune_wisdom_save();
+
+    G_UNLOCK(plan_cache);
+
+    g_free(wisdom_filename);
+    wisdom_filename = NULL;
+}
+
 static GType
 sample_mode_register_type(SwamiPlugin *plugin)
 {
@@ -153,6 +335,199 @@ sample_mode_register_type(SwamiPlugin *plugin)
     return g_enum_register_static ("FFTuneSampleMode", values);
 }
 
+static GType
+planner_register_type(SwamiPlugin *plugin)
+{
+    static const GEnumValue values[] =
+    {
+        { FFTUNE_PLANNER_ESTIMATE, "FFTUNE_PLANNER_ESTIMATE", "Estimate" },
+        { FFTUNE_PLANNER_MEASURE, "FFTUNE_PLANNER_MEASURE", "Measure" },
+        { FFTUNE_PLANNER_PATIENT, "FFTUNE_PLANNER_PATIENT", "Patient" },
+        { 0, NULL, NULL }
+    };
+
+    /* registered static, see sample_mode_register_type() */
+    return g_enum_register_static ("FFTunePlanner", values);
+}
+
+static GType
+fft_size_register_type(SwamiPlugin *plugin)
+{
+    static const GEnumValue values[] =
+    {
+        { FFTUNE_FFT_SIZE_EXACT, "FFTUNE_FFT_SIZE_EXACT", "Exact" },
+        { FFTUNE_FFT_SIZE_FAST, "FFTUNE_FFT_SIZE_FAST", "Fast" },
+        { FFTUNE_FFT_SIZE_POWER_OF_TWO, "FFTUNE_FFT_SIZE_POWER_OF_TWO", "PowerOfTwo" },
+        { 0, NULL, NULL }
+    };
+
+    /* registered static, see sample_mode_register_type() */
+    return g_enum_register_static ("FFTuneFftSize", values);
+}
+
+static GType
+window_register_type(SwamiPlugin *plugin)
+{
+    static const GEnumValue values[] =
+    {
+        { FFTUNE_WINDOW_HANN, "FFTUNE_WINDOW_HANN", "Hann" },
+        { FFTUNE_WINDOW_HAMMING, "FFTUNE_WINDOW_HAMMING", "Hamming" },
+        { FFTUNE_WINDOW_BLACKMAN, "FFTUNE_WINDOW_BLACKMAN", "Blackman" },
+        { FFTUNE_WINDOW_RECTANGULAR, "FFTUNE_WINDOW_RECTANGULAR", "Rectangular" },
+        { 0, NULL, NULL }
+    };
+
+    /* registered static, see sample_mode_register_type() */
+    return g_enum_register_static ("FFTuneWindow", values);
+}
+
+/* Load FFTW wisdom from the Swami XDG cache directory (created by
+ * swami_init()), if it exists */
+static void
+fftune_wisdom_load(void)
+{
+    FILE *file;
+
+    if(!wisdom_filename)
+    {
+        wisdom_filename = g_build_filename(g_get_user_cache_dir(), "swami",
+                                           WISDOM_FILE_NAME, NULL);    /* ++ alloc */
+    }
+
+    file = fopen(wisdom_filename, "r");
+
+    if(!file)
+    {
+        return;
+    }
+
+    G_LOCK(plan_cache);
+    swami_fftw_planner_lock();
+
+    if(!fftwf_import_wisdom_from_file(file))
+    {
+        g_warning("Failed to import FFTW wisdom from '%s'", wisdom_filename);
+    }
+
+    swami_fftw_planner_unlock();
+    G_UNLOCK(plan_cache);
+
+    fclose(file);
+}
+
+/* Save FFTW wisdom to the wisdom file, if any was gained since it was loaded
+ * or last saved.  Plan cache should be locked by caller. */
+static void
+fftune_wisdom_save(void)
+{
+    FILE *file;
+
+    if(!wisdom_changed || !wisdom_filename)
+    {
+        return;
+    }
+
+    file = fopen(wisdom_filename, "w");
+
+    if(!file)
+    {
+        g_warning("Failed to save FFTW wisdom to '%s': %s", wisdom_filename,
+                  g_strerror(errno));
+        return;
+    }
+
+    swami_fftw_planner_lock();
+    fftwf_export_wisdom_to_file(file);
+    swami_fftw_planner_unlock();
+    fclose(file);
+
+    wisdom_changed = FALSE;
+}
+
+static void
+fftune_plan_free(FFTunePlan *plan)
+{
+    swami_fftw_planner_lock();
+    fftwf_destroy_plan(plan->plan);
+    swami_fftw_planner_unlock();
+
+    fftwf_free(plan->in);
+    fftwf_free(plan->out);
+    g_slice_free(FFTunePlan, plan);
+}
+
+/* Get a cached FFTW plan for a transform size and planner flags, planning it
+ * if not already in the cache.  Plan cache should be locked by caller.
+ * Returns plan which is owned by the cache or NULL on error. */
+static FFTunePlan *
+fftune_plan_get(int size, unsigned flags)
+{
+    FFTunePlan *plan;
+    GList *p;
+
+    for(p = plan_cache; p; p = p->next)
+    {
+        plan = (FFTunePlan *)(p->data);
+
+        if(plan->size == size && plan->flags == flags)
+        {
+            /* move to front of list (most recently used) */
+            plan_cache = g_list_remove_link(plan_cache, p);
+            plan_cache = g_list_concat(p, plan_cache);
+            return (plan);
+        }
+    }
+
+    plan = g_slice_new(FFTunePlan);
+    plan->size = size;
+    plan->flags = flags;
+    plan->in = fftwf_malloc(sizeof(float) * size);
+    plan->out = fftwf_malloc(sizeof(float) * size);
+
+    if(!plan->in || !plan->out)
+    {
+        g_critical(_(ERRMSG_MALLOC_1), (guint)(sizeof(float) * size));
+        fftwf_free(plan->in);
+        fftwf_free(plan->out);
+        g_slice_free(FFTunePlan, plan);
+        return (NULL);
+    }
+
+    /* create FFTW plan (real to half complex), arrays are overwritten while
+     * planning with anything other than FFTW_ESTIMATE */
+    swami_fftw_planner_lock();
+    plan->plan = fftwf_plan_r2r_1d(size, plan->in, plan->out, FFTW_R2HC, flags);
+    swami_fftw_planner_unlock();
+
+    if(!plan->plan)
+    {
+        fftwf_free(plan->in);
+        fftwf_free(plan->out);
+        g_slice_free(FFTunePlan, plan);
+        return (NULL);
+    }
+
+    /* Measured plans add to the wisdom, save it now since planning can be
+     * expensive and the plugin may never be unloaded cleanly */
+    if(flags != FFTW_ESTIMATE)
+    {
+        wisdom_changed = TRUE;
+        fftune_wisdom_save();
+    }
+
+    plan_cache = g_list_prepend(plan_cache, plan);
+
+    /* Remove least recently used plan if cache is full */
+    if(g_list_length(plan_cache) > PLAN_CACHE_SIZE)
+    {
+        p = g_list_last(plan_cache);
+        fftune_plan_free((FFTunePlan *)(p->data));
+        plan_cache = g_list_delete_link(plan_cache, p);
+    }
+
+    return (plan);
+}
+
 static void
 fftune_spectra_class_init(FFTuneSpectraClass *klass)
 {
@@ -253,6 +628,41 @@ fftune_spectra_class_init(FFTuneSpectraClass *klass)
                                     g_param_spec_float("ellapsed-time", _("Ellapsed time"),
                                             _("Ellapsed time of last execution in seconds"),
                                             0.0, G_MAXFLOAT, 0.0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_CALC_TIME,
+                                    g_param_spec_float("calc-time", _("Calculation time"),
+                                            _("Time from last update request to result in seconds"),
+                                            0.0, G_MAXFLOAT, 0.0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_CALCULATING,
+                                    g_param_spec_boolean("calculating", _("Calculating"),
+                                            _("Spectrum calculation is pending"),
+                                            FALSE, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, PROP_PLANNER,
+                                    g_param_spec_enum("planner", _("Planner"),
+                                            _("FFTW planner effort (plans are cached)"),
+                                            planner_enum_type, FFTUNE_PLANNER_ESTIMATE,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_FFT_SIZE,
+                                    g_param_spec_enum("fft-size", _("FFT size"),
+                                            _("FFT size policy (zero padding of sample data)"),
+                                            fft_size_enum_type, FFTUNE_FFT_SIZE_EXACT,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_MAX_FFT_SIZE,
+                                    g_param_spec_uint("max-fft-size", _("Max FFT size"),
+                                            _("Maximum FFT size (0 for unlimited)"),
+                                            0, G_MAXUINT, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_WINDOW,
+                                    g_param_spec_enum("window", _("Window"),
+                                            _("Window function (if enable-window is set)"),
+                                            window_enum_type, FFTUNE_WINDOW_HANN,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_SEGMENT_SIZE,
+                                    g_param_spec_uint("segment-size", _("Segment size"),
+                                            _("Segment size of averaged spectrum (0 for single FFT)"),
+                                            0, G_MAXUINT, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, PROP_SEGMENT_HOP,
+                                    g_param_spec_uint("segment-hop", _("Segment hop"),
+                                            _("Hop between averaged spectrum segments (0 for half segment)"),
+                                            0, G_MAXUINT, 0, G_PARAM_READWRITE));
 }
 
 static void
@@ -271,6 +681,8 @@ fftune_spectra_finalize(GObject *object)
 {
     FFTuneSpectra *spectra = FFTUNE_SPECTRA(object);
 
+    fftune_spectra_cancel_job(spectra);
+
     if(spectra->spectrum)
     {
         fftwf_free(spectra->spectrum);
@@ -292,6 +704,7 @@ fftune_spectra_set_property(GObject *object, guint property_id,
                             const GValue *value, GParamSpec *pspec)
 {
     FFTuneSpectra *spectra = FFTUNE_SPECTRA(object);
+    FFTuneJob *oldjob = spectra->job;
     gboolean spectrum_update = FALSE;
     gboolean tunings_update = FALSE;
 
@@ -304,6 +717,13 @@ fftune_spectra_set_property(GObject *object, guint property_id,
         }
 
         spectra->active = g_value_get_boolean(value);
+
+        /* deactivating cancels a pending spectrum calculation */
+        if(!spectra->active)
+        {
+            fftune_spectra_cancel_job(spectra);
+        }
+
         break;
 
     case PROP_SAMPLE:
@@ -431,25 +851,88 @@ fftune_spectra_set_property(GObject *object, guint property_id,
         spectrum_update = TRUE;
         break;
 
+    case PROP_PLANNER:
+        spectra->planner = g_value_get_enum(value);
+        break;
+
+    case PROP_FFT_SIZE:
+        if(g_value_get_enum(value) == spectra->fft_size_mode)
+        {
+            break;
+        }
+
+        spectra->fft_size_mode = g_value_get_enum(value);
+        spectrum_update = TRUE;
+        break;
+
+    case PROP_MAX_FFT_SIZE:
+        if(g_value_get_uint(value) == spectra->max_fft_size)
+        {
+            break;
+        }
+
+        spectra->max_fft_size = g_value_get_uint(value);
+        spectrum_update = TRUE;
+        break;
+
+    case PROP_WINDOW:
+        if(g_value_get_enum(value) == spectra->window)
+        {
+            break;
+        }
+
+        spectra->window = g_value_get_enum(value);
+        spectrum_update = TRUE;
+        break;
+
+    case PROP_SEGMENT_SIZE:
+        if(g_value_get_uint(value) == spectra->segment_size)
+        {
+            break;
+        }
+
+        spectra->segment_size = g_value_get_uint(value);
+        spectrum_update = TRUE;
+        break;
+
+    case PROP_SEGMENT_HOP:
+        if(g_value_get_uint(value) == spectra->segment_hop)
+        {
+            break;
+        }
+
+        spectra->segment_hop = g_value_get_uint(value);
+        spectrum_update = TRUE;
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
     }
 
+    /* a pending spectrum calculation is superseded by any spectrum change */
+    if(spectrum_update)
+    {
+        fftune_spectra_cancel_job(spectra);
+    }
+
     if(spectra->active && spectra->sample)
     {
         if(spectrum_update)	/* spectrum need update? */
         {
-            if(fftune_spectra_calc_spectrum(spectra))
-            {
-                fftune_spectra_calc_tunings(spectra);
-            }
+            fftune_spectra_queue_job(spectra);
         }
-        else if(tunings_update)	/* tuning values need update? */
+        else if(tunings_update && spectra->spectrum)	/* tuning values need update? */
         {
             fftune_spectra_calc_tunings(spectra);
         }
     }
+
+    /* job queued, superseded or canceled? */
+    if(spectra->job != oldjob)
+    {
+        g_object_notify(object, "calculating");
+    }
 }
 
 static void
@@ -561,80 +1044,327 @@ fftune_spectra_get_property(GObject *object, guint property_id,
         g_value_set_float(value, spectra->ellapsed_time);
         break;
 
+    case PROP_CALC_TIME:
+        g_value_set_float(value, spectra->calc_time);
+        break;
+
+    case PROP_CALCULATING:
+        g_value_set_boolean(value, spectra->job != NULL);
+        break;
+
+    case PROP_PLANNER:
+        g_value_set_enum(value, spectra->planner);
+        break;
+
+    case PROP_FFT_SIZE:
+        g_value_set_enum(value, spectra->fft_size_mode);
+        break;
+
+    case PROP_MAX_FFT_SIZE:
+        g_value_set_uint(value, spectra->max_fft_size);
+        break;
+
+    case PROP_WINDOW:
+        g_value_set_enum(value, spectra->window);
+        break;
+
+    case PROP_SEGMENT_SIZE:
+        g_value_set_uint(value, spectra->segment_size);
+        break;
+
+    case PROP_SEGMENT_HOP:
+        g_value_set_uint(value, spectra->segment_hop);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
     }
 }
 
+/* Queue a spectrum calculation job with the current parameters of spectra */
+static void
+fftune_spectra_queue_job(FFTuneSpectra *spectra)
+{
+    FFTuneJob *job;
+
+    job = g_new0(FFTuneJob, 1);
+    job->spectra = spectra;
+    job->sample = g_object_ref(spectra->sample);     /* ++ ref sample */
+
+    g_object_get(spectra->sample,
+                 "sample-size", &job->sample_size,
+                 "loop-start", &job->loop_start,
+                 "loop-end", &job->loop_end,
+                 NULL);
+
+    job->sample_mode = spectra->sample_mode;
+    job->sample_start = spectra->sample_start;
+    job->sample_end = spectra->sample_end;
+    job->limit = spectra->limit;
+    job->enable_window = spectra->enable_window;
+    job->window = spectra->window;
+    job->planner = spectra->planner;
+    job->fft_size_mode = spectra->fft_size_mode;
+    job->max_fft_size = spectra->max_fft_size;
+    job->segment_size = spectra->segment_size;
+    job->segment_hop = spectra->segment_hop;
+    job->timer = g_timer_new();
+
+    spectra->job = job;
+    calc_jobs = g_list_prepend(calc_jobs, job);
+
+    g_thread_pool_push(calc_pool, job, NULL);
+}
+
+/* Cancel the pending spectrum calculation job of spectra, if any.  The job
+ * itself is freed by fftune_job_done() once the worker is done with it. */
+static void
+fftune_spectra_cancel_job(FFTuneSpectra *spectra)
+{
+    FFTuneJob *job = spectra->job;
+
+    if(!job)
+    {
+        return;
+    }
+
+    job->spectra = NULL;
+    g_atomic_int_set(&job->cancel, TRUE);
+    spectra->job = NULL;
+}
+
+/* calc_pool worker thread function */
+static void
+fftune_job_run(gpointer data, gpointer user_data)
+{
+    FFTuneJob *job = data;
+
+    if(!g_atomic_int_get(&job->cancel))
+    {
+        fftune_job_calc_spectrum(job);
+    }
+
+    /* deliver result in main loop */
+    g_idle_add(fftune_job_done, job);
+}
+
+/* Main loop callback to deliver the result of a finished job */
+static gboolean
+fftune_job_done(gpointer data)
+{
+    FFTuneJob *job = data;
+    FFTuneSpectra *spectra = job->spectra;
+
+    if(spectra)         /* not superseded? */
+    {
+        spectra->job = NULL;
+        spectra->calc_time = (float)g_timer_elapsed(job->timer, NULL);
+
+        if(job->spectrum)
+        {
+            spectra->ellapsed_time = job->ellapsed_time;
+
+            /* emit spectrum-change signal */
+            g_signal_emit(spectra, obj_signals[SPECTRUM_CHANGE], 0,
+                          job->spectrum_size, job->spectrum);
+
+            g_free(spectra->spectrum);
+            spectra->spectrum = job->spectrum;      /* !! spectra takes over */
+            spectra->spectrum_size = job->spectrum_size;
+            spectra->fft_size = job->fft_size;
+            job->spectrum = NULL;
+
+            fftune_spectra_calc_tunings(spectra);
+        }
+
+        g_object_notify(G_OBJECT(spectra), "calc-time");
+        g_object_notify(G_OBJECT(spectra), "calculating");
+    }
+
+    calc_jobs = g_list_remove(calc_jobs, job);
+    fftune_job_free(job);
+
+    return (FALSE);
+}
+
+static void
+fftune_job_free(FFTuneJob *job)
+{
+    g_object_unref(job->sample);        /* -- unref sample */
+    g_timer_destroy(job->timer);
+    g_free(job->spectrum);
+    g_free(job);
+}
+
+/* Check if a transform size only has small prime factors (fast for FFTW) */
+static gboolean
+fft_size_is_fast(guint size)
+{
+    static const guint primes[] = { 2, 3, 5, 7 };
+    int i;
+
+    for(i = 0; i < G_N_ELEMENTS(primes); i++)
+    {
+        while(size % primes[i] == 0)
+        {
+            size /= primes[i];
+        }
+    }
+
+    return (size == 1);
+}
+
+/* Round a transform size up or down to a size of the given FFT size policy */
+static guint
+fft_size_round(guint size, int mode, gboolean up)
+{
+    guint pow2;
+
+    if(size <= 1)
+    {
+        return (1);
+    }
+
+    if(mode == FFTUNE_FFT_SIZE_POWER_OF_TWO)
+    {
+        for(pow2 = 1; pow2 < size && pow2 <= G_MAXUINT / 2; pow2 *= 2);
+
+        return ((up || pow2 == size) ? pow2 : pow2 / 2);
+    }
+
+    if(mode == FFTUNE_FFT_SIZE_FAST)
+    {
+        /* sizes with only small prime factors are dense, so this is short */
+        while(!fft_size_is_fast(size))
+        {
+            size += up ? 1 : -1;
+        }
+    }
+
+    return (size);
+}
+
+/* Get the transform size for count samples according to the FFT size policy
+ * of a job.  The transform size is count zero padded up to the policy size.
+ * If truncate is TRUE, count is reduced as needed to fit the "max-fft-size"
+ * (otherwise it is exceeded if necessary). */
+static guint
+fftune_job_fft_size(FFTuneJob *job, guint *count, gboolean truncate)
+{
+    guint size, max_size = job->max_fft_size;
+
+    size = fft_size_round(*count, job->fft_size_mode, TRUE);
+
+    if(truncate && max_size && size > max_size)
+    {
+        size = fft_size_round(max_size, job->fft_size_mode, FALSE);
+        *count = MIN(*count, size);
+    }
+
+    return (size);
+}
+
+/* Get value of a window function at index i of a window of the given size */
+static double
+fftune_window_value(int window, guint i, guint size)
+{
+    double x;
+
+    if(size <= 1)
+    {
+        return (1.0);
+    }
+
+    x = 2.0 * G_PI * ((double)i / (size - 1));
+
+    switch(window)
+    {
+    case FFTUNE_WINDOW_HAMMING:
+        return (0.54 - 0.46 * cos(x));
+
+    case FFTUNE_WINDOW_BLACKMAN:
+        return (0.42 - 0.5 * cos(x) + 0.08 * cos(2.0 * x));
+
+    case FFTUNE_WINDOW_RECTANGULAR:
+        return (1.0);
+
+    default:      /* FFTUNE_WINDOW_HANN */
+        return (0.5 * (1.0 - cos(x)));
+    }
+}
+
+/* Calculate the spectrum of a job (called from calc_pool worker thread) */
 static gboolean
-fftune_spectra_calc_spectrum(FFTuneSpectra *spectra)
+fftune_job_calc_spectrum(FFTuneJob *job)
 {
-    guint start, sample_size, loop_start, loop_end;
+    guint start, count, i, dsize, fftsize;
     IpatchSampleHandle handle;
     GError *err = NULL;
     void *data;           /* Stores sample data (floats) */
     double *result;       /* FFT power spectrum result */
     int result_size;
-    guint count, i, dsize;
     GTimeVal start_time, end_time;
     float ellapsed;
 
-    g_return_val_if_fail(spectra->sample != NULL, FALSE);
-
-    g_object_get(spectra->sample,
-                 "sample-size", &sample_size,
-                 "loop-start", &loop_start,
-                 "loop-end", &loop_end,
-                 NULL);
-
-    if(spectra->sample_mode == FFTUNE_MODE_LOOP)	/* loop mode? */
+    if(job->sample_mode == FFTUNE_MODE_LOOP)	/* loop mode? */
     {
-        start = loop_start;
+        start = job->loop_start;
 
-        count = loop_end - loop_start;   /* number of samples in loop */
+        count = job->loop_end - job->loop_start;   /* number of samples in loop */
         dsize = count * 2 + 1;	/* 2 iterations + 1 (first sample appended) */
+
+        /* loop cycles are not truncated */
+        fftsize = fftune_job_fft_size(job, &dsize, FALSE);
     }
     else	/* selection mode */
     {
-        if(spectra->sample_start == 0 && spectra->sample_end == 0)
+        if(job->sample_start == 0 && job->sample_end == 0)
         {
             start = 0;
-            count = sample_size;
+            count = job->sample_size;
         }
         else
         {
-            if(spectra->sample_start <= spectra->sample_end)
+            if(job->sample_start <= job->sample_end)
             {
-                start = spectra->sample_start;
-                count = spectra->sample_end - spectra->sample_start + 1;
+                start = job->sample_start;
+                count = job->sample_end - job->sample_start + 1;
             }
             else	/* swap start/end if backwards */
             {
-                start = spectra->sample_end;
-                count = spectra->sample_start - spectra->sample_end + 1;
+                start = job->sample_end;
+                count = job->sample_start - job->sample_end + 1;
             }
         }
 
-        if(spectra->limit && count > spectra->limit)
+        if(job->limit && count > job->limit)
+        {
+            count = job->limit;
+        }
+
+        /* use averaged spectrum of segments, if enabled and more than 1 */
+        if(job->segment_size && count > job->segment_size)
         {
-            count = spectra->limit;
+            return (fftune_job_calc_averaged(job, start, count));
         }
 
+        fftsize = fftune_job_fft_size(job, &count, TRUE);
         dsize = count;
     }
 
-    /* Allocate sample/result buffer, sample data is stored as floats and result
-     * is stored as doubles (dsize / 2 + 1 in length). */
-    data = g_try_malloc(sizeof(double) * (dsize / 2 + 1));   /* allocate transform array */
+    /* Allocate sample/result buffer, sample data is stored as floats (zero
+     * padded to fftsize) and result is stored as doubles (fftsize / 2 + 1 in
+     * length). */
+    data = g_try_malloc(sizeof(double) * (fftsize / 2 + 1));   /* allocate transform array */
 
     if(!data)
     {
-        g_critical(_(ERRMSG_MALLOC_1), (guint)(sizeof(double) * (dsize / 2 + 1)));
+        g_critical(_(ERRMSG_MALLOC_1), (guint)(sizeof(double) * (fftsize / 2 + 1)));
         return (FALSE);
     }
 
-    if(!ipatch_sample_handle_open(spectra->sample, &handle, 'r', SAMPLE_FORMAT,
+    if(!ipatch_sample_handle_open(job->sample, &handle, 'r', SAMPLE_FORMAT,
                                   IPATCH_SAMPLE_UNITY_CHANNEL_MAP, &err))
     {
         g_critical("Failed to open sample in FFTune plugin: %s",
@@ -657,7 +1387,13 @@ fftune_spectra_calc_spectrum(FFTuneSpectra *spectra)
 
     ipatch_sample_handle_close(&handle);
 
-    if(spectra->sample_mode == FFTUNE_MODE_LOOP)	/* do 2 iterations for loops */
+    if(g_atomic_int_get(&job->cancel))	/* superseded while reading? */
+    {
+        g_free(data);
+        return (FALSE);
+    }
+
+    if(job->sample_mode == FFTUNE_MODE_LOOP)	/* do 2 iterations for loops */
     {
         for(i = 0; i < count; i++)
         {
@@ -668,90 +1404,251 @@ fftune_spectra_calc_spectrum(FFTuneSpectra *spectra)
         ((float *)data)[dsize - 1] = ((float *)data)[0];
     }
 
-    result_size = dsize;
-
     g_get_current_time(&start_time);
 
-    if(spectra->enable_window)
+    if(job->enable_window)
     {
         for(i = 0; i < dsize; i++)
         {
-            ((float *)data)[i] *= (float)(0.5 * (1.0 - cos(2.0 * G_PI * ((float)i / (dsize - 1)))));
+            ((float *)data)[i] *= (float)fftune_window_value(job->window, i, dsize);
         }
     }
 
+    /* zero pad sample data up to FFT size */
+    for(i = dsize; i < fftsize; i++)
+    {
+        ((float *)data)[i] = 0.0;
+    }
+
     /* Calculate FFT power spectrum of sample data. Result is returned in the same array. */
-    result = fftune_spectra_run_fftw(data, &result_size);
+    if(!fftune_job_run_fftw(job, data, fftsize, data, FALSE))
+    {
+        g_free(data);
+        return (FALSE);
+    }
 
     g_get_current_time(&end_time);
 
     ellapsed = (float)((end_time.tv_sec - start_time.tv_sec)
                        + (end_time.tv_usec - start_time.tv_usec) / 1000000.0);
 
-    spectra->ellapsed_time = ellapsed;
+    job->ellapsed_time = ellapsed;
+
+    /* Resize data array to size of FFT power data */
+    result_size = fftsize / 2 + 1;
+    result = g_realloc(data, sizeof(double) * result_size);
+
+    job->spectrum = result;
+    job->spectrum_size = result_size;
+    job->fft_size = fftsize;
+
+    return (TRUE);
+}
+
+/* Calculate an averaged power spectrum (Welch's method) of count samples at
+ * start, from overlapping windowed segments of "segment-size" samples spaced
+ * "segment-hop" apart.  Sample data is streamed from the sample a hop at a
+ * time, so memory use only depends on the segment size. */
+static gboolean
+fftune_job_calc_averaged(FFTuneJob *job, guint start, guint count)
+{
+    IpatchSampleHandle handle;
+    GError *err = NULL;
+    float *segment;       /* current segment of sample data */
+    float *window;        /* window function values */
+    float *fftdata;       /* windowed and zero padded segment */
+    double *result;       /* averaged FFT power spectrum result */
+    int result_size;
+    guint segsize, hop, fftsize, pos, keep, segments, i;
+    GTimeVal start_time, end_time;
+    gboolean success = FALSE;
+
+    segsize = job->segment_size;
+    fftsize = fftune_job_fft_size(job, &segsize, TRUE);
+
+    hop = job->segment_hop ? job->segment_hop : segsize / 2;
+    hop = CLAMP(hop, 1, segsize);
 
-    if(!result)
+    result_size = fftsize / 2 + 1;
+
+    segment = g_try_malloc(sizeof(float) * segsize);
+    window = g_try_malloc(sizeof(float) * segsize);
+    fftdata = g_try_malloc(sizeof(float) * fftsize);
+    result = g_try_malloc0(sizeof(double) * result_size);
+
+    if(!segment || !window || !fftdata || !result)
     {
-        g_free(data);
+        g_critical(_(ERRMSG_MALLOC_1), (guint)(sizeof(float) * (segsize * 2 + fftsize)
+                   + sizeof(double) * result_size));
+        g_free(segment);
+        g_free(window);
+        g_free(fftdata);
+        g_free(result);
         return (FALSE);
     }
 
-    /* emit spectrum-change signal */
-    g_signal_emit(spectra, obj_signals[SPECTRUM_CHANGE], 0, result_size, result);
+    for(i = 0; i < segsize; i++)
+    {
+        window[i] = job->enable_window
+                    ? (float)fftune_window_value(job->window, i, segsize) : 1.0;
+    }
 
-    g_free(spectra->spectrum);
-    spectra->spectrum = result;
-    spectra->spectrum_size = result_size;
+    /* zero padding at end of FFT data is the same for all segments */
+    for(i = segsize; i < fftsize; i++)
+    {
+        fftdata[i] = 0.0;
+    }
 
-    return (TRUE);
-}
+    if(!ipatch_sample_handle_open(job->sample, &handle, 'r', SAMPLE_FORMAT,
+                                  IPATCH_SAMPLE_UNITY_CHANNEL_MAP, &err))
+    {
+        g_critical("Failed to open sample in FFTune plugin: %s",
+                   ipatch_gerror_message(err));
+        g_error_free(err);
+        goto ret;
+    }
 
-static double *
-fftune_spectra_run_fftw(void *data, int *dsize)
-{
-    fftwf_plan fftplan;
-    float *outdata;
-    int size = *dsize;
-    int outsize;
-    int i, x;
+    g_get_current_time(&start_time);
 
-    outsize = size / 2 + 1;
-    outdata = fftwf_malloc(sizeof(float) * size);   /* allocate output transform array */
+    /* samples of previous segment which overlap with the next one */
+    keep = segsize - hop;
 
-    if(!outdata)
+    for(pos = 0, segments = 0; count - pos >= segsize; pos += hop, segments++)
     {
-        g_critical(_(ERRMSG_MALLOC_1), (guint)(sizeof(float) * size));
-        return (NULL);
+        if(g_atomic_int_get(&job->cancel))	/* superseded? */
+        {
+            ipatch_sample_handle_close(&handle);
+            goto ret;
+        }
+
+        if(segments > 0 && keep > 0)	/* shift overlapping samples and read hop */
+        {
+            memmove(segment, segment + hop, sizeof(float) * keep);
+
+            if(!ipatch_sample_handle_read(&handle, start + pos + keep, hop,
+                                          segment + keep, &err))
+            {
+                break;
+            }
+        }
+        else if(!ipatch_sample_handle_read(&handle, start + pos, segsize,
+                                           segment, &err))	/* whole segment */
+        {
+            break;
+        }
+
+        for(i = 0; i < segsize; i++)
+        {
+            fftdata[i] = segment[i] * window[i];
+        }
+
+        if(!fftune_job_run_fftw(job, fftdata, fftsize, result, TRUE))
+        {
+            ipatch_sample_handle_close(&handle);
+            goto ret;
+        }
     }
 
-    /* create FFTW plan (real to half complex, in place transform) */
-    fftplan = fftwf_plan_r2r_1d(size, data, outdata, FFTW_R2HC, FFTW_ESTIMATE);
-    fftwf_execute(fftplan);	/* do the FFT calculation */
-    fftwf_destroy_plan(fftplan);
+    ipatch_sample_handle_close(&handle);
 
-    /* compute power spectrum (its stored over the output array) */
-    ((double *)data)[0] = outdata[0] * outdata[0];	/* DC component */
+    if(err)
+    {
+        g_critical("Failed to read sample data in FFTune plugin: %s",
+                   ipatch_gerror_message(err));
+        g_error_free(err);
+        goto ret;
+    }
 
-    x = (size + 1) / 2;
+    for(i = 0; i < (guint)result_size; i++)
+    {
+        result[i] /= segments;
+    }
 
-    for(i = 1; i < x; ++i)	/* (i < size/2 rounded up) */
+    g_get_current_time(&end_time);
+
+    job->ellapsed_time = (float)((end_time.tv_sec - start_time.tv_sec)
+                                     + (end_time.tv_usec - start_time.tv_usec) / 1000000.0);
+
+    job->spectrum = result;     /* !! job takes over result */
+    job->spectrum_size = result_size;
+    job->fft_size = fftsize;
+    result = NULL;
+
+    success = TRUE;
+
+ret:
+    g_free(segment);
+    g_free(window);
+    g_free(fftdata);
+    g_free(result);
+
+    return (success);
+}
+
+/* Calculate the power spectrum of size floats of data and store it to power
+ * (size / 2 + 1 doubles), or add it to power if accumulate is TRUE.  data
+ * and power may point to the same array. */
+static gboolean
+fftune_job_run_fftw(FFTuneJob *job, const float *data, int size,
+                    double *power, gboolean accumulate)
+{
+    FFTunePlan *plan;
+    unsigned flags;
+    float *outdata;
+    double val;
+    int i, x;
+
+    switch(job->planner)
     {
-        ((double *)data)[i] = outdata[i] * outdata[i] + outdata[size - i] * outdata[size - i];
+    case FFTUNE_PLANNER_MEASURE:
+        flags = FFTW_MEASURE;
+        break;
+
+    case FFTUNE_PLANNER_PATIENT:
+        flags = FFTW_PATIENT;
+        break;
+
+    default:
+        flags = FFTW_ESTIMATE;
+        break;
     }
 
-    if(size % 2 == 0)  /* count is even? */
+    G_LOCK(plan_cache);
+
+    /* get cached plan for this transform size (created if needed) */
+    plan = fftune_plan_get(size, flags);
+
+    if(!plan)
     {
-        ((double *)data)[size / 2] = outdata[size / 2] * outdata[size / 2];    /* Nyquist freq. */
+        G_UNLOCK(plan_cache);
+        return (FALSE);
     }
 
-    fftwf_free(outdata);
+    /* copy sample data to plan input array and do the FFT calculation */
+    memcpy(plan->in, data, sizeof(float) * size);
+    fftwf_execute(plan->plan);
+    outdata = plan->out;
 
-    *dsize = outsize;
+    /* compute power spectrum */
+    x = size / 2 + 1;
 
-    /* Resize data array to size of FFT power data */
-    data = realloc(data, sizeof(double) * outsize);
+    for(i = 0; i < x; ++i)
+    {
+        if(i == 0 || i * 2 == size)	/* DC component or Nyquist freq. */
+        {
+            val = outdata[i] * outdata[i];
+        }
+        else
+        {
+            val = outdata[i] * outdata[i] + outdata[size - i] * outdata[size - i];
+        }
+
+        power[i] = accumulate ? power[i] + val : val;
+    }
+
+    G_UNLOCK(plan_cache);
 
-    return (data);
+    return (TRUE);
 }
 
 /* typebag for temporary sorted GList of tunings.  Wouldn't need it if
@@ -785,7 +1682,7 @@ fftune_spectra_calc_tunings(FFTuneSpectra *spectra)
                  NULL);
 
     /* frequency resolution (frequency difference between array indexes) */
-    spectra->freqres = (double)sample_rate / ((spectra->spectrum_size - 1) * 2);
+    spectra->freqres = (double)sample_rate / spectra->fft_size;
 
     /* separation amount in array index units for selecting unique tunings */
     tolndx = (int)(spectra->separation / spectra->freqres + 0.5);
@@ -64,8 +64,17 @@ typedef struct
     float min_freq;	/* min freq for tuning suggestions */
     float max_freq;	/* max freq for tuning suggestions */
     int max_tunings;	/* maximum tuning suggestions to find */
-    int enable_window;    /* Enable Hann windowing of sample data */
+    int enable_window;    /* Enable windowing of sample data */
     float ellapsed_time;  /* Ellapsed time of last execution in seconds */
+    float calc_time;      /* Time from last update request to result in seconds */
+    gpointer job;         /* pending spectrum calculation job or NULL */
+    int planner;          /* FFTW planner effort (FFTUNE_PLANNER_*) */
+    int fft_size_mode;    /* FFT size policy (FFTUNE_FFT_SIZE_*) */
+    guint max_fft_size;   /* maximum FFT size or 0 for unlimited */
+    guint fft_size;       /* FFT size of current spectrum */
+    int window;           /* window function (FFTUNE_WINDOW_*) */
+    guint segment_size;   /* averaged spectrum segment size (0 for single FFT) */
+    guint segment_hop;    /* samples between segments (0 for half segment) */
 } FFTuneSpectra;
 
 typedef struct
@@ -80,6 +89,31 @@ enum
     FFTUNE_MODE_LOOP	/* sample loop */
 };
 
+/* FFTW planner effort enum */
+enum
+{
+    FFTUNE_PLANNER_ESTIMATE,	/* FFTW_ESTIMATE, no planning cost */
+    FFTUNE_PLANNER_MEASURE,	/* FFTW_MEASURE, measure fastest plan */
+    FFTUNE_PLANNER_PATIENT	/* FFTW_PATIENT, measure more plans */
+};
+
+/* FFT size policy enum */
+enum
+{
+    FFTUNE_FFT_SIZE_EXACT,	/* transform exactly the sample data size */
+    FFTUNE_FFT_SIZE_FAST,		/* zero pad to size with only factors 2, 3, 5, 7 */
+    FFTUNE_FFT_SIZE_POWER_OF_TWO	/* zero pad to power of two size */
+};
+
+/* window function enum */
+enum
+{
+    FFTUNE_WINDOW_HANN,		/* Hann (raised cosine) window */
+    FFTUNE_WINDOW_HAMMING,	/* Hamming window */
+    FFTUNE_WINDOW_BLACKMAN,	/* Blackman window */
+    FFTUNE_WINDOW_RECTANGULAR	/* no windowing */
+};
+
 
 GType fftune_spectra_get_type(void);
 FFTuneSpectra *fftune_spectra_new(void);
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <glib/gstdio.h>
+
 #include <libswami/libswami.h>
 #include <swamigui/swamigui.h>
 #include <libinstpatch/libinstpatch.h>
@@ -51,6 +53,25 @@
 /* max length of reverb/chorus preset names (including '\0') */
 #define PRESET_NAME_LEN 21
 
+/* max threads for background voice cache building of patch presets */
+#define CACHE_BUILD_THREADS 2
+
+/* slots for items of voice cache misses posted by note-on, and interval in
+ * milliseconds at which they are queued for caching */
+#define CACHE_MISS_SLOTS 64
+#define CACHE_MISS_INTERVAL 100
+
+/* interval in milliseconds at which voice caches of items changed by
+ * property notifies are updated (coalesces fast changes like slider drags) */
+#define CACHE_UPDATE_INTERVAL 100
+
+/* count of note-on time histogram buckets (log2 of microseconds) */
+#define NOTEON_HISTOGRAM_BUCKETS 16
+
+/* size of the MIDI event ring from the MIDI control to the audio callback
+ * (must be a power of 2) */
+#define MIDI_RING_SIZE 1024
+
 
 typedef struct _WavetblFluidSynth WavetblFluidSynth;
 typedef struct _WavetblFluidSynthClass WavetblFluidSynthClass;
@@ -67,6 +88,16 @@ typedef struct _WavetblFluidSynthClass WavetblFluidSynthClass;
 #define WAVETBL_IS_FLUIDSYNTH_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE ((klass), WAVETBL_TYPE_FLUIDSYNTH))
 
+typedef struct _WavetblFluidSynthRender WavetblFluidSynthRender;
+typedef struct _WavetblFluidSynthRenderClass WavetblFluidSynthRenderClass;
+
+#define WAVETBL_TYPE_FLUIDSYNTH_RENDER   (render_type)
+#define WAVETBL_FLUIDSYNTH_RENDER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), WAVETBL_TYPE_FLUIDSYNTH_RENDER, \
+   WavetblFluidSynthRender))
+#define WAVETBL_IS_FLUIDSYNTH_RENDER(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), WAVETBL_TYPE_FLUIDSYNTH_RENDER))
+
 typedef struct _realtime_noteon_t realtime_noteon_t;
 
 #define INTERPOLATION_TYPE (interp_mode_type)
@@ -94,6 +125,60 @@ typedef struct
 
 #define CHORUS_WAVEFORM_TYPE (chorus_waveform_type)
 
+/* FluidSynth data converted once per cached voice (IpatchSF2Voice user_data),
+ * so that note-on doesn't need to allocate or convert anything */
+typedef struct
+{
+    IpatchSampleStoreCache *store;	/* sample store kept open (or NULL) */
+    fluid_sample_t *sample;	/* FluidSynth sample shared by note-ons (or NULL) */
+    char *mods;			/* array of mod_count fluid_mod_t (fluid_mod_sizeof()) */
+    int mod_count;		/* count of modulators in mods */
+    IpatchSF2GenArray gen_array;	/* generators, note-on only reads these */
+} CachedVoice;
+
+/* get a modulator from a CachedVoice mods array */
+#define CACHED_VOICE_MOD(cvoice, i) \
+    ((fluid_mod_t *)((cvoice)->mods + (i) * fluid_mod_sizeof()))
+
+/* voice_cache_hash value, shared by the published hash and its copies */
+typedef struct
+{
+    IpatchSF2VoiceCache *cache;	/* voice cache (++ ref) */
+    guint64 size;			/* bytes of sample data kept open by cache */
+    volatile gint last_use;	/* voice_cache_clock value of last note-on */
+    int refcount;			/* count of hashes containing entry */
+} CacheEntry;
+
+/* realtime control state of the most recent note of the active item */
+typedef struct
+{
+    IpatchItem *item;		/* active item note was played on (no ref) */
+    IpatchSF2VoiceCache *cache;	/* voice cache of item (no ref, see rt_hold) */
+    int sel_values[IPATCH_SF2_VOICE_CACHE_MAX_SEL_VALUES]; /* sel criteria of note */
+    fluid_voice_t *voices[MAX_REALTIME_VOICES]; /* FluidSynth voices */
+    int count;			/* count of voices */
+} RealtimeNote;
+
+/* Coalesced realtime generator updates of the most recent note of the
+ * active item.  Only the latest value per voice and generator is kept, the
+ * batch is applied once per audio period (uses the rt_updates lock). */
+typedef struct
+{
+    int seq;			/* rt_seq of the note the updates are for */
+    fluid_voice_t *voices[MAX_REALTIME_VOICES]; /* FluidSynth voices of note */
+    int count;			/* count of voices (max MAX_REALTIME_VOICES) */
+    gint16 values[MAX_REALTIME_VOICES][IPATCH_SF2_GEN_COUNT]; /* gen values */
+    guint8 dirty[MAX_REALTIME_VOICES][IPATCH_SF2_GEN_COUNT]; /* TRUE if set */
+    guint16 pending[MAX_REALTIME_VOICES * IPATCH_SF2_GEN_COUNT]; /* dirty list */
+    int pending_count;		/* count of entries in pending */
+} RealtimeUpdates;
+
+/* timestamped MIDI event in the MIDI event ring */
+typedef struct
+{
+    gint64 time;			/* control event tick in microseconds */
+    SwamiMidiEvent event;		/* the MIDI event */
+} MidiRingEvent;
 
 /* FluidSynth SwamiWavetbl object */
 struct _WavetblFluidSynth
@@ -125,10 +210,38 @@ struct _WavetblFluidSynth
     /* active item is the focus, allow realtime control of most recent note of active item. */
     IpatchItem *active_item;			/* active audible instrument */
     IpatchItem *solo_item;                        /* child of active item to solo or NULL */
-    IpatchSF2VoiceCache *rt_cache;		/* voice cache of active_item */
-    int rt_sel_values[IPATCH_SF2_VOICE_CACHE_MAX_SEL_VALUES]; /* sel criteria of note */
-    fluid_voice_t *rt_voices[MAX_REALTIME_VOICES]; /* FluidSynth voices */
-    int rt_count;			/* count for rt_index_array and rt_voices */
+
+    /* rt_note is written by the synthesis thread only and read with the
+     * rt_seq sequence lock (odd while being written) */
+    volatile gint rt_seq;
+    RealtimeNote rt_note;
+    IpatchSF2VoiceCache *rt_hold;	/* keeps rt_note.cache alive if no longer published */
+    RealtimeUpdates *rt_updates;	/* pending realtime updates of rt_note */
+
+    gboolean preload_presets;	/* TRUE to cache all presets of loaded patches */
+    volatile gint cache_serial;	/* incremented on close to cancel CacheTasks */
+    volatile gint preload_batch;	/* incremented for each patch preload */
+    volatile gint preload_stop;	/* preload batch stopped at memory budget */
+
+    /* items of note-on voice cache misses (no ref, only compared), posted
+     * lock free by note-on and queued for caching by cache_miss_drain() */
+    gpointer volatile cache_misses[CACHE_MISS_SLOTS];
+    guint cache_miss_id;		/* cache_miss_drain() timeout source ID */
+
+    /* cached items changed by property notifies (item -> item, ++ ref) and
+     * the cache_update_flush() timeout source ID, uses wavetbl lock */
+    GHashTable *cache_dirty;
+    guint cache_update_id;
+
+    /* MIDI control events for the audio callback, written by MIDI control
+     * callbacks (serialized by the midi_ring lock), read lock free by the
+     * audio callback */
+    MidiRingEvent *midi_ring;
+    volatile gint midi_ring_head;	/* index of next event to write */
+    volatile gint midi_ring_tail;	/* index of next event to read */
+    volatile gint midi_ring_drops;	/* count of events dropped (ring full) */
+    double audio_rate;		/* sample rate of audio driver */
+    gint64 audio_period_usecs;	/* audio period duration in microseconds */
 };
 
 /* FluidSynth wavetbl class */
@@ -137,6 +250,84 @@ struct _WavetblFluidSynthClass
     SwamiWavetblClass parent_class; /* derived from SwamiWavetblClass */
 };
 
+/* event of an offline render event list (see "add-event" signal) */
+typedef struct
+{
+    guint time;			/* event time in milliseconds */
+    guint index;			/* order event was added in, for sorting */
+    SwamiMidiEvent event;		/* the MIDI event */
+} RenderEvent;
+
+/* Offline render object.  Renders a MIDI file or an event list through the
+ * sfloader, voice caches and settings of a WavetblFluidSynth to a sound
+ * file, faster than realtime and without an audio driver. */
+struct _WavetblFluidSynthRender
+{
+    GObject parent_instance;
+
+    WavetblFluidSynth *wavetbl;	/* wavetbl to render with (++ ref) */
+    IpatchList *patches;		/* patches to load or NULL for wavetbl's (++ ref) */
+    char *midi_file;		/* MIDI file to render or NULL for event list */
+    GArray *events;		/* event list (RenderEvent) */
+    char *file_name;		/* output sound file name */
+    int file_format;		/* output file format (IpatchSndFileFormat) */
+    gboolean float_output;	/* TRUE for float output, 16 bit otherwise */
+    int sample_rate;		/* output sample rate or 0 for wavetbl's */
+    int block_size;		/* frames rendered per fluid_synth_write_float() */
+    guint tail_time;		/* milliseconds rendered after the end */
+    int threads;			/* count of parts rendered in parallel */
+
+    GThread *thread;		/* render thread or NULL */
+    guint done_id;		/* idle source ID of render_done() or 0 */
+    volatile gint running;	/* TRUE while render thread is running */
+    volatile gint cancel;		/* set to TRUE to cancel render */
+    volatile gint position;	/* milliseconds rendered so far */
+    float realtime_factor;	/* audio time / render time of last render */
+    char *error;			/* error message of last render or NULL */
+};
+
+/* Offline render class */
+struct _WavetblFluidSynthRenderClass
+{
+    GObjectClass parent_class;
+
+    /* action signals */
+    void (*add_event)(WavetblFluidSynthRender *render, guint time,
+                      SwamiMidiEvent *event);
+    void (*clear_events)(WavetblFluidSynthRender *render);
+};
+
+/* block synchronization of parallel render parts */
+typedef struct
+{
+    GMutex *mutex;		/* lock for pending */
+    GCond *cond;			/* signaled when pending reaches 0 */
+    int pending;			/* count of parts still rendering a block */
+} RenderSync;
+
+/* Part of a render, a FluidSynth instance for a group of MIDI channels
+ * (channel % count == index) */
+typedef struct
+{
+    WavetblFluidSynthRender *render;	/* render object */
+    fluid_synth_t *synth;		/* FluidSynth instance of this part */
+    fluid_player_t *player;	/* MIDI file player or NULL */
+    RenderSync *sync;		/* block synchronization */
+    int index;			/* index of this part */
+    int count;			/* count of parts */
+    double rate;			/* sample rate */
+    float *buf;			/* interleaved stereo block buffer */
+    guint event_index;		/* index of next event in render events */
+    guint64 frames;		/* frame position of block to render */
+    guint block_frames;		/* count of frames to render in block */
+} RenderPart;
+
+/* default frames rendered per fluid_synth_write_float() call */
+#define RENDER_DEFAULT_BLOCK_SIZE   8192
+
+/* default milliseconds rendered after the end for releases and effects */
+#define RENDER_DEFAULT_TAIL_TIME    2000
+
 enum
 {
     WTBL_PROP_0,
@@ -154,7 +345,55 @@ enum
     WTBL_PROP_CHORUS_WAVEFORM,
     WTBL_PROP_ACTIVE_ITEM,
     WTBL_PROP_SOLO_ITEM,
-    WTBL_PROP_MODULATORS
+    WTBL_PROP_MODULATORS,
+    WTBL_PROP_PRELOAD_PRESETS,
+    WTBL_PROP_CACHE_SIZE_LIMIT,
+    WTBL_PROP_CACHE_SIZE,
+    WTBL_PROP_CACHE_HITS,
+    WTBL_PROP_CACHE_MISSES,
+    WTBL_PROP_CACHE_EVICTIONS,
+    WTBL_PROP_NOTEON_COUNT,
+    WTBL_PROP_NOTEON_TIME_AVG,
+    WTBL_PROP_NOTEON_TIME_MAX,
+    WTBL_PROP_NOTEON_HISTOGRAM,
+    WTBL_PROP_VOICE_ALLOC_FAILURES,
+    WTBL_PROP_ACTIVE_VOICES,
+    WTBL_PROP_CPU_LOAD,
+    WTBL_PROP_CACHE_BUILD_COUNT,
+    WTBL_PROP_CACHE_BUILD_TIME_AVG,
+    WTBL_PROP_CACHE_BUILD_TIME_MAX,
+    WTBL_PROP_LOCK_WAIT_COUNT,
+    WTBL_PROP_LOCK_WAIT_TIME,
+    WTBL_PROP_MIDI_EVENTS_DROPPED,
+    WTBL_PROP_STATS_REPORT
+};
+
+/* offline render properties */
+enum
+{
+    RENDER_PROP_0,
+    RENDER_PROP_WAVETBL,
+    RENDER_PROP_PATCHES,
+    RENDER_PROP_MIDI_FILE,
+    RENDER_PROP_FILE_NAME,
+    RENDER_PROP_FILE_FORMAT,
+    RENDER_PROP_FLOAT_OUTPUT,
+    RENDER_PROP_SAMPLE_RATE,
+    RENDER_PROP_BLOCK_SIZE,
+    RENDER_PROP_TAIL_TIME,
+    RENDER_PROP_THREADS,
+    RENDER_PROP_ACTIVE,
+    RENDER_PROP_POSITION,
+    RENDER_PROP_REALTIME_FACTOR,
+    RENDER_PROP_ERROR
+};
+
+/* offline render signals */
+enum
+{
+    RENDER_ADD_EVENT,
+    RENDER_CLEAR_EVENTS,
+    RENDER_LAST_SIGNAL
 };
 
 /* number to use for first dynamic (FluidSynth settings) property */
@@ -184,6 +423,15 @@ typedef struct
     IpatchItem *item;		/* instrument item */
 } sfloader_preset_data_t;
 
+/* background voice cache build task (see cache_pool) */
+typedef struct
+{
+    WavetblFluidSynth *wavetbl;	/* wavetable object (++ ref) */
+    IpatchItem *item;		/* instrument item to cache (++ ref) */
+    int serial;			/* wavetbl cache_serial when task was queued */
+    int batch;			/* wavetbl preload_batch or 0 if not a preload */
+} CacheTask;
+
 /* FluidSynth property flags (for exceptions such as string booleans) */
 typedef enum
 {
@@ -224,6 +472,12 @@ wavetbl_fluidsynth_midi_ctrl_callback(SwamiControl *control,
                                       const GValue *value);
 static gboolean wavetbl_fluidsynth_open(SwamiWavetbl *swami_wavetbl,
                                         GError **err);
+static gint64 midi_ring_time(void);
+static gboolean midi_ring_push(WavetblFluidSynth *wavetbl,
+                               const struct timeval *tick,
+                               const SwamiMidiEvent *midi);
+static int wavetbl_fluidsynth_audio_func(void *data, int len, int nfx,
+        float *fx[], int nout, float *out[]);
 static void wavetbl_fluidsynth_prop_callback(IpatchItemPropNotify *notify);
 static int wavetbl_fluidsynth_handle_midi_event(void *data,
         fluid_midi_event_t *event);
@@ -241,9 +495,12 @@ static gboolean wavetbl_fluidsynth_check_update_item(SwamiWavetbl *wavetbl,
 static void wavetbl_fluidsynth_update_item(SwamiWavetbl *wavetbl,
         IpatchItem *item);
 static void wavetbl_fluidsynth_update_reverb(WavetblFluidSynth *wavetbl);
+static void synth_set_reverb(fluid_synth_t *synth, const ReverbParams *params);
 static int find_reverb_preset(const char *name);
 static void wavetbl_fluidsynth_update_chorus(WavetblFluidSynth *wavetbl);
+static void synth_set_chorus(fluid_synth_t *synth, const ChorusParams *params);
 static int find_chorus_preset(const char *name);
+static void synth_midi_event(fluid_synth_t *synth, const SwamiMidiEvent *midi);
 
 static fluid_sfont_t *sfloader_load_sfont(fluid_sfloader_t *loader,
         const char *filename);
@@ -259,14 +516,106 @@ static int sfloader_preset_get_num(fluid_preset_t *preset);
 static int sfloader_preset_noteon(fluid_preset_t *preset,
                                   fluid_synth_t *synth,
                                   int chan, int key, int vel);
-static void cache_instrument(WavetblFluidSynth *wavetbl, IpatchItem *item);
-static int cache_instrument_noteon(WavetblFluidSynth *wavetbl, IpatchItem *item,
+static GHashTable *voice_cache_hash_copy(void);
+static CacheEntry *cache_entry_new(IpatchSF2VoiceCache *cache, guint64 size);
+static void cache_entry_unref(CacheEntry *entry);
+static void voice_cache_hash_copy_GHFunc(gpointer key, gpointer value,
+        gpointer user_data);
+static void voice_cache_hash_publish(GHashTable *hash);
+static gboolean voice_cache_hash_find_value(gpointer key, gpointer value,
+        gpointer user_data);
+static void voice_cache_synchronize(void);
+static void voice_cache_evict(GHashTable *hash, IpatchItem *keep_item);
+static void voice_cache_pin(GSList *items);
+static void voice_cache_unpin(GSList *items);
+static void voice_cache_evict_GHFunc(gpointer key, gpointer value,
+                                     gpointer user_data);
+static GHashTable *voice_cache_read_begin(int *epoch);
+static void voice_cache_read_end(int epoch);
+static int rt_note_read(WavetblFluidSynth *wavetbl, RealtimeNote *note);
+static CachedVoice *cached_voice_new(IpatchSF2Voice *voice);
+static void cached_voice_convert_mods(CachedVoice *cvoice, GSList *mod_list);
+static void cached_voice_free(CachedVoice *cvoice);
+static void retired_synth_add(fluid_synth_t *synth);
+static void retired_synth_delete(fluid_synth_t *synth);
+static void retired_samples_free(void);
+static unsigned int *retired_voice_ids(int *count);
+static int retired_voice_id_compare(const void *a, const void *b);
+static gboolean cache_instrument(WavetblFluidSynth *wavetbl, IpatchItem *item,
+                                 gboolean preload);
+static IpatchSF2VoiceCache *cache_instrument_convert(WavetblFluidSynth *wavetbl,
+        IpatchItem *item);
+static gboolean cache_instrument_load(IpatchItem *item,
+                                      IpatchSF2VoiceCache *cache,
+                                      gboolean preload);
+static gboolean cache_instrument_update(WavetblFluidSynth *wavetbl,
+                                        IpatchItem *item);
+static gboolean cache_voices_compatible(IpatchSF2VoiceCache *cache,
+                                        IpatchSF2VoiceCache *new_cache);
+static gboolean mod_list_equal(GSList *a, GSList *b);
+static void cache_task_queue(WavetblFluidSynth *wavetbl, IpatchItem *item,
+                             int batch);
+static gboolean cache_item_is_preset(IpatchItem *item);
+static void cache_patch_presets(WavetblFluidSynth *wavetbl, IpatchItem *patch);
+static void cache_task_run(gpointer data, gpointer user_data);
+static void cache_miss_post(WavetblFluidSynth *wavetbl, IpatchItem *item);
+static gboolean cache_miss_drain(gpointer data);
+static void cache_update_clear(WavetblFluidSynth *wavetbl);
+static gboolean cache_update_flush(gpointer data);
+static void cache_update_GHFunc(gpointer key, gpointer value,
+                                gpointer user_data);
+static GSList *wavetbl_get_patches(WavetblFluidSynth *wavetbl);
+static int cache_instrument_noteon(WavetblFluidSynth *wavetbl,
+                                   GHashTable *hash, IpatchItem *item,
                                    fluid_synth_t *synth, int chan, int key,
                                    int vel);
+static void rt_updates_apply(WavetblFluidSynth *wavetbl, gboolean wait);
+static gint64 stats_time_usec(void);
+static void stats_max(volatile gint *max, gint value);
+static void stats_cache_build(gint64 start);
+static void stats_fold(void);
+static char *stats_report(WavetblFluidSynth *wavetbl);
+static void voice_cache_lock(void);
 static void active_item_realtime_update(WavetblFluidSynth *wavetbl,
                                         IpatchItem *item, GParamSpec *pspec,
                                         const GValue *value);
 
+static GType render_register_type(SwamiPlugin *plugin);
+static void render_class_init(WavetblFluidSynthRenderClass *klass);
+static void render_init(WavetblFluidSynthRender *render);
+static void render_finalize(GObject *object);
+static void render_set_property(GObject *object, guint property_id,
+                                const GValue *value, GParamSpec *pspec);
+static void render_get_property(GObject *object, guint property_id,
+                                GValue *value, GParamSpec *pspec);
+static void render_real_add_event(WavetblFluidSynthRender *render, guint time,
+                                  SwamiMidiEvent *event);
+static void render_real_clear_events(WavetblFluidSynthRender *render);
+static void render_start(WavetblFluidSynthRender *render);
+static void render_stop(WavetblFluidSynthRender *render);
+static gboolean render_done(gpointer data);
+static gpointer render_thread(gpointer data);
+static gboolean render_run(WavetblFluidSynthRender *render, GError **err);
+static GSList *render_cache_presets(WavetblFluidSynthRender *render,
+                                 GSList *patches);
+static void render_part_block(RenderPart *part);
+static void render_part_func(gpointer data, gpointer user_data);
+#if FLUID_VERSION_ATLEAST(2,2,0)
+static int render_part_playback(void *data, fluid_midi_event_t *event);
+#endif
+static GSList *render_get_patches(WavetblFluidSynthRender *render);
+static fluid_settings_t *render_settings_new(WavetblFluidSynth *wavetbl,
+        int sample_rate);
+static void render_settings_copy(void *data, const char *name, int type);
+static fluid_synth_t *render_synth_new(WavetblFluidSynth *wavetbl,
+                                       fluid_settings_t *settings,
+                                       GSList *patches);
+static gboolean render_write(WavetblFluidSynthRender *render,
+                             IpatchSampleHandle *handle, const float *buf,
+                             guint count, guint64 *frames, double rate,
+                             GError **err);
+static gint render_event_compare(gconstpointer a, gconstpointer b);
+
 /* FluidSynth settings boolean exceptions (yes/no string values) */
 static const char *settings_str_bool[] =
 {
@@ -283,8 +632,11 @@ static const char *settings_str_bool[] =
 static GType wavetbl_type = 0;
 static GType interp_mode_type = 0;
 static GType chorus_waveform_type = 0;
+static GType render_type = 0;
 
 static GObjectClass *wavetbl_parent_class = NULL;
+static GObjectClass *render_parent_class = NULL;
+static guint render_signals[RENDER_LAST_SIGNAL] = { 0 };
 
 /* last dynamic property ID (incremented for each dynamically installed prop) */
 static guint last_property_id = FIRST_DYNAMIC_PROP;
@@ -299,9 +651,86 @@ static guint8 *dynamic_prop_flags;
 /* Quark key used for assigning FluidSynth options string arrays to GParamSpecs */
 GQuark wavetbl_fluidsynth_options_quark;
 
-/* keeps a hash of patch objects to SF2VoiceCache objects */
+/* Hash of patch objects to SF2VoiceCache objects.  The hash is published
+ * RCU style for the synthesis thread: a published hash is never modified.
+ * Writers (holding the voice_cache_hash lock) publish a modified copy and
+ * free the previous hash once no note-on can still be using it, so note-on
+ * never blocks on a lock or touches GObject reference counts.  Readers
+ * announce themselves in voice_cache_readers for the current epoch. */
 G_LOCK_DEFINE_STATIC(voice_cache_hash);
 static GHashTable *voice_cache_hash = NULL;
+static volatile gint voice_cache_epoch = 0;
+static volatile gint voice_cache_readers[2] = { 0, 0 };
+
+/* list of WavetblFluidSynth objects (for rt_hold), uses voice_cache_hash lock */
+static GSList *wavetbl_list = NULL;
+
+/* Voice cache memory budget, shared by all wavetbl objects.  The least
+ * recently played instruments are evicted when the sample data size of the
+ * published hash exceeds voice_cache_size_limit (uses voice_cache_hash lock). */
+static guint64 voice_cache_size = 0;		/* bytes of cached sample data */
+static guint64 voice_cache_size_limit = 0;	/* max bytes or 0 for unlimited */
+static GHashTable *voice_cache_pins = NULL;	/* item -> pin count, not evicted */
+static volatile gint voice_cache_clock = 0;	/* incremented for every note-on */
+static volatile gint voice_cache_hits = 0;	/* note-ons of cached items */
+static volatile gint voice_cache_misses = 0;	/* note-ons of uncached items */
+static volatile gint voice_cache_evictions = 0;	/* count of evicted items */
+
+/* Synthesis statistics, shared by all wavetbl objects like the cache
+ * counters above.  Note-on and lock wait counters are updated atomically,
+ * the cache build counters and 64 bit time totals use the synth_stats lock.
+ * Times are in microseconds.  The note-on and lock wait times are added to
+ * 32 bit pending counters, which stats_fold() moves to the totals. */
+static volatile gint noteon_count = 0;		/* count of timed note-ons */
+static volatile gint noteon_time_pending = 0;	/* note-on time not in total */
+static volatile gint noteon_time_max = 0;	/* longest note-on time */
+static volatile gint noteon_histogram[NOTEON_HISTOGRAM_BUCKETS]; /* bucket N: < 2^N */
+static volatile gint voice_alloc_failures = 0;	/* failed voice allocations */
+static volatile gint lock_wait_count = 0;	/* contended voice_cache_hash locks */
+static volatile gint lock_wait_pending = 0;	/* lock wait time not in total */
+
+G_LOCK_DEFINE_STATIC(synth_stats);
+static guint64 noteon_time_total = 0;		/* total note-on time */
+static guint64 lock_wait_time = 0;		/* total voice_cache_hash lock wait */
+static guint cache_build_count = 0;		/* count of voice cache builds */
+static guint64 cache_build_time_total = 0;	/* total voice cache build time */
+static guint cache_build_time_max = 0;		/* longest voice cache build */
+
+/* FluidSynth samples of freed voice caches, which could still be playing.
+ * Once no new note-on can use them (voice caches are freed after
+ * voice_cache_synchronize()), only the voices playing at that time can.
+ * retired_samples_free() moves newly retired samples into a batch with the
+ * IDs of those voices and deletes a batch once none of them is playing. */
+typedef struct
+{
+    GSList *samples;		/* retired fluid_sample_t of batch */
+    unsigned int *voice_ids;	/* sorted IDs of voices playing at retire time */
+    int voice_count;		/* count of voice_ids */
+    gboolean ended;		/* TRUE if voices had ended on previous check */
+} RetiredBatch;
+
+G_LOCK_DEFINE_STATIC(retired_samples);
+static GSList *retired_samples = NULL;	/* samples not yet in a batch */
+
+/* lock for retired_synths and retired_batches, taken before retired_samples
+ * (deleting a synth can free voice caches) */
+G_LOCK_DEFINE_STATIC(retired_synths);
+static GSList *retired_synths = NULL;	/* synths which could play samples */
+static GSList *retired_batches = NULL;	/* RetiredBatch list */
+
+/* lock for wavetbl rt_updates, only tried by the audio callback */
+G_LOCK_DEFINE_STATIC(rt_updates);
+
+/* serializes writers of wavetbl MIDI event rings */
+G_LOCK_DEFINE_STATIC(midi_ring);
+
+/* thread pool for background voice cache building of loaded patch presets */
+static GThreadPool *cache_pool = NULL;
+static volatile gint cache_pool_exit = FALSE;	/* TRUE to skip queued tasks */
+
+/* items queued or being cached in cache_pool, so each is queued only once */
+G_LOCK_DEFINE_STATIC(cache_pending);
+static GHashTable *cache_pending = NULL;
 
 /* Reverb and Chorus preset tables (index 0 contains default values) */
 G_LOCK_DEFINE_STATIC(preset_tables);	/* lock for reverb and chorus tables */
@@ -350,7 +779,8 @@ plugin_fluidsynth_init(SwamiPlugin *plugin, GError **err)
 
     /* initialize voice cache hash */
     voice_cache_hash = g_hash_table_new_full(NULL, NULL, NULL,
-                       (GDestroyNotify)g_object_unref);
+                       (GDestroyNotify)cache_entry_unref);
+    voice_cache_pins = g_hash_table_new(NULL, NULL);
     /* initialize built-in reverb and chorus presets
      * !! Make sure that name field ends in NULLs (strncpy does this).
      * !! If not, then a potential multi-thread string crash could occur.
@@ -421,6 +851,24 @@ plugin_fluidsynth_init(SwamiPlugin *plugin, GError **err)
         chorus_waveform_type = chorus_waveform_register_type(plugin);
     }
 
+    if(!render_type)
+    {
+        render_type = render_register_type(plugin);
+    }
+
+    if(!cache_pool)
+    {
+        cache_pool = g_thread_pool_new(cache_task_run, NULL,
+                                       CACHE_BUILD_THREADS, FALSE, err);
+
+        if(!cache_pool)
+        {
+            return (FALSE);
+        }
+
+        cache_pending = g_hash_table_new(NULL, NULL);
+    }
+
     return (TRUE);
 }
 
@@ -430,8 +878,22 @@ plugin_fluidsynth_exit (SwamiPlugin *plugin)
 {
     guint i;
 
+    /* stop background voice caching, queued tasks are skipped but still
+     * release their references */
+    if(cache_pool)
+    {
+        g_atomic_int_set(&cache_pool_exit, TRUE);
+        g_thread_pool_free(cache_pool, FALSE, TRUE);
+        cache_pool = NULL;
+
+        g_hash_table_destroy(cache_pending);
+        cache_pending = NULL;
+    }
+
     /* free static table allocated in plugin_fluidsynth_init(). */
     g_hash_table_destroy(voice_cache_hash);
+    g_hash_table_destroy(voice_cache_pins);
+    retired_samples_free();
 
     g_free(reverb_presets);
     g_free(chorus_presets);
@@ -712,6 +1174,106 @@ wavetbl_fluidsynth_class_init(WavetblFluidSynthClass *klass)
                                             _("Modulators"),
                                             IPATCH_TYPE_SF2_MOD_LIST,
                                             G_PARAM_READWRITE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_PRELOAD_PRESETS,
+                                    g_param_spec_boolean("preload-presets", _("Preload presets"),
+                                            _("Cache all presets of loaded patches in the background"),
+                                            TRUE, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_SIZE_LIMIT,
+                                    g_param_spec_uint("cache-size-limit", _("Cache size limit"),
+                                            _("Max megabytes of cached sample data (0 = unlimited)"),
+                                            0, G_MAXUINT, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_SIZE,
+                                    g_param_spec_uint64("cache-size", _("Cache size"),
+                                            _("Bytes of cached sample data"),
+                                            0, G_MAXUINT64, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_HITS,
+                                    g_param_spec_uint("cache-hits", _("Cache hits"),
+                                            _("Count of note-ons of cached instruments"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_MISSES,
+                                    g_param_spec_uint("cache-misses", _("Cache misses"),
+                                            _("Count of note-ons of uncached instruments"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_EVICTIONS,
+                                    g_param_spec_uint("cache-evictions", _("Cache evictions"),
+                                            _("Count of instruments evicted from the cache"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_NOTEON_COUNT,
+                                    g_param_spec_uint("noteon-count", _("Note-on count"),
+                                            _("Count of timed note-ons"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_NOTEON_TIME_AVG,
+                                    g_param_spec_double("noteon-time-avg", _("Note-on time average"),
+                                            _("Average note-on time in microseconds"),
+                                            0.0, G_MAXDOUBLE, 0.0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_NOTEON_TIME_MAX,
+                                    g_param_spec_uint("noteon-time-max", _("Note-on time max"),
+                                            _("Longest note-on time in microseconds"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_NOTEON_HISTOGRAM,
+                                    g_param_spec_value_array("noteon-histogram", _("Note-on histogram"),
+                                            _("Note-on counts by time, element N counts times below 2^N microseconds, the last one all longer times"),
+                                            g_param_spec_uint("count", NULL, NULL,
+                                                    0, G_MAXUINT, 0,
+                                                    G_PARAM_READABLE),
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_VOICE_ALLOC_FAILURES,
+                                    g_param_spec_uint("voice-alloc-failures", _("Voice allocation failures"),
+                                            _("Count of failed FluidSynth voice allocations"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_MIDI_EVENTS_DROPPED,
+                                    g_param_spec_uint("midi-events-dropped", _("MIDI events dropped"),
+                                            _("Count of MIDI control events dropped because the audio callback event queue was full"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_ACTIVE_VOICES,
+                                    g_param_spec_int("active-voices", _("Active voices"),
+                                            _("Count of active FluidSynth voices"),
+                                            0, G_MAXINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CPU_LOAD,
+                                    g_param_spec_double("cpu-load", _("CPU load"),
+                                            _("FluidSynth CPU load in percent"),
+                                            0.0, G_MAXDOUBLE, 0.0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_BUILD_COUNT,
+                                    g_param_spec_uint("cache-build-count", _("Cache build count"),
+                                            _("Count of instrument voice cache builds"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_BUILD_TIME_AVG,
+                                    g_param_spec_double("cache-build-time-avg", _("Cache build time average"),
+                                            _("Average voice cache build time in microseconds"),
+                                            0.0, G_MAXDOUBLE, 0.0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_CACHE_BUILD_TIME_MAX,
+                                    g_param_spec_uint("cache-build-time-max", _("Cache build time max"),
+                                            _("Longest voice cache build time in microseconds"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_LOCK_WAIT_COUNT,
+                                    g_param_spec_uint("lock-wait-count", _("Lock wait count"),
+                                            _("Count of contended voice cache lock acquisitions"),
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_LOCK_WAIT_TIME,
+                                    g_param_spec_uint64("lock-wait-time", _("Lock wait time"),
+                                            _("Total voice cache lock wait time in microseconds"),
+                                            0, G_MAXUINT64, 0,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
+    g_object_class_install_property(obj_class, WTBL_PROP_STATS_REPORT,
+                                    g_param_spec_string("stats-report", _("Statistics report"),
+                                            _("Text report of the synthesis statistics"),
+                                            NULL,
+                                            G_PARAM_READABLE | IPATCH_PARAM_NO_SAVE));
 }
 
 /* for counting the number of FluidSynth settings properties */
@@ -904,8 +1466,14 @@ wavetbl_fluidsynth_init(WavetblFluidSynth *wavetbl)
     wavetbl->chorus_params = chorus_presets[0];
 
     wavetbl->active_item = NULL;
-    wavetbl->rt_cache = NULL;
-    wavetbl->rt_count = 0;
+    wavetbl->preload_presets = TRUE;
+
+    wavetbl->midi_ring = g_new0(MidiRingEvent, MIDI_RING_SIZE);
+    wavetbl->rt_updates = g_new0(RealtimeUpdates, 1);
+
+    voice_cache_lock();
+    wavetbl_list = g_slist_prepend(wavetbl_list, wavetbl);
+    G_UNLOCK(voice_cache_hash);
 }
 
 static void
@@ -913,8 +1481,27 @@ wavetbl_fluidsynth_finalize(GObject *object)
 {
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(object);
 
+    if(wavetbl->cache_miss_id)
+    {
+        g_source_remove(wavetbl->cache_miss_id);
+    }
+
+    cache_update_clear(wavetbl);
+
+    voice_cache_lock();
+    wavetbl_list = g_slist_remove(wavetbl_list, wavetbl);
+
+    if(wavetbl->rt_hold)
+    {
+        g_object_unref(wavetbl->rt_hold);    /* -- unref held voice cache */
+    }
+
+    G_UNLOCK(voice_cache_hash);
+
     g_free(wavetbl->banks);
     g_free(wavetbl->programs);
+    g_free(wavetbl->midi_ring);
+    g_free(wavetbl->rt_updates);
 
     if(wavetbl->midi_ctrl)
     {
@@ -936,6 +1523,7 @@ wavetbl_fluidsynth_set_property(GObject *object, guint property_id,
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(object);
     GSList *oldmods, *newmods;
     IpatchItem *item, *active_item;
+    GHashTable *hash;
     char *name;
     const char *s;
     int retval;
@@ -1148,6 +1736,25 @@ wavetbl_fluidsynth_set_property(GObject *object, guint property_id,
 
         break;
 
+    case WTBL_PROP_PRELOAD_PRESETS:
+        wavetbl->preload_presets = g_value_get_boolean(value);
+        break;
+
+    case WTBL_PROP_CACHE_SIZE_LIMIT:
+        voice_cache_lock();
+        voice_cache_size_limit = (guint64)g_value_get_uint(value) * (1024 * 1024);
+
+        /* evict now if over the new limit */
+        if(voice_cache_size_limit && voice_cache_size > voice_cache_size_limit)
+        {
+            hash = voice_cache_hash_copy();
+            voice_cache_evict(hash, NULL);
+            voice_cache_hash_publish(hash);
+        }
+
+        G_UNLOCK(voice_cache_hash);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
@@ -1159,11 +1766,13 @@ wavetbl_fluidsynth_get_property(GObject *object, guint property_id,
                                 GValue *value, GParamSpec *pspec)
 {
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(object);
+    GValueArray *valarray;
+    GValue elem = { 0 };
     GSList *mods;
     char s[256];
     char *name;
     double d;
-    int retval;
+    int retval, count;
     int i;
     GStrv strv;
 
@@ -1323,6 +1932,122 @@ wavetbl_fluidsynth_get_property(GObject *object, guint property_id,
         g_value_take_boxed(value, mods);
         break;
 
+    case WTBL_PROP_PRELOAD_PRESETS:
+        g_value_set_boolean(value, wavetbl->preload_presets);
+        break;
+
+    case WTBL_PROP_CACHE_SIZE_LIMIT:
+        voice_cache_lock();
+        g_value_set_uint(value, voice_cache_size_limit / (1024 * 1024));
+        G_UNLOCK(voice_cache_hash);
+        break;
+
+    case WTBL_PROP_CACHE_SIZE:
+        voice_cache_lock();
+        g_value_set_uint64(value, voice_cache_size);
+        G_UNLOCK(voice_cache_hash);
+        break;
+
+    case WTBL_PROP_CACHE_HITS:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&voice_cache_hits));
+        break;
+
+    case WTBL_PROP_CACHE_MISSES:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&voice_cache_misses));
+        break;
+
+    case WTBL_PROP_CACHE_EVICTIONS:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&voice_cache_evictions));
+        break;
+
+    case WTBL_PROP_NOTEON_COUNT:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&noteon_count));
+        break;
+
+    case WTBL_PROP_NOTEON_TIME_AVG:
+        stats_fold();
+        G_LOCK(synth_stats);
+        count = g_atomic_int_get(&noteon_count);
+        g_value_set_double(value, count ? (double)noteon_time_total
+                           / (guint)count : 0.0);
+        G_UNLOCK(synth_stats);
+        break;
+
+    case WTBL_PROP_NOTEON_TIME_MAX:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&noteon_time_max));
+        break;
+
+    case WTBL_PROP_NOTEON_HISTOGRAM:
+        valarray = g_value_array_new(NOTEON_HISTOGRAM_BUCKETS);
+        g_value_init(&elem, G_TYPE_UINT);
+
+        for(i = 0; i < NOTEON_HISTOGRAM_BUCKETS; i++)
+        {
+            g_value_set_uint(&elem, (guint)g_atomic_int_get(&noteon_histogram[i]));
+            g_value_array_append(valarray, &elem);
+        }
+
+        g_value_unset(&elem);
+        g_value_take_boxed(value, valarray);   /* !! takes over array */
+        break;
+
+    case WTBL_PROP_VOICE_ALLOC_FAILURES:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&voice_alloc_failures));
+        break;
+
+    case WTBL_PROP_MIDI_EVENTS_DROPPED:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&wavetbl->midi_ring_drops));
+        break;
+
+    case WTBL_PROP_ACTIVE_VOICES:
+        SWAMI_LOCK_READ(wavetbl);
+        g_value_set_int(value, wavetbl->synth
+                        ? fluid_synth_get_active_voice_count(wavetbl->synth) : 0);
+        SWAMI_UNLOCK_READ(wavetbl);
+        break;
+
+    case WTBL_PROP_CPU_LOAD:
+        SWAMI_LOCK_READ(wavetbl);
+        g_value_set_double(value, wavetbl->synth
+                           ? fluid_synth_get_cpu_load(wavetbl->synth) : 0.0);
+        SWAMI_UNLOCK_READ(wavetbl);
+        break;
+
+    case WTBL_PROP_CACHE_BUILD_COUNT:
+        G_LOCK(synth_stats);
+        g_value_set_uint(value, cache_build_count);
+        G_UNLOCK(synth_stats);
+        break;
+
+    case WTBL_PROP_CACHE_BUILD_TIME_AVG:
+        G_LOCK(synth_stats);
+        g_value_set_double(value, cache_build_count
+                           ? (double)cache_build_time_total / cache_build_count
+                           : 0.0);
+        G_UNLOCK(synth_stats);
+        break;
+
+    case WTBL_PROP_CACHE_BUILD_TIME_MAX:
+        G_LOCK(synth_stats);
+        g_value_set_uint(value, cache_build_time_max);
+        G_UNLOCK(synth_stats);
+        break;
+
+    case WTBL_PROP_LOCK_WAIT_COUNT:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&lock_wait_count));
+        break;
+
+    case WTBL_PROP_LOCK_WAIT_TIME:
+        stats_fold();
+        G_LOCK(synth_stats);
+        g_value_set_uint64(value, lock_wait_time);
+        G_UNLOCK(synth_stats);
+        break;
+
+    case WTBL_PROP_STATS_REPORT:
+        g_value_take_string(value, stats_report(wavetbl));
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
         break;
@@ -1398,64 +2123,173 @@ wavetbl_fluidsynth_midi_ctrl_callback(SwamiControl *control,
         if(G_VALUE_TYPE(value) == SWAMI_TYPE_MIDI_EVENT
                 && (midi = g_value_get_boxed(value)))
         {
-            switch(midi->type)
+            /* update channel bank and program # */
+            if(midi->channel < wavetbl->channel_count)
             {
-            case SWAMI_MIDI_NOTE_ON:
-                fluid_synth_noteon(synth, midi->channel, midi->data.note.note,
-                                   midi->data.note.velocity);
-                break;
+                if(midi->type == SWAMI_MIDI_CONTROL14
+                        && midi->data.control.param == SWAMI_MIDI_CC_BANK_MSB)
+                {
+                    wavetbl->banks[midi->channel] = midi->data.control.value;
+                }
+                else if(midi->type == SWAMI_MIDI_PROGRAM_CHANGE)
+                {
+                    wavetbl->programs[midi->channel] = midi->data.control.value;
+                }
+            }
 
-            case SWAMI_MIDI_NOTE_OFF:
-                fluid_synth_noteoff(synth, midi->channel, midi->data.note.note);
-                break;
+            /* queue for the audio callback or apply now if no audio driver.
+             * Events are dropped if the ring is full, applying them now
+             * would reorder them before queued ones. */
+            if(!wavetbl->audio)
+            {
+                synth_midi_event(synth, midi);
+            }
+            else if(!midi_ring_push(wavetbl, &event->tick, midi))
+            {
+                g_atomic_int_inc(&wavetbl->midi_ring_drops);
+            }
+        }
 
-            case SWAMI_MIDI_PITCH_BEND:	/* FluidSynth uses 0-16383 */
-                fluid_synth_pitch_bend(synth, midi->channel,
-                                       midi->data.control.value + 8192);
-                break;
+        i++;
+    }
+}
 
-            case SWAMI_MIDI_CONTROL:
-                fluid_synth_cc(synth, midi->channel, midi->data.control.param,
-                               midi->data.control.value);
-                break;
+/* Queue a MIDI event for the audio callback.  Returns FALSE if the ring is
+ * full.  MT-NOTE: The audio callback is the only reader, so only the head
+ * needs a lock. */
+static gboolean
+midi_ring_push(WavetblFluidSynth *wavetbl, const struct timeval *tick,
+               const SwamiMidiEvent *midi)
+{
+    MidiRingEvent *revent;
+    GTimeVal now;
+    gint64 delay;
+    int head;
 
-            case SWAMI_MIDI_CONTROL14:
-                if(midi->data.control.param == SWAMI_MIDI_CC_BANK_MSB)
-                {
-                    /* update channel bank # */
-                    if(midi->channel < wavetbl->channel_count)
-                    {
-                        wavetbl->banks[midi->channel] = midi->data.control.value;
-                    }
-
-                    fluid_synth_bank_select(synth, midi->channel,
-                                            midi->data.control.value);
-                }
-                else
-                    fluid_synth_cc(synth, midi->channel, midi->data.control.param,
-                                   midi->data.control.value);
+    G_LOCK(midi_ring);
 
-                break;
+    head = g_atomic_int_get(&wavetbl->midi_ring_head);
+
+    if(((head + 1) & (MIDI_RING_SIZE - 1))
+            == g_atomic_int_get(&wavetbl->midi_ring_tail))
+    {
+        G_UNLOCK(midi_ring);
+        return (FALSE);
+    }
 
-            case SWAMI_MIDI_PROGRAM_CHANGE:
+    revent = &wavetbl->midi_ring[head];
 
-                /* update channel program # */
-                if(midi->channel < wavetbl->channel_count)
-                {
-                    wavetbl->programs[midi->channel] = midi->data.control.value;
-                }
+    /* Event ticks are wall clock time, convert to midi_ring_time() by the
+     * age of the event (0 for events which weren't stamped), clamped to an
+     * audio period for clock steps and stale events */
+    delay = 0;
 
-                fluid_synth_program_change(synth, midi->channel,
-                                           midi->data.control.value);
-                break;
+    if(tick->tv_sec || tick->tv_usec)
+    {
+        g_get_current_time(&now);
+        delay = ((gint64)now.tv_sec - tick->tv_sec) * G_USEC_PER_SEC
+                + (now.tv_usec - tick->tv_usec);
+        delay = CLAMP(delay, 0, wavetbl->audio_period_usecs);
+    }
+
+    revent->time = midi_ring_time() - delay;
+
+    revent->event = *midi;
+
+    /* publish event */
+    g_atomic_int_set(&wavetbl->midi_ring_head, (head + 1) & (MIDI_RING_SIZE - 1));
+
+    G_UNLOCK(midi_ring);
+
+    return (TRUE);
+}
+
+/* Monotonic time in microseconds for MIDI event timing (wall clock time with
+ * GLib older than 2.28, clock steps are bounded by the clamping of event
+ * frames in wavetbl_fluidsynth_audio_func()) */
+static gint64
+midi_ring_time(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    return (g_get_monotonic_time());
+#else
+    return (stats_time_usec());
+#endif
+}
+
+/* Audio driver callback.  Queued MIDI events are delayed by one audio
+ * period, which maps their tick to a frame within the current period, and
+ * the period is rendered in pieces split at the event frames.  This gives
+ * events a constant latency instead of landing on period boundaries.  The
+ * resolution is FluidSynth's internal 64 frame block, since events only
+ * take effect at its boundaries.
+ * MT-NOTE: Called in the audio thread.
+ */
+static int
+wavetbl_fluidsynth_audio_func(void *data, int len, int nfx, float *fx[],
+                              int nout, float *out[])
+{
+    WavetblFluidSynth *wavetbl = (WavetblFluidSynth *)data;
+    MidiRingEvent *revent;
+    float **fxofs, **outofs;
+    gint64 now_usec, offset;
+    int done = 0, count, tail, i;
+
+    now_usec = midi_ring_time();
 
-            default:
+    fxofs = g_newa(float *, nfx + 1);
+    outofs = g_newa(float *, nout + 1);
+
+    rt_updates_apply(wavetbl, FALSE);
+
+    tail = g_atomic_int_get(&wavetbl->midi_ring_tail);
+
+    while(done < len)
+    {
+        count = len - done;
+
+        for(; tail != g_atomic_int_get(&wavetbl->midi_ring_head);
+                tail = (tail + 1) & (MIDI_RING_SIZE - 1))
+        {
+            revent = &wavetbl->midi_ring[tail];
+            offset = (gint64)((revent->time - now_usec) * wavetbl->audio_rate
+                              / G_USEC_PER_SEC) + len;
+
+            /* events are never held past the current period */
+            offset = CLAMP(offset, 0, len - 1);
+
+            /* event after the current position? Render up to it. */
+            if(offset > done)
+            {
+                count = MIN(count, offset - done);
                 break;
             }
+
+            synth_midi_event(wavetbl->synth, &revent->event);
+            g_atomic_int_set(&wavetbl->midi_ring_tail,
+                             (tail + 1) & (MIDI_RING_SIZE - 1));
         }
 
-        i++;
+        for(i = 0; i < nfx; i++)
+        {
+            fxofs[i] = fx[i] ? fx[i] + done : NULL;
+        }
+
+        for(i = 0; i < nout; i++)
+        {
+            outofs[i] = out[i] ? out[i] + done : NULL;
+        }
+
+        if(fluid_synth_process(wavetbl->synth, count, nfx, fxofs, nout, outofs)
+                != FLUID_OK)
+        {
+            return (FLUID_FAILED);
+        }
+
+        done += count;
     }
+
+    return (FLUID_OK);
 }
 
 /** init function for FluidSynth Swami wavetable driver */
@@ -1464,6 +2298,7 @@ wavetbl_fluidsynth_open(SwamiWavetbl *swami_wavetbl, GError **err)
 {
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(swami_wavetbl);
     fluid_sfloader_t *loader;
+    int period_size = 64;
     int i;
 
     SWAMI_LOCK_WRITE(wavetbl);
@@ -1485,6 +2320,9 @@ wavetbl_fluidsynth_open(SwamiWavetbl *swami_wavetbl, GError **err)
         return (FALSE);
     }
 
+    /* retired samples of voice caches must outlive its voices */
+    retired_synth_add(wavetbl->synth);
+
     /* hook our sfloader */
     loader = new_fluid_sfloader(sfloader_load_sfont, delete_fluid_sfloader);
 
@@ -1499,7 +2337,18 @@ wavetbl_fluidsynth_open(SwamiWavetbl *swami_wavetbl, GError **err)
     fluid_sfloader_set_data(loader, wavetbl);
     fluid_synth_add_sfloader(wavetbl->synth, loader);
 
-    wavetbl->audio = new_fluid_audio_driver(wavetbl->settings, wavetbl->synth);
+    /* MIDI control events are dispatched by the audio callback */
+    wavetbl->midi_ring_head = 0;
+    wavetbl->midi_ring_tail = 0;
+    fluid_settings_getnum(wavetbl->settings, "synth.sample-rate",
+                          &wavetbl->audio_rate);
+    fluid_settings_getint(wavetbl->settings, "audio.period-size", &period_size);
+    wavetbl->audio_period_usecs = (gint64)period_size * G_USEC_PER_SEC
+                                  / MAX(wavetbl->audio_rate, 1.0);
+
+    wavetbl->audio = new_fluid_audio_driver2(wavetbl->settings,
+                     wavetbl_fluidsynth_audio_func,
+                     wavetbl);
 
     /* Load dummy SoundFont to make active items work - sfloader_load_sfont */
     fluid_synth_sfload(wavetbl->synth, "!", FALSE);
@@ -1554,6 +2403,10 @@ wavetbl_fluidsynth_open(SwamiWavetbl *swami_wavetbl, GError **err)
         ipatch_item_prop_connect(NULL, NULL, wavetbl_fluidsynth_prop_callback,
                                  NULL, wavetbl);
 
+    /* queue voice cache misses of note-on for caching periodically */
+    wavetbl->cache_miss_id = g_timeout_add(CACHE_MISS_INTERVAL,
+                                           cache_miss_drain, wavetbl);
+
     swami_wavetbl->active = TRUE;
     SWAMI_UNLOCK_WRITE(wavetbl);
 
@@ -1573,54 +2426,123 @@ wavetbl_fluidsynth_prop_callback(IpatchItemPropNotify *notify)
     }
 
     /* check if changed item is a dependent of active audible (for realtime fx) */
-    SWAMI_LOCK_READ(wavetbl);
+    SWAMI_LOCK_WRITE(wavetbl);
 
     if(notify->item == wavetbl->active_item
             && notify->pspec->flags & IPATCH_PARAM_SYNTH_REALTIME)
         active_item_realtime_update(wavetbl, notify->item, notify->pspec,
                                     notify->new_value);
 
-    SWAMI_UNLOCK_READ(wavetbl);
+    SWAMI_UNLOCK_WRITE(wavetbl);
 
     /* see if property change affects any loaded instruments */
-    if(wavetbl_fluidsynth_check_update_item((SwamiWavetbl *)wavetbl,
-                                            notify->item, notify->pspec))
+    if(!wavetbl_fluidsynth_check_update_item((SwamiWavetbl *)wavetbl,
+            notify->item, notify->pspec))
     {
-        wavetbl_fluidsynth_update_item((SwamiWavetbl *)wavetbl, notify->item);
+        return;
     }
-}
 
-/* Called for each event received from the FluidSynth MIDI router */
-static int
-wavetbl_fluidsynth_handle_midi_event(void *data, fluid_midi_event_t *event)
-{
-    WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(data);
-    int type = fluid_midi_event_get_type(event);
-    int chan = fluid_midi_event_get_channel(event);
-    int retval;
+    /* mark the item dirty, its voice cache is updated by cache_update_flush()
+     * so fast property changes only cause one update per interval */
+    SWAMI_LOCK_WRITE(wavetbl);
 
-    retval = fluid_synth_handle_midi_event(wavetbl->synth, event);
+    if(!wavetbl->cache_dirty)
+    {
+        wavetbl->cache_dirty = g_hash_table_new_full(NULL, NULL,
+                               g_object_unref, NULL);
+    }
 
-    switch(type)
+    if(!g_hash_table_lookup(wavetbl->cache_dirty, notify->item))
     {
-    case WAVETBL_FLUID_NOTE_ON:
-        swami_control_midi_transmit(wavetbl->midi_ctrl,
-                                    SWAMI_MIDI_NOTE_ON, chan,
-                                    fluid_midi_event_get_key(event),
-                                    fluid_midi_event_get_velocity(event));
-        break;
+        g_hash_table_insert(wavetbl->cache_dirty,       /* ++ ref item */
+                            g_object_ref(notify->item), notify->item);
+    }
 
-    case WAVETBL_FLUID_NOTE_OFF:
-        swami_control_midi_transmit(wavetbl->midi_ctrl,
-                                    SWAMI_MIDI_NOTE_OFF, chan,
-                                    fluid_midi_event_get_key(event),
-                                    fluid_midi_event_get_velocity(event));
-        break;
+    if(!wavetbl->cache_update_id)
+    {
+        wavetbl->cache_update_id = g_timeout_add(CACHE_UPDATE_INTERVAL,
+                                   cache_update_flush, wavetbl);
+    }
 
-    case WAVETBL_FLUID_CONTROL_CHANGE:
+    SWAMI_UNLOCK_WRITE(wavetbl);
+}
 
-        /* update current wavetable bank? */
-        if(fluid_midi_event_get_control(event) == SWAMI_MIDI_CC_BANK_MSB
+/* apply a Swami MIDI event to a FluidSynth instance */
+static void
+synth_midi_event(fluid_synth_t *synth, const SwamiMidiEvent *midi)
+{
+    switch(midi->type)
+    {
+    case SWAMI_MIDI_NOTE_ON:
+        fluid_synth_noteon(synth, midi->channel, midi->data.note.note,
+                           midi->data.note.velocity);
+        break;
+
+    case SWAMI_MIDI_NOTE_OFF:
+        fluid_synth_noteoff(synth, midi->channel, midi->data.note.note);
+        break;
+
+    case SWAMI_MIDI_PITCH_BEND:	/* FluidSynth uses 0-16383 */
+        fluid_synth_pitch_bend(synth, midi->channel,
+                               midi->data.control.value + 8192);
+        break;
+
+    case SWAMI_MIDI_CONTROL:
+        fluid_synth_cc(synth, midi->channel, midi->data.control.param,
+                       midi->data.control.value);
+        break;
+
+    case SWAMI_MIDI_CONTROL14:
+        if(midi->data.control.param == SWAMI_MIDI_CC_BANK_MSB)
+            fluid_synth_bank_select(synth, midi->channel,
+                                    midi->data.control.value);
+        else
+            fluid_synth_cc(synth, midi->channel, midi->data.control.param,
+                           midi->data.control.value);
+
+        break;
+
+    case SWAMI_MIDI_PROGRAM_CHANGE:
+        fluid_synth_program_change(synth, midi->channel,
+                                   midi->data.control.value);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Called for each event received from the FluidSynth MIDI router */
+static int
+wavetbl_fluidsynth_handle_midi_event(void *data, fluid_midi_event_t *event)
+{
+    WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(data);
+    int type = fluid_midi_event_get_type(event);
+    int chan = fluid_midi_event_get_channel(event);
+    int retval;
+
+    retval = fluid_synth_handle_midi_event(wavetbl->synth, event);
+
+    switch(type)
+    {
+    case WAVETBL_FLUID_NOTE_ON:
+        swami_control_midi_transmit(wavetbl->midi_ctrl,
+                                    SWAMI_MIDI_NOTE_ON, chan,
+                                    fluid_midi_event_get_key(event),
+                                    fluid_midi_event_get_velocity(event));
+        break;
+
+    case WAVETBL_FLUID_NOTE_OFF:
+        swami_control_midi_transmit(wavetbl->midi_ctrl,
+                                    SWAMI_MIDI_NOTE_OFF, chan,
+                                    fluid_midi_event_get_key(event),
+                                    fluid_midi_event_get_velocity(event));
+        break;
+
+    case WAVETBL_FLUID_CONTROL_CHANGE:
+
+        /* update current wavetable bank? */
+        if(fluid_midi_event_get_control(event) == SWAMI_MIDI_CC_BANK_MSB
                 && chan < wavetbl->channel_count)
         {
             wavetbl->banks[chan] = fluid_midi_event_get_value(event);
@@ -1670,6 +2592,20 @@ wavetbl_fluidsynth_close(SwamiWavetbl *swami_wavetbl)
     /* remove our property change callback */
     ipatch_item_prop_disconnect(wavetbl->prop_callback_handler_id);
 
+    /* cancel pending background voice caching */
+    g_atomic_int_inc(&wavetbl->cache_serial);
+
+    if(wavetbl->cache_miss_id)
+    {
+        g_source_remove(wavetbl->cache_miss_id);
+        wavetbl->cache_miss_id = 0;
+    }
+
+    memset((void *)wavetbl->cache_misses, 0, sizeof(wavetbl->cache_misses));
+
+    /* drop pending property change updates */
+    cache_update_clear(wavetbl);
+
     if(wavetbl->midi)
     {
         delete_fluid_midi_driver(wavetbl->midi);
@@ -1687,20 +2623,34 @@ wavetbl_fluidsynth_close(SwamiWavetbl *swami_wavetbl)
 
     if(wavetbl->synth)
     {
-        delete_fluid_synth(wavetbl->synth);
-    }
-
-    if(wavetbl->rt_cache)
-    {
-        g_object_unref(wavetbl->rt_cache);
+        retired_synth_delete(wavetbl->synth);
     }
 
     wavetbl->midi = NULL;
     wavetbl->midi_router = NULL;
     wavetbl->audio = NULL;
     wavetbl->synth = NULL;
-    wavetbl->rt_cache = NULL;
-    wavetbl->rt_count = 0;
+
+    /* synthesis thread is gone, so realtime note state can be reset */
+    voice_cache_lock();
+
+    if(wavetbl->rt_hold)
+    {
+        g_object_unref(wavetbl->rt_hold);    /* -- unref held voice cache */
+    }
+
+    wavetbl->rt_hold = NULL;
+    memset(&wavetbl->rt_note, 0, sizeof(wavetbl->rt_note));
+
+    G_LOCK(rt_updates);
+    wavetbl->rt_updates->pending_count = 0;
+    memset(wavetbl->rt_updates->dirty, 0, sizeof(wavetbl->rt_updates->dirty));
+    G_UNLOCK(rt_updates);
+
+    G_UNLOCK(voice_cache_hash);
+
+    /* delete samples of freed voice caches, if no synth could be playing them */
+    retired_samples_free();
 
     swami_wavetbl->active = FALSE;
 
@@ -1727,7 +2677,7 @@ wavetbl_fluidsynth_load_patch(SwamiWavetbl *swami_wavetbl, IpatchItem *patch,
                               GError **err)
 {
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(swami_wavetbl);
-    char s[16];			/* enough space to store printf "&%p" */
+    char s[32];			/* enough space to store printf "&%p" */
 
     if(!IPATCH_IS_BASE(patch))
     {
@@ -1747,9 +2697,15 @@ wavetbl_fluidsynth_load_patch(SwamiWavetbl *swami_wavetbl, IpatchItem *patch,
     }
 
     /* load patch by pointer (our FluidSynth sfloader plugin will use it) */
-    g_strdup_printf(s, "&%p", (void *)patch);
+    g_snprintf(s, sizeof(s), "&%p", (void *)patch);
     fluid_synth_sfload(wavetbl->synth, s, FALSE);
 
+    /* build voice caches for all presets in the background */
+    if(wavetbl->preload_presets)
+    {
+        cache_patch_presets(wavetbl, patch);
+    }
+
     SWAMI_UNLOCK_WRITE(wavetbl);
 
     return (TRUE);
@@ -1761,6 +2717,7 @@ wavetbl_fluidsynth_load_active_item(SwamiWavetbl *swami_wavetbl,
                                     IpatchItem *item, GError **err)
 {
     WavetblFluidSynth *wavetbl = WAVETBL_FLUIDSYNTH(swami_wavetbl);
+    IpatchItem *old_item;
 
     /* only set as active item if its convertable to a SF2 voice cache */
     if(item && ipatch_find_converter(G_OBJECT_TYPE(item),
@@ -1768,22 +2725,18 @@ wavetbl_fluidsynth_load_active_item(SwamiWavetbl *swami_wavetbl,
     {
         SWAMI_LOCK_WRITE(wavetbl);
 
-        if(wavetbl->active_item)	/* remove reference to any current active item */
-        {
-            g_object_unref(wavetbl->active_item);
-        }
-
-        wavetbl->active_item = g_object_ref(item);  /* ++ add reference to item */
+        /* active item pointer is read by note-on without locking (but only
+         * used as voice cache hash key) */
+        old_item = wavetbl->active_item;
+        g_object_ref(item);             /* ++ add reference to item */
+        g_atomic_pointer_set((gpointer *)&wavetbl->active_item, item);
 
-        if(wavetbl->rt_cache)
+        if(old_item)	/* remove reference to previous active item */
         {
-            g_object_unref(wavetbl->rt_cache);
-            wavetbl->rt_cache = NULL;
+            g_object_unref(old_item);
         }
 
-        wavetbl->rt_count = 0;
-
-        cache_instrument(wavetbl, item);	/* cache the instrument voices */
+        cache_instrument(wavetbl, item, FALSE);	/* cache the instrument voices */
 
         SWAMI_UNLOCK_WRITE(wavetbl);
 
@@ -1798,7 +2751,7 @@ static gboolean
 wavetbl_fluidsynth_check_update_item(SwamiWavetbl *wavetbl, IpatchItem *item,
                                      GParamSpec *prop)
 {
-    IpatchSF2VoiceCache *cache;
+    CacheEntry *entry;
 
     /* if parameter doesn't have the SYNTH flag set, then no update needed */
     if(!(prop->flags & IPATCH_PARAM_SYNTH))
@@ -1806,20 +2759,29 @@ wavetbl_fluidsynth_check_update_item(SwamiWavetbl *wavetbl, IpatchItem *item,
         return (FALSE);
     }
 
-    /* check if item is cached */
-    G_LOCK(voice_cache_hash);
-    cache = g_hash_table_lookup(voice_cache_hash, item);
+    /* check if item is cached (published hash is never modified) */
+    voice_cache_lock();
+    entry = g_hash_table_lookup(voice_cache_hash, item);
     G_UNLOCK(voice_cache_hash);
 
-    return (cache != NULL);
+    return (entry != NULL);
 }
 
 /* SwamiWavetbl method to update an item's synthesis cache */
 static void
 wavetbl_fluidsynth_update_item(SwamiWavetbl *wavetbl, IpatchItem *item)
 {
+    gint64 start;
+
+    start = stats_time_usec();
+
     SWAMI_LOCK_WRITE(wavetbl);
-    cache_instrument(WAVETBL_FLUIDSYNTH(wavetbl), item);
+
+    if(cache_instrument_update(WAVETBL_FLUIDSYNTH(wavetbl), item))
+    {
+        stats_cache_build(start);
+    }
+
     SWAMI_UNLOCK_WRITE(wavetbl);
 }
 
@@ -1834,20 +2796,26 @@ wavetbl_fluidsynth_update_reverb(WavetblFluidSynth *wavetbl)
     }
 
     wavetbl->reverb_update = FALSE;
+    synth_set_reverb(wavetbl->synth, &wavetbl->reverb_params);
+}
 
+/* set the reverb parameters of a FluidSynth instance */
+static void
+synth_set_reverb(fluid_synth_t *synth, const ReverbParams *params)
+{
 #if FLUID_VERSION_ATLEAST(2,1,6)
     /* Avoid calling deprecated API */
     int fx_group = -1;
-    fluid_synth_set_reverb_group_roomsize(wavetbl->synth, fx_group, wavetbl->reverb_params.room_size);
-    fluid_synth_set_reverb_group_damp(wavetbl->synth, fx_group, wavetbl->reverb_params.damp);
-    fluid_synth_set_reverb_group_width(wavetbl->synth, fx_group, wavetbl->reverb_params.width);
-    fluid_synth_set_reverb_group_level(wavetbl->synth, fx_group, wavetbl->reverb_params.level);
+    fluid_synth_set_reverb_group_roomsize(synth, fx_group, params->room_size);
+    fluid_synth_set_reverb_group_damp(synth, fx_group, params->damp);
+    fluid_synth_set_reverb_group_width(synth, fx_group, params->width);
+    fluid_synth_set_reverb_group_level(synth, fx_group, params->level);
 #else
-    fluid_synth_set_reverb(wavetbl->synth,
-                           wavetbl->reverb_params.room_size,
-                           wavetbl->reverb_params.damp,
-                           wavetbl->reverb_params.width,
-                           wavetbl->reverb_params.level);
+    fluid_synth_set_reverb(synth,
+                           params->room_size,
+                           params->damp,
+                           params->width,
+                           params->level);
 #endif
 }
 
@@ -1879,22 +2847,28 @@ wavetbl_fluidsynth_update_chorus(WavetblFluidSynth *wavetbl)
     }
 
     wavetbl->chorus_update = FALSE;
+    synth_set_chorus(wavetbl->synth, &wavetbl->chorus_params);
+}
 
+/* set the chorus parameters of a FluidSynth instance */
+static void
+synth_set_chorus(fluid_synth_t *synth, const ChorusParams *params)
+{
 #if FLUID_VERSION_ATLEAST(2,1,6)
     /* Avoid calling deprecated API */
     int fx_group = -1;
-    fluid_synth_set_chorus_group_nr(wavetbl->synth, fx_group, wavetbl->chorus_params.count);
-    fluid_synth_set_chorus_group_level(wavetbl->synth, fx_group, wavetbl->chorus_params.level);
-    fluid_synth_set_chorus_group_speed(wavetbl->synth, fx_group, wavetbl->chorus_params.freq);
-    fluid_synth_set_chorus_group_depth(wavetbl->synth, fx_group, wavetbl->chorus_params.depth);
-    fluid_synth_set_chorus_group_type(wavetbl->synth, fx_group, wavetbl->chorus_params.waveform);
+    fluid_synth_set_chorus_group_nr(synth, fx_group, params->count);
+    fluid_synth_set_chorus_group_level(synth, fx_group, params->level);
+    fluid_synth_set_chorus_group_speed(synth, fx_group, params->freq);
+    fluid_synth_set_chorus_group_depth(synth, fx_group, params->depth);
+    fluid_synth_set_chorus_group_type(synth, fx_group, params->waveform);
 #else
-    fluid_synth_set_chorus(wavetbl->synth,
-                           wavetbl->chorus_params.count,
-                           wavetbl->chorus_params.level,
-                           wavetbl->chorus_params.freq,
-                           wavetbl->chorus_params.depth,
-                           wavetbl->chorus_params.waveform);
+    fluid_synth_set_chorus(synth,
+                           params->count,
+                           params->level,
+                           params->freq,
+                           params->depth,
+                           params->waveform);
 #endif
 }
 
@@ -2203,318 +3177,2772 @@ sfloader_preset_noteon (fluid_preset_t *preset, fluid_synth_t *synth,
     sfloader_preset_data_t *preset_data = fluid_preset_get_data(preset);
     WavetblFluidSynth *wavetbl = preset_data->wavetbl;
     IpatchItem *item = preset_data->item;
+    GHashTable *hash;
+    gint64 start;
+    int epoch, usecs, bucket;
+
+    start = stats_time_usec();
+
+    /* MT-NOTE: Called in the synthesis thread, no locks are taken (see
+     * voice_cache_hash) so that editing can't stall audio. */
+    hash = voice_cache_read_begin(&epoch);
 
-    SWAMI_LOCK_WRITE (wavetbl);
     if (!item)
     {
-        item = wavetbl->active_item; /* take active item */
+        /* take active item */
+        item = g_atomic_pointer_get((gpointer *)&wavetbl->active_item);
     }
 
 	/* play note if an item exists */
     if (item)
     {
-        cache_instrument_noteon(wavetbl, item, synth, chan, key, vel);
+        cache_instrument_noteon(wavetbl, hash, item, synth, chan, key, vel);
     }
-    SWAMI_UNLOCK_WRITE (wavetbl);
+
+    voice_cache_read_end(epoch);
+
+    /* update note-on time statistics */
+    usecs = (int)MAX(stats_time_usec() - start, 0);
+
+    for(bucket = 0; bucket < NOTEON_HISTOGRAM_BUCKETS - 1
+            && usecs >= (1 << bucket); bucket++);
+
+    g_atomic_int_inc(&noteon_histogram[bucket]);
+    g_atomic_int_inc(&noteon_count);
+    g_atomic_int_add(&noteon_time_pending, usecs);
+    stats_max(&noteon_time_max, usecs);
 
     return (FLUID_OK);
 }
 
-/* caches an instrument item into SoundFont voices for faster processing at
- * note-on time in cache_instrument_noteon().
- * MT-NOTE: Caller is responsible for wavetbl object locking.
+/* Copy the published voice cache hash (with new references to voice caches).
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
  */
+static GHashTable *
+voice_cache_hash_copy(void)
+{
+    GHashTable *hash;
+
+    hash = g_hash_table_new_full(NULL, NULL, NULL,
+                                 (GDestroyNotify)cache_entry_unref);
+    g_hash_table_foreach(voice_cache_hash, voice_cache_hash_copy_GHFunc, hash);
+
+    return (hash);
+}
+
 static void
-cache_instrument(WavetblFluidSynth *wavetbl, IpatchItem *item)
+voice_cache_hash_copy_GHFunc(gpointer key, gpointer value, gpointer user_data)
 {
-    IpatchConverter *conv;
-    IpatchSF2Voice *voice;
-    IpatchSF2VoiceCache *cache;
-    IpatchItem *solo_item = NULL;
-    int i, count;
+    CacheEntry *entry = value;
 
-    /* ++ ref - create SF2 voice cache converter */
-    conv = ipatch_create_converter(G_OBJECT_TYPE(item), IPATCH_TYPE_SF2_VOICE_CACHE);
+    entry->refcount++;
+    g_hash_table_insert((GHashTable *)user_data, key, entry);
+}
 
-    /* no SF2 voice cache converter for this item type? */
-    if(!conv)
+/* Create a voice cache hash entry.
+ * !! Takes over the voice cache reference.
+ */
+static CacheEntry *
+cache_entry_new(IpatchSF2VoiceCache *cache, guint64 size)
+{
+    CacheEntry *entry;
+
+    entry = g_slice_new(CacheEntry);
+    entry->cache = cache;
+    entry->size = size;
+    entry->last_use = g_atomic_int_get(&voice_cache_clock);
+    entry->refcount = 1;
+
+    return (entry);
+}
+
+/* voice cache hash value destroy function.
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
+ */
+static void
+cache_entry_unref(CacheEntry *entry)
+{
+    if(--entry->refcount > 0)
     {
         return;
     }
 
-    SWAMI_LOCK_READ(wavetbl);
+    g_object_unref(entry->cache);         /* -- unref voice cache */
+    g_slice_free(CacheEntry, entry);
+}
 
-    if(wavetbl->solo_item)
+/* Publish a new voice cache hash to note-on and free the previous one after
+ * all note-ons which could still be using it have finished.
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
+ */
+static void
+voice_cache_hash_publish(GHashTable *hash)
+{
+    WavetblFluidSynth *wavetbl;
+    GHashTable *old_hash = voice_cache_hash;
+    RealtimeNote note;
+    GSList *p;
+
+    g_atomic_pointer_set((gpointer *)&voice_cache_hash, hash);
+    voice_cache_synchronize();
+
+    /* Keep the voice cache of the most recent realtime note of each wavetbl
+     * alive, if its no longer in the hash.  No note-on is using the old hash
+     * anymore, so rt_note can only change to a cache in the new hash. */
+    for(p = wavetbl_list; p; p = p->next)
     {
-        solo_item = g_object_ref(wavetbl->solo_item);    /* ++ ref solo item */
+        wavetbl = (WavetblFluidSynth *)(p->data);
+        rt_note_read(wavetbl, &note);
+
+        if(note.cache && note.cache != wavetbl->rt_hold
+                && !g_hash_table_find(hash, voice_cache_hash_find_value, note.cache))
+        {
+            if(wavetbl->rt_hold)
+            {
+                g_object_unref(wavetbl->rt_hold);
+            }
+
+            wavetbl->rt_hold = g_object_ref(note.cache);    /* ++ ref held cache */
+        }
     }
 
-    SWAMI_UNLOCK_READ(wavetbl);
+    g_hash_table_destroy(old_hash);
+}
 
-    g_object_set(conv, "solo-item", solo_item, NULL);
+/* Wait for all note-ons which started before the call to finish.
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
+ */
+static void
+voice_cache_synchronize(void)
+{
+    int epoch;
 
-    cache = ipatch_sf2_voice_cache_new(NULL, 0);          /* ++ ref voice cache */
+    /* switch new readers to the other epoch and wait for the readers of the
+     * previous epoch (which might use old data) to finish, note-on is short
+     * so this is just a few microseconds at most */
+    epoch = g_atomic_int_get(&voice_cache_epoch);
+    g_atomic_int_set(&voice_cache_epoch, !epoch);
 
-    /* copy session modulators to voice cache */
-    cache->override_mods = ipatch_sf2_mod_list_duplicate(wavetbl->mods);
+    while(g_atomic_int_get(&voice_cache_readers[epoch]) > 0)
+    {
+        g_thread_yield();
+    }
+}
 
-    ipatch_converter_add_input(conv, G_OBJECT(item));
-    ipatch_converter_add_output(conv, G_OBJECT(cache));
+/* g_hash_table_find() callback to find a voice cache value */
+static gboolean
+voice_cache_hash_find_value(gpointer key, gpointer value, gpointer user_data)
+{
+    return (((CacheEntry *)value)->cache == user_data);
+}
 
-    /* Convert item to SF2 voice cache and assign solo-item (if any)
-     * ++ ref list */
-    if(!ipatch_converter_convert(conv, NULL))
+/* bag for voice_cache_evict_GHFunc() */
+typedef struct
+{
+    IpatchItem *keep_item;	/* item not to evict or NULL */
+    IpatchItem *lru_item;		/* least recently used item or NULL */
+    guint lru_age;		/* note-ons since lru_item was played */
+    guint clock;			/* current voice_cache_clock */
+} EvictBag;
+
+/* Remove the least recently played items from an unpublished voice cache
+ * hash, until the cache size is within voice_cache_size_limit.  Active items,
+ * pinned items (see voice_cache_pin()) and keep_item are never evicted.  Sample stores are closed when the entry
+ * is no longer in any hash and freed by the SwamiRoot sample cache clean.
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
+ */
+static void
+voice_cache_evict(GHashTable *hash, IpatchItem *keep_item)
+{
+    CacheEntry *entry;
+    EvictBag bag;
+
+    bag.keep_item = keep_item;
+
+    while(voice_cache_size_limit && voice_cache_size > voice_cache_size_limit)
     {
-        g_object_unref(cache);      /* -- unref voice cache object */
+        bag.lru_item = NULL;
+        bag.lru_age = 0;
+        bag.clock = (guint)g_atomic_int_get(&voice_cache_clock);
+        g_hash_table_foreach(hash, voice_cache_evict_GHFunc, &bag);
 
-        if(solo_item)
+        if(!bag.lru_item)
         {
-            g_object_unref(solo_item);    /* -- unref solo item */
+            break;    /* nothing left which may be evicted */
         }
 
-        g_object_unref(conv);       /* -- unref converter */
-        return;
+        entry = g_hash_table_lookup(hash, bag.lru_item);
+        voice_cache_size -= entry->size;
+        g_hash_table_remove(hash, bag.lru_item);
+        g_atomic_int_inc(&voice_cache_evictions);
     }
+}
 
-    if(solo_item)
+static void
+voice_cache_evict_GHFunc(gpointer key, gpointer value, gpointer user_data)
+{
+    EvictBag *bag = user_data;
+    CacheEntry *entry = value;
+    GSList *p;
+    guint age;
+
+    if(key == bag->keep_item || g_hash_table_lookup(voice_cache_pins, key))
     {
-        g_object_unref(solo_item);    /* -- unref solo item */
+        return;
     }
 
-    g_object_unref(conv);         /* -- unref converter */
-
-    /* Use voice->user_data to close open cached stores */
-    cache->voice_user_data_destroy = (GDestroyNotify)ipatch_sample_store_cache_close;
+    for(p = wavetbl_list; p; p = p->next)
+    {
+        if(key == g_atomic_pointer_get
+                ((gpointer *)&((WavetblFluidSynth *)(p->data))->active_item))
+        {
+            return;
+        }
+    }
 
-    /* loop over voices and load sample data into RAM */
-    count = cache->voices->len;
+    /* age is relative to the current clock, so wrap around is handled */
+    age = bag->clock - (guint)g_atomic_int_get(&entry->last_use);
 
-    for(i = 0; i < count; i++)
+    if(!bag->lru_item || age > bag->lru_age)
     {
-        voice = &g_array_index(cache->voices, IpatchSF2Voice, i);
-        ipatch_sf2_voice_cache_sample_data(voice, NULL);
-
-        /* Keep sample store cached by doing a dummy open */
-        ipatch_sample_store_cache_open((IpatchSampleStoreCache *)voice->sample_store);
-        voice->user_data = voice->sample_store;
+        bag->lru_item = key;
+        bag->lru_age = age;
     }
-
-    /* !! hash takes over voice cache reference */
-    G_LOCK(voice_cache_hash);
-    g_hash_table_insert(voice_cache_hash, item, cache);
-    G_UNLOCK(voice_cache_hash);
 }
 
-/* noteon event function for cached instruments.
- * MT-NOTE: Caller is responsible for wavetbl object locking.
- */
-static int
-cache_instrument_noteon(WavetblFluidSynth *wavetbl, IpatchItem *item,
-                        fluid_synth_t *synth, int chan, int key, int vel)
+/* Pin items so that their voice caches aren't evicted (cached or not yet),
+ * until unpinned with voice_cache_unpin().  Items are only used as keys, the
+ * caller should keep them alive while pinned. */
+static void
+voice_cache_pin(GSList *items)
 {
-    guint16 index_array[MAX_INST_VOICES];		/* voice index array */
-    int sel_values[IPATCH_SF2_VOICE_CACHE_MAX_SEL_VALUES];
-    fluid_voice_t *fluid_voices[MAX_REALTIME_VOICES];
-    IpatchSF2VoiceCache *cache;
-    IpatchSF2VoiceSelInfo *sel_info;
-    IpatchSF2GenArray *gen_array;
-    fluid_voice_t *flvoice;
-    fluid_sample_t *wusample;
-    fluid_mod_t *wumod;
-    IpatchSF2Mod *mod;
-    IpatchSF2Voice *voice;
-    int i, voice_count, voice_num;
     GSList *p;
+    int count;
 
-    G_LOCK(voice_cache_hash);
-    cache = g_hash_table_lookup(voice_cache_hash, item);
+    voice_cache_lock();
 
-    if(cache)
+    for(p = items; p; p = p->next)
     {
-        g_object_ref(cache);    /* ++ ref cache object */
+        count = GPOINTER_TO_INT(g_hash_table_lookup(voice_cache_pins, p->data));
+        g_hash_table_insert(voice_cache_pins, p->data, GINT_TO_POINTER(count + 1));
     }
 
     G_UNLOCK(voice_cache_hash);
+}
 
-    if(!cache)
-    {
-        return (FLUID_OK);    /* instrument not yet cached? */
-    }
+/* Unpin items pinned with voice_cache_pin(), evicting least recently used
+ * items if the cache is over the memory budget */
+static void
+voice_cache_unpin(GSList *items)
+{
+    GHashTable *hash;
+    GSList *p;
+    int count;
 
-    for(i = 0; i < cache->sel_count; i++)
+    voice_cache_lock();
+
+    for(p = items; p; p = p->next)
     {
-        sel_info = &cache->sel_info[i];
+        count = GPOINTER_TO_INT(g_hash_table_lookup(voice_cache_pins, p->data));
 
-        switch(sel_info->type)
+        if(count > 1)
         {
-        case IPATCH_SF2_VOICE_SEL_NOTE:
-            sel_values[i] = key;
-            break;
-
-        case IPATCH_SF2_VOICE_SEL_VELOCITY:
-            sel_values[i] = vel;
-            break;
-
-        default:
-            sel_values[i] = 127;	/* FIXME */
-            break;
+            g_hash_table_insert(voice_cache_pins, p->data,
+                                GINT_TO_POINTER(count - 1));
+        }
+        else
+        {
+            g_hash_table_remove(voice_cache_pins, p->data);
         }
     }
 
-    voice_count = ipatch_sf2_voice_cache_select(cache, sel_values, index_array,
-                  MAX_INST_VOICES);
+    if(voice_cache_size_limit && voice_cache_size > voice_cache_size_limit)
+    {
+        hash = voice_cache_hash_copy();
+        voice_cache_evict(hash, NULL);
+        voice_cache_hash_publish(hash);
+    }
 
-    /* loop over matching voice indexes */
-    for(voice_num = 0; voice_num < voice_count; voice_num++)
+    G_UNLOCK(voice_cache_hash);
+}
+
+/* Start using the published voice cache hash, without locking.  Returns the
+ * hash, which stays valid until voice_cache_read_end() is called with the
+ * returned epoch. */
+static GHashTable *
+voice_cache_read_begin(int *epoch)
+{
+    int e;
+
+    /* retry if a writer switched epochs before we were counted */
+    while(TRUE)
     {
-        voice = IPATCH_SF2_VOICE_CACHE_GET_VOICE(cache, index_array[voice_num]);
+        e = g_atomic_int_get(&voice_cache_epoch);
+        g_atomic_int_inc(&voice_cache_readers[e]);
 
-        if(!voice->sample_store)
+        if(g_atomic_int_get(&voice_cache_epoch) == e)
         {
-            continue;    /* For ROM and other non-readable samples */
+            break;
         }
 
-        /* FIXME - pool of wusamples? */
-        wusample = new_fluid_sample();
+        g_atomic_int_add(&voice_cache_readers[e], -1);
+    }
 
-        fluid_sample_set_sound_data(wusample,
-                                    ipatch_sample_store_cache_get_location((IpatchSampleStoreCache *)(voice->sample_store)),
-                                    NULL,
-                                    voice->sample_size,
-                                    voice->rate,
-                                    FALSE
-                                   );
+    *epoch = e;
 
-        fluid_sample_set_loop(wusample, voice->loop_start, voice->loop_end);
-        fluid_sample_set_pitch(wusample, voice->root_note, voice->fine_tune);
+    return (g_atomic_pointer_get((gpointer *)&voice_cache_hash));
+}
 
-        /* allocate the FluidSynth voice */
-        flvoice = fluid_synth_alloc_voice(synth, wusample, chan, key, vel);
+/* Done using the hash returned by voice_cache_read_begin() */
+static void
+voice_cache_read_end(int epoch)
+{
+    g_atomic_int_add(&voice_cache_readers[epoch], -1);
+}
 
-        if(!flvoice)
-        {
-            delete_fluid_sample(wusample);
-            g_object_unref(cache);	/* -- unref cache */
-            return (TRUE);
+/* Lock the voice_cache_hash lock, counting the time waited if contended */
+static void
+voice_cache_lock(void)
+{
+    gint64 start;
+
+    if(G_TRYLOCK(voice_cache_hash))
+    {
+        return;
+    }
+
+    start = stats_time_usec();
+    G_LOCK(voice_cache_hash);
+
+    g_atomic_int_inc(&lock_wait_count);
+    g_atomic_int_add(&lock_wait_pending, (int)MAX(stats_time_usec() - start, 0));
+}
+
+/* current time in microseconds for statistics */
+static gint64
+stats_time_usec(void)
+{
+    GTimeVal now;
+
+    g_get_current_time(&now);
+
+    return ((gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec);
+}
+
+/* atomically raise a statistics maximum to value */
+static void
+stats_max(volatile gint *max, gint value)
+{
+    gint old;
+
+    do
+    {
+        old = g_atomic_int_get(max);
+
+        if(value <= old)
+        {
+            return;
+        }
+    }
+    while(!g_atomic_int_compare_and_exchange(max, old, value));
+}
+
+/* add a voice cache build, which started at start, to the statistics */
+static void
+stats_cache_build(gint64 start)
+{
+    guint usecs = (guint)MAX(stats_time_usec() - start, 0);
+
+    G_LOCK(synth_stats);
+    cache_build_count++;
+    cache_build_time_total += usecs;
+    cache_build_time_max = MAX(cache_build_time_max, usecs);
+    G_UNLOCK(synth_stats);
+}
+
+/* Move the pending note-on and lock wait times to their 64 bit totals.
+ * Called often enough that the pending counters can't overflow, which takes
+ * more than half an hour of accumulated time.
+ * MT-NOTE: Not called from the synthesis thread, which only adds to the
+ * pending counters.
+ */
+static void
+stats_fold(void)
+{
+    gint pending;
+
+    G_LOCK(synth_stats);
+
+    /* subtract just the amount read, so concurrent additions are kept */
+    pending = g_atomic_int_get(&noteon_time_pending);
+    g_atomic_int_add(&noteon_time_pending, -pending);
+    noteon_time_total += (guint)pending;
+
+    pending = g_atomic_int_get(&lock_wait_pending);
+    g_atomic_int_add(&lock_wait_pending, -pending);
+    lock_wait_time += (guint)pending;
+
+    G_UNLOCK(synth_stats);
+}
+
+/* Format the synthesis statistics as text, for shells and logs.
+ * Returns: Newly allocated string.
+ */
+static char *
+stats_report(WavetblFluidSynth *wavetbl)
+{
+    GString *str;
+    guint count, build_count, build_max;
+    guint64 build_total, noteon_total, lock_wait_total;
+    int voices = 0, i;
+    double cpu_load = 0.0;
+
+    SWAMI_LOCK_READ(wavetbl);
+
+    if(wavetbl->synth)
+    {
+        voices = fluid_synth_get_active_voice_count(wavetbl->synth);
+        cpu_load = fluid_synth_get_cpu_load(wavetbl->synth);
+    }
+
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    stats_fold();
+
+    G_LOCK(synth_stats);
+    build_count = cache_build_count;
+    build_total = cache_build_time_total;
+    build_max = cache_build_time_max;
+    noteon_total = noteon_time_total;
+    lock_wait_total = lock_wait_time;
+    count = (guint)g_atomic_int_get(&noteon_count);
+    G_UNLOCK(synth_stats);
+
+    str = g_string_new(NULL);
+    g_string_append_printf(str, "active-voices: %d\ncpu-load: %.2f%%\n",
+                           voices, cpu_load);
+    g_string_append_printf(str, "noteon-count: %u\nnoteon-time-avg: %.1f us\n"
+                           "noteon-time-max: %u us\n", count,
+                           count ? (double)noteon_total / count : 0.0,
+                           (guint)g_atomic_int_get(&noteon_time_max));
+
+    for(i = 0; i < NOTEON_HISTOGRAM_BUCKETS; i++)
+    {
+        if(i < NOTEON_HISTOGRAM_BUCKETS - 1)
+            g_string_append_printf(str, "noteon-histogram < %u us: %u\n", 1U << i,
+                                   (guint)g_atomic_int_get(&noteon_histogram[i]));
+        else
+            g_string_append_printf(str, "noteon-histogram >= %u us: %u\n",
+                                   1U << (i - 1),
+                                   (guint)g_atomic_int_get(&noteon_histogram[i]));
+    }
+
+    g_string_append_printf(str, "voice-alloc-failures: %u\n",
+                           (guint)g_atomic_int_get(&voice_alloc_failures));
+    g_string_append_printf(str, "midi-events-dropped: %u\n",
+                           (guint)g_atomic_int_get(&wavetbl->midi_ring_drops));
+    g_string_append_printf(str, "cache-build-count: %u\ncache-build-time-avg: %.1f us\n"
+                           "cache-build-time-max: %u us\n", build_count,
+                           build_count ? (double)build_total / build_count : 0.0,
+                           build_max);
+    g_string_append_printf(str, "cache-hits: %u\ncache-misses: %u\n"
+                           "cache-evictions: %u\n",
+                           (guint)g_atomic_int_get(&voice_cache_hits),
+                           (guint)g_atomic_int_get(&voice_cache_misses),
+                           (guint)g_atomic_int_get(&voice_cache_evictions));
+    g_string_append_printf(str, "lock-wait-count: %u\nlock-wait-time: %"
+                           G_GUINT64_FORMAT " us\n",
+                           (guint)g_atomic_int_get(&lock_wait_count),
+                           lock_wait_total);
+
+    return (g_string_free(str, FALSE));
+}
+
+/* Read a consistent copy of the realtime note state written by note-on.
+ * Never blocks the synthesis thread, retries if the state is being written.
+ * Returns the rt_seq value of the copy. */
+static int
+rt_note_read(WavetblFluidSynth *wavetbl, RealtimeNote *note)
+{
+    int seq;
+
+    do
+    {
+        seq = g_atomic_int_get(&wavetbl->rt_seq);
+
+        if(seq & 1)	/* being written? */
+        {
+            g_thread_yield();
+            continue;
+        }
+
+        memcpy(note, &wavetbl->rt_note, sizeof(RealtimeNote));
+    }
+    while((seq & 1) || g_atomic_int_get(&wavetbl->rt_seq) != seq);
+
+    return (seq);
+}
+
+/* Create the FluidSynth data for a cached voice with loaded sample data */
+static CachedVoice *
+cached_voice_new(IpatchSF2Voice *voice)
+{
+    CachedVoice *cvoice;
+
+    cvoice = g_new0(CachedVoice, 1);
+
+    if(voice->sample_store)
+    {
+        /* Keep sample store cached by doing a dummy open */
+        cvoice->store = (IpatchSampleStoreCache *)(voice->sample_store);
+        ipatch_sample_store_cache_open(cvoice->store);
+
+        cvoice->sample = new_fluid_sample();
+
+        if(cvoice->sample)
+        {
+            fluid_sample_set_sound_data(cvoice->sample,
+                                        ipatch_sample_store_cache_get_location(cvoice->store),
+                                        NULL,
+                                        voice->sample_size,
+                                        voice->rate,
+                                        FALSE
+                                       );
+
+            fluid_sample_set_loop(cvoice->sample, voice->loop_start, voice->loop_end);
+            fluid_sample_set_pitch(cvoice->sample, voice->root_note, voice->fine_tune);
+        }
+    }
+
+    cvoice->gen_array = voice->gen_array;
+    cached_voice_convert_mods(cvoice, voice->mod_list);
+
+    return (cvoice);
+}
+
+/* Convert a voice modulator list to the FluidSynth modulators of a CachedVoice */
+static void
+cached_voice_convert_mods(CachedVoice *cvoice, GSList *mod_list)
+{
+    IpatchSF2Mod *mod;
+    fluid_mod_t *wumod;
+    GSList *p;
+    int i;
+
+    /* convert modulators
+     * Note: here modulators are assumed non-linked modulators */
+    cvoice->mod_count = g_slist_length(mod_list);
+
+    /* clear fields is more safe (in particular next field) */
+    cvoice->mods = g_malloc0(cvoice->mod_count * fluid_mod_sizeof());
+
+    for(p = mod_list, i = 0; p; p = p->next, i++)
+    {
+        mod = (IpatchSF2Mod *)(p->data);
+        wumod = CACHED_VOICE_MOD(cvoice, i);
+
+        fluid_mod_set_dest(wumod, mod->dest);
+        fluid_mod_set_source1(wumod,
+                              mod->src & IPATCH_SF2_MOD_MASK_CONTROL,
+                              ((mod->src & (IPATCH_SF2_MOD_MASK_DIRECTION
+                                            | IPATCH_SF2_MOD_MASK_POLARITY
+                                            | IPATCH_SF2_MOD_MASK_TYPE))
+                               >> IPATCH_SF2_MOD_SHIFT_DIRECTION)
+                              | ((mod->src & IPATCH_SF2_MOD_MASK_CC) ? FLUID_MOD_CC : 0));
+
+        fluid_mod_set_source2(wumod,
+                              mod->amtsrc & IPATCH_SF2_MOD_MASK_CONTROL,
+                              ((mod->amtsrc & (IPATCH_SF2_MOD_MASK_DIRECTION
+                                               | IPATCH_SF2_MOD_MASK_POLARITY
+                                               | IPATCH_SF2_MOD_MASK_TYPE))
+                               >> IPATCH_SF2_MOD_SHIFT_DIRECTION)
+                              | ((mod->amtsrc & IPATCH_SF2_MOD_MASK_CC) ? FLUID_MOD_CC : 0));
+
+        fluid_mod_set_amount(wumod, mod->amount);
+    }
+}
+
+/* IpatchSF2VoiceCache voice_user_data_destroy function for CachedVoice */
+static void
+cached_voice_free(CachedVoice *cvoice)
+{
+    if(!cvoice)
+    {
+        return;
+    }
+
+    /* FluidSynth voices could still be playing the sample, retire it */
+    if(cvoice->sample)
+    {
+        G_LOCK(retired_samples);
+        retired_samples = g_slist_prepend(retired_samples, cvoice->sample);
+        G_UNLOCK(retired_samples);
+    }
+
+    if(cvoice->store)
+    {
+        ipatch_sample_store_cache_close(cvoice->store);
+    }
+
+    g_free(cvoice->mods);
+    g_free(cvoice);
+}
+
+/* Add a synth to the synths which could be playing retired samples */
+static void
+retired_synth_add(fluid_synth_t *synth)
+{
+    G_LOCK(retired_synths);
+    retired_synths = g_slist_prepend(retired_synths, synth);
+    G_UNLOCK(retired_synths);
+}
+
+/* Remove a synth added with retired_synth_add() and delete it.  Done with the
+ * lock held, since deleting its voices still accesses their samples. */
+static void
+retired_synth_delete(fluid_synth_t *synth)
+{
+    G_LOCK(retired_synths);
+    retired_synths = g_slist_remove(retired_synths, synth);
+    delete_fluid_synth(synth);
+    G_UNLOCK(retired_synths);
+}
+
+/* Delete retired FluidSynth samples which no voice can be playing anymore
+ * and batch newly retired samples (see retired_samples).  Called on close,
+ * at the end of a render and periodically while a wavetbl is open. */
+static void
+retired_samples_free(void)
+{
+    GSList *samples = NULL, *pending, *p, *next;
+    RetiredBatch *batch;
+    unsigned int *ids;
+    int i, count;
+
+    G_LOCK(retired_synths);
+
+    /* take the newly retired samples before getting the playing voices, so
+     * any voice which could use them is included */
+    G_LOCK(retired_samples);
+    pending = retired_samples;
+    retired_samples = NULL;
+    G_UNLOCK(retired_samples);
+
+    ids = retired_voice_ids(&count);        /* ++ alloc */
+
+    /* delete batches whose voices have ended since the previous check, which
+     * leaves the mixer time to drop them (all batches, if no synth) */
+    for(p = retired_batches; p; p = next)
+    {
+        next = p->next;
+        batch = (RetiredBatch *)(p->data);
+
+        if(retired_synths)
+        {
+            for(i = 0; i < batch->voice_count && count > 0; i++)
+            {
+                if(bsearch(&batch->voice_ids[i], ids, count, sizeof(ids[0]),
+                           retired_voice_id_compare))
+                {
+                    break;
+                }
+            }
+
+            if(count > 0 && i < batch->voice_count)
+            {
+                continue;    /* voice still playing */
+            }
+
+            if(!batch->ended)
+            {
+                batch->ended = TRUE;
+                continue;
+            }
+        }
+
+        samples = g_slist_concat(batch->samples, samples);
+        g_free(batch->voice_ids);
+        g_free(batch);
+        retired_batches = g_slist_delete_link(retired_batches, p);
+    }
+
+    /* batch newly retired samples with the currently playing voices */
+    if(pending && retired_synths)
+    {
+        batch = g_new(RetiredBatch, 1);
+        batch->samples = pending;
+        batch->voice_ids = ids;         /* !! takes over IDs */
+        batch->voice_count = count;
+        batch->ended = FALSE;
+        retired_batches = g_slist_prepend(retired_batches, batch);
+        ids = NULL;
+    }
+    else
+    {
+        samples = g_slist_concat(pending, samples);    /* no synth */
+    }
+
+    G_UNLOCK(retired_synths);
+
+    g_free(ids);        /* -- free IDs (if not taken over by batch) */
+
+    for(p = samples; p; p = p->next)
+    {
+        delete_fluid_sample((fluid_sample_t *)(p->data));
+    }
+
+    g_slist_free(samples);
+}
+
+/* Get the IDs of the voices playing in all retired_synths.
+ * Returns: Sorted array of voice IDs (caller frees), count is stored to count
+ * MT-NOTE: Caller must hold the retired_synths lock.
+ */
+static unsigned int *
+retired_voice_ids(int *count)
+{
+    fluid_voice_t **voices;
+    unsigned int *ids = NULL;
+    GSList *p;
+    int i, n, size, polyphony;
+
+    *count = 0;
+
+    for(p = retired_synths, size = 0; p; p = p->next)
+    {
+        size += fluid_synth_get_polyphony((fluid_synth_t *)(p->data));
+    }
+
+    if(size <= 0)
+    {
+        return (NULL);
+    }
+
+    ids = g_new(unsigned int, size);
+    voices = g_new(fluid_voice_t *, size + 1);
+
+    for(p = retired_synths, n = 0; p; p = p->next)
+    {
+        polyphony = fluid_synth_get_polyphony((fluid_synth_t *)(p->data));
+        polyphony = MIN(polyphony, size - n);
+
+        if(polyphony <= 0)
+        {
+            continue;
+        }
+
+        /* list is NULL terminated if shorter than polyphony */
+        fluid_synth_get_voicelist((fluid_synth_t *)(p->data), voices,
+                                  polyphony, -1);
+
+        for(i = 0; i < polyphony && voices[i]; i++)
+        {
+            ids[n++] = fluid_voice_get_id(voices[i]);
+        }
+    }
+
+    g_free(voices);
+
+    qsort(ids, n, sizeof(ids[0]), retired_voice_id_compare);
+    *count = n;
+
+    return (ids);
+}
+
+static int
+retired_voice_id_compare(const void *a, const void *b)
+{
+    unsigned int ida = *(const unsigned int *)a, idb = *(const unsigned int *)b;
+
+    return (ida < idb ? -1 : (ida > idb ? 1 : 0));
+}
+
+/* caches an instrument item into SoundFont voices for faster processing at
+ * note-on time in cache_instrument_noteon().  If preload is TRUE the item is
+ * only cached if it fits in the memory budget (see cache_instrument_load()).
+ * Returns: FALSE if preload is TRUE and the item didn't fit, TRUE otherwise
+ * MT-NOTE: wavetbl fields are accessed with the wavetbl lock, can be called
+ * from cache_pool threads.
+ */
+static gboolean
+cache_instrument(WavetblFluidSynth *wavetbl, IpatchItem *item,
+                 gboolean preload)
+{
+    IpatchSF2VoiceCache *cache;
+    gboolean retval = TRUE;
+    gint64 start;
+
+    start = stats_time_usec();
+
+    cache = cache_instrument_convert(wavetbl, item);    /* ++ ref voice cache */
+
+    if(cache)
+    {
+        /* !! takes over reference */
+        retval = cache_instrument_load(item, cache, preload);
+        stats_cache_build(start);
+    }
+
+    return (retval);
+}
+
+/* Convert an instrument item to a SF2 voice cache, without sample data.
+ * Returns: New voice cache (caller owns a reference) or NULL on error.
+ * MT-NOTE: wavetbl fields are accessed with the wavetbl lock.
+ */
+static IpatchSF2VoiceCache *
+cache_instrument_convert(WavetblFluidSynth *wavetbl, IpatchItem *item)
+{
+    IpatchConverter *conv;
+    IpatchSF2VoiceCache *cache;
+    IpatchItem *solo_item = NULL;
+
+    /* ++ ref - create SF2 voice cache converter */
+    conv = ipatch_create_converter(G_OBJECT_TYPE(item), IPATCH_TYPE_SF2_VOICE_CACHE);
+
+    /* no SF2 voice cache converter for this item type? */
+    if(!conv)
+    {
+        return (NULL);
+    }
+
+    cache = ipatch_sf2_voice_cache_new(NULL, 0);          /* ++ ref voice cache */
+
+    SWAMI_LOCK_READ(wavetbl);
+
+    if(wavetbl->solo_item)
+    {
+        solo_item = g_object_ref(wavetbl->solo_item);    /* ++ ref solo item */
+    }
+
+    /* copy session modulators to voice cache */
+    cache->override_mods = ipatch_sf2_mod_list_duplicate(wavetbl->mods);
+
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    g_object_set(conv, "solo-item", solo_item, NULL);
+
+    ipatch_converter_add_input(conv, G_OBJECT(item));
+    ipatch_converter_add_output(conv, G_OBJECT(cache));
+
+    /* Convert item to SF2 voice cache and assign solo-item (if any) */
+    if(!ipatch_converter_convert(conv, NULL))
+    {
+        g_object_unref(cache);      /* -- unref voice cache object */
+        cache = NULL;
+    }
+
+    if(solo_item)
+    {
+        g_object_unref(solo_item);    /* -- unref solo item */
+    }
+
+    g_object_unref(conv);         /* -- unref converter */
+
+    return (cache);
+}
+
+/* Load the sample data of a converted voice cache, convert its voices to
+ * FluidSynth and publish it for an item.  Least recently used items are
+ * evicted if the cache goes over the memory budget, unless preload is TRUE,
+ * in which case nothing is evicted and the voice cache is discarded if it
+ * doesn't fit in the budget.
+ * !! Takes over the voice cache reference.
+ * Returns: FALSE if the voice cache was discarded, TRUE if published
+ */
+static gboolean
+cache_instrument_load(IpatchItem *item, IpatchSF2VoiceCache *cache,
+                      gboolean preload)
+{
+    IpatchSF2Voice *voice;
+    GHashTable *hash, *stores;
+    CacheEntry *entry, *old_entry;
+    guint64 size = 0;
+    guint bytes;
+    int i, count;
+
+    /* voice->user_data is the CachedVoice with FluidSynth data of a voice */
+    cache->voice_user_data_destroy = (GDestroyNotify)cached_voice_free;
+
+    /* loop over voices, load sample data into RAM and convert to FluidSynth */
+    count = cache->voices->len;
+    stores = g_hash_table_new(NULL, NULL);  /* to count shared stores once */
+
+    for(i = 0; i < count; i++)
+    {
+        voice = &g_array_index(cache->voices, IpatchSF2Voice, i);
+        ipatch_sf2_voice_cache_sample_data(voice, NULL);
+        voice->user_data = cached_voice_new(voice);
+
+        if(voice->sample_store && !g_hash_table_lookup(stores, voice->sample_store))
+        {
+            g_hash_table_insert(stores, voice->sample_store, voice->sample_store);
+            ipatch_sample_get_size(IPATCH_SAMPLE(voice->sample_store), &bytes);
+            size += bytes;
+        }
+    }
+
+    g_hash_table_destroy(stores);
+
+    /* publish a copy of the hash with the new voice cache, evicting least
+     * recently used items if over the memory budget
+     * !! entry takes over voice cache reference */
+    entry = cache_entry_new(cache, size);
+
+    voice_cache_lock();
+    old_entry = g_hash_table_lookup(voice_cache_hash, item);
+
+    /* preloads only use what is left of the budget */
+    if(preload && voice_cache_size_limit
+            && voice_cache_size - (old_entry ? old_entry->size : 0) + size
+               > voice_cache_size_limit)
+    {
+        cache_entry_unref(entry);       /* -- unref voice cache */
+        G_UNLOCK(voice_cache_hash);
+        return (FALSE);
+    }
+
+    hash = voice_cache_hash_copy();
+
+    if(old_entry)
+    {
+        voice_cache_size -= old_entry->size;
+    }
+
+    g_hash_table_insert(hash, item, entry);
+    voice_cache_size += size;
+
+    if(!preload)
+    {
+        voice_cache_evict(hash, item);
+    }
+
+    voice_cache_hash_publish(hash);
+    G_UNLOCK(voice_cache_hash);
+
+    return (TRUE);
+}
+
+/* Update the voice cache of an item after a property change.  The item is
+ * converted again (without loading sample data) and if only generators or
+ * modulators of voices changed, a CachedVoice copy with the new values is
+ * published for each changed voice.  Structural changes (zones added or
+ * removed, samples, ranges, etc) publish the new voice cache.
+ * MT-NOTE: Note-on only reads the generators and modulators of a CachedVoice,
+ * which is never modified once published, so it sees either the old or the
+ * new values of a voice.  The IpatchSF2Voice generators are also updated,
+ * they are only read with the voice_cache_hash lock held.
+ */
+static gboolean
+cache_instrument_update(WavetblFluidSynth *wavetbl, IpatchItem *item)
+{
+    IpatchSF2VoiceCache *cache, *new_cache;
+    IpatchSF2Voice *voice, *new_voice;
+    CachedVoice *cvoice, *new_cvoice;
+    CacheEntry *entry;
+    GSList *old_cvoices = NULL, *p, *tmp;
+    gboolean gens_changed, mods_changed;
+    int i;
+
+    new_cache = cache_instrument_convert(wavetbl, item);  /* ++ ref new cache */
+
+    if(!new_cache)
+    {
+        return (FALSE);
+    }
+
+    voice_cache_lock();
+
+    entry = g_hash_table_lookup(voice_cache_hash, item);
+    cache = entry ? entry->cache : NULL;
+
+    if(!cache || !cache_voices_compatible(cache, new_cache))
+    {
+        G_UNLOCK(voice_cache_hash);
+        cache_instrument_load(item, new_cache, FALSE);  /* !! takes over reference */
+        return (TRUE);
+    }
+
+    for(i = 0; i < cache->voices->len; i++)
+    {
+        voice = &g_array_index(cache->voices, IpatchSF2Voice, i);
+        new_voice = &g_array_index(new_cache->voices, IpatchSF2Voice, i);
+
+        gens_changed = memcmp(&voice->gen_array, &new_voice->gen_array,
+                              sizeof(IpatchSF2GenArray)) != 0;
+        mods_changed = !mod_list_equal(voice->mod_list, new_voice->mod_list);
+
+        if(!gens_changed && !mods_changed)
+        {
+            continue;
+        }
+
+        voice->gen_array = new_voice->gen_array;
+
+        if(mods_changed)
+        {
+            /* swap modulator lists (new cache frees the old one) */
+            tmp = voice->mod_list;
+            voice->mod_list = new_voice->mod_list;
+            new_voice->mod_list = tmp;
+        }
+
+        /* replace CachedVoice with a copy which has the new generators and
+         * modulators, old one is freed after note-ons which could be using it
+         * are done */
+        cvoice = (CachedVoice *)(voice->user_data);
+
+        if(!cvoice)
+        {
+            continue;
+        }
+
+        new_cvoice = g_new(CachedVoice, 1);
+        *new_cvoice = *cvoice;
+        new_cvoice->gen_array = voice->gen_array;
+
+        if(mods_changed)
+        {
+            cached_voice_convert_mods(new_cvoice, voice->mod_list);
+        }
+        else
+        {
+            new_cvoice->mods = g_memdup(cvoice->mods,
+                                        cvoice->mod_count * fluid_mod_sizeof());
+        }
+
+        g_atomic_pointer_set(&voice->user_data, new_cvoice);
+        old_cvoices = g_slist_prepend(old_cvoices, cvoice);
+    }
+
+    /* keep the session modulators of the cache up to date */
+    tmp = cache->override_mods;
+    cache->override_mods = new_cache->override_mods;
+    new_cache->override_mods = tmp;
+
+    if(old_cvoices)
+    {
+        voice_cache_synchronize();
+    }
+
+    G_UNLOCK(voice_cache_hash);
+
+    /* free replaced CachedVoice structures (store and sample were moved) */
+    for(p = old_cvoices; p; p = p->next)
+    {
+        cvoice = (CachedVoice *)(p->data);
+        g_free(cvoice->mods);
+        g_free(cvoice);
+    }
+
+    g_slist_free(old_cvoices);
+    g_object_unref(new_cache);    /* -- unref new cache */
+
+    return (TRUE);
+}
+
+/* Check if a newly converted voice cache differs from a cached one only in
+ * voice generators and modulators.
+ * MT-NOTE: Caller must hold the voice_cache_hash lock.
+ */
+static gboolean
+cache_voices_compatible(IpatchSF2VoiceCache *cache,
+                        IpatchSF2VoiceCache *new_cache)
+{
+    IpatchSF2Voice *voice, *new_voice;
+    int i;
+
+    if(cache->voices->len != new_cache->voices->len
+            || cache->sel_count != new_cache->sel_count
+            || memcmp(cache->sel_info, new_cache->sel_info,
+                      cache->sel_count * sizeof(IpatchSF2VoiceSelInfo)) != 0
+            || cache->ranges->len != new_cache->ranges->len
+            || memcmp(cache->ranges->data, new_cache->ranges->data,
+                      cache->ranges->len * sizeof(IpatchRange)) != 0)
+    {
+        return (FALSE);
+    }
+
+    for(i = 0; i < cache->voices->len; i++)
+    {
+        voice = &g_array_index(cache->voices, IpatchSF2Voice, i);
+        new_voice = &g_array_index(new_cache->voices, IpatchSF2Voice, i);
+
+        if(voice->sample_data != new_voice->sample_data
+                || voice->sample_size != new_voice->sample_size
+                || voice->loop_start != new_voice->loop_start
+                || voice->loop_end != new_voice->loop_end
+                || voice->rate != new_voice->rate
+                || voice->root_note != new_voice->root_note
+                || voice->fine_tune != new_voice->fine_tune
+                || voice->range_index != new_voice->range_index)
+        {
+            return (FALSE);
+        }
+    }
+
+    return (TRUE);
+}
+
+/* Compare two SoundFont modulator lists */
+static gboolean
+mod_list_equal(GSList *a, GSList *b)
+{
+    IpatchSF2Mod *amod, *bmod;
+
+    for(; a && b; a = a->next, b = b->next)
+    {
+        amod = (IpatchSF2Mod *)(a->data);
+        bmod = (IpatchSF2Mod *)(b->data);
+
+        if(amod->src != bmod->src || amod->dest != bmod->dest
+                || amod->amount != bmod->amount || amod->amtsrc != bmod->amtsrc
+                || amod->trans != bmod->trans)
+        {
+            return (FALSE);
+        }
+    }
+
+    return (!a && !b);
+}
+
+/* Check if an item is a preset (instrument with MIDI bank and program) which
+ * can be converted to a voice cache */
+static gboolean
+cache_item_is_preset(IpatchItem *item)
+{
+    return (g_object_class_find_property(G_OBJECT_GET_CLASS(item), "program")
+            && g_object_class_find_property(G_OBJECT_GET_CLASS(item), "bank")
+            && ipatch_find_converter(G_OBJECT_TYPE(item),
+                                     IPATCH_TYPE_SF2_VOICE_CACHE));
+}
+
+/* Queue all presets of a patch which aren't cached for background caching in
+ * cache_pool.  Background caching is a preload, it stops once the next
+ * preset doesn't fit in the memory budget.
+ */
+static void
+cache_patch_presets(WavetblFluidSynth *wavetbl, IpatchItem *patch)
+{
+    IpatchList *list;
+    IpatchItem *item;
+    gboolean cached;
+    int batch;
+    GList *p;
+
+    batch = g_atomic_int_exchange_and_add(&wavetbl->preload_batch, 1) + 1;
+
+    /* ++ ref list of children */
+    list = ipatch_container_get_children(IPATCH_CONTAINER(patch),
+                                         IPATCH_TYPE_ITEM);
+
+    for(p = list->items; p; p = p->next)
+    {
+        item = (IpatchItem *)(p->data);
+
+        if(!cache_item_is_preset(item))
+        {
+            continue;
+        }
+
+        voice_cache_lock();
+        cached = g_hash_table_lookup(voice_cache_hash, item) != NULL;
+        G_UNLOCK(voice_cache_hash);
+
+        if(!cached)
+        {
+            cache_task_queue(wavetbl, item, batch);
+        }
+    }
+
+    g_object_unref(list);         /* -- unref list */
+}
+
+/* Queue background voice cache building of an item in cache_pool, unless
+ * it is already queued or being cached.  batch is the wavetbl preload_batch
+ * of a preload or 0 if not a preload. */
+static void
+cache_task_queue(WavetblFluidSynth *wavetbl, IpatchItem *item, int batch)
+{
+    CacheTask *task;
+
+    G_LOCK(cache_pending);
+
+    if(g_hash_table_lookup(cache_pending, item))
+    {
+        G_UNLOCK(cache_pending);
+        return;
+    }
+
+    g_hash_table_insert(cache_pending, item, item);
+    G_UNLOCK(cache_pending);
+
+    task = g_slice_new(CacheTask);
+    task->wavetbl = g_object_ref(wavetbl);  /* ++ ref wavetbl */
+    task->item = g_object_ref(item);        /* ++ ref item */
+    task->serial = g_atomic_int_get(&wavetbl->cache_serial);
+    task->batch = batch;
+
+    g_thread_pool_push(cache_pool, task, NULL);
+}
+
+/* cache_pool thread function to build the voice cache of a CacheTask */
+static void
+cache_task_run(gpointer data, gpointer user_data)
+{
+    CacheTask *task = data;
+    WavetblFluidSynth *wavetbl = task->wavetbl;
+    gboolean preload = task->batch != 0;
+    gboolean skip;
+
+    /* plugin not exiting, wavetbl not closed and preload not stopped since
+     * task was queued? */
+    if(!g_atomic_int_get(&cache_pool_exit)
+            && task->serial == g_atomic_int_get(&wavetbl->cache_serial)
+            && (!preload
+                || task->batch != g_atomic_int_get(&wavetbl->preload_stop)))
+    {
+        /* item could have been cached (active item, etc) in the meantime,
+         * don't start a preload if the memory budget is already used up */
+        voice_cache_lock();
+        skip = g_hash_table_lookup(voice_cache_hash, task->item) != NULL
+               || (preload && voice_cache_size_limit
+                   && voice_cache_size >= voice_cache_size_limit);
+        G_UNLOCK(voice_cache_hash);
+
+        /* preload didn't fit in the budget? - stop the rest of the batch,
+         * presets which are played are still cached on a miss */
+        if(!skip && !cache_instrument(wavetbl, task->item, preload))
+        {
+            g_atomic_int_set(&wavetbl->preload_stop, task->batch);
+        }
+    }
+
+    G_LOCK(cache_pending);
+    g_hash_table_remove(cache_pending, task->item);
+    G_UNLOCK(cache_pending);
+
+    g_object_unref(task->item);         /* -- unref item */
+    g_object_unref(task->wavetbl);      /* -- unref wavetbl */
+    g_slice_free(CacheTask, task);
+}
+
+/* Post a voice cache miss of an item for caching by cache_miss_drain().  The
+ * item is stored in a free slot (starting at a slot chosen by its pointer),
+ * nothing is done if it is already posted or all slots are in use (the item
+ * will be posted again by its next note-on).
+ * MT-NOTE: Called in the synthesis thread, lock free.
+ */
+static void
+cache_miss_post(WavetblFluidSynth *wavetbl, IpatchItem *item)
+{
+    gpointer slot_item;
+    guint i, slot;
+
+    slot = (guint)(GPOINTER_TO_SIZE(item) / sizeof(gpointer)) % CACHE_MISS_SLOTS;
+
+    for(i = 0; i < CACHE_MISS_SLOTS; i++, slot = (slot + 1) % CACHE_MISS_SLOTS)
+    {
+        slot_item = g_atomic_pointer_get((gpointer *)&wavetbl->cache_misses[slot]);
+
+        if(slot_item == item)
+        {
+            return;
+        }
+
+        if(!slot_item && g_atomic_pointer_compare_and_exchange
+                ((gpointer *)&wavetbl->cache_misses[slot], NULL, item))
+        {
+            return;
+        }
+    }
+}
+
+/* Timeout callback which queues the items of posted voice cache misses for
+ * caching.  Posted item pointers don't hold a reference, so they are only
+ * compared with the children of the loaded patches (which are referenced).
+ * MT-NOTE: Called in the main loop, only removes items from the slots.
+ */
+static gboolean
+cache_miss_drain(gpointer data)
+{
+    WavetblFluidSynth *wavetbl = data;
+    gpointer misses[CACHE_MISS_SLOTS];
+    gpointer slot_item;
+    IpatchList *list;
+    GSList *patches, *p;
+    GList *lp;
+    int i, count = 0;
+
+    /* delete retired samples which are no longer playing */
+    retired_samples_free();
+
+    /* keep the pending statistics times from overflowing */
+    stats_fold();
+
+    for(i = 0; i < CACHE_MISS_SLOTS; i++)
+    {
+        slot_item = g_atomic_pointer_get((gpointer *)&wavetbl->cache_misses[i]);
+
+        if(slot_item && g_atomic_pointer_compare_and_exchange
+                ((gpointer *)&wavetbl->cache_misses[i], slot_item, NULL))
+        {
+            misses[count++] = slot_item;
+        }
+    }
+
+    if(!count)
+    {
+        return (TRUE);
+    }
+
+    patches = wavetbl_get_patches(wavetbl);       /* ++ ref patches */
+
+    for(p = patches; p; p = p->next)
+    {
+        /* ++ ref list of children */
+        list = ipatch_container_get_children(IPATCH_CONTAINER(p->data),
+                                             IPATCH_TYPE_ITEM);
+
+        for(lp = list->items; lp; lp = lp->next)
+        {
+            for(i = 0; i < count; i++)
+            {
+                if(lp->data == misses[i])
+                {
+                    cache_task_queue(wavetbl, (IpatchItem *)(lp->data), 0);
+                    break;
+                }
+            }
+        }
+
+        g_object_unref(list);         /* -- unref list */
+        g_object_unref(p->data);      /* -- unref patch */
+    }
+
+    g_slist_free(patches);
+
+    return (TRUE);
+}
+
+/* Remove the cache_update_flush() timeout and drop pending dirty items.
+ * MT-NOTE: Wavetbl instance must be locked by caller (or being finalized).
+ */
+static void
+cache_update_clear(WavetblFluidSynth *wavetbl)
+{
+    if(wavetbl->cache_update_id)
+    {
+        g_source_remove(wavetbl->cache_update_id);
+        wavetbl->cache_update_id = 0;
+    }
+
+    if(wavetbl->cache_dirty)
+    {
+        g_hash_table_destroy(wavetbl->cache_dirty);     /* -- unref items */
+        wavetbl->cache_dirty = NULL;
+    }
+}
+
+/* Timeout callback which updates the voice caches of items changed by
+ * property notifies since the last call (see wavetbl_fluidsynth_prop_callback)
+ */
+static gboolean
+cache_update_flush(gpointer data)
+{
+    WavetblFluidSynth *wavetbl = data;
+    GHashTable *dirty;
+
+    SWAMI_LOCK_WRITE(wavetbl);
+    dirty = wavetbl->cache_dirty;         /* !! takes over dirty items */
+    wavetbl->cache_dirty = NULL;
+    wavetbl->cache_update_id = 0;
+    SWAMI_UNLOCK_WRITE(wavetbl);
+
+    if(dirty)
+    {
+        g_hash_table_foreach(dirty, cache_update_GHFunc, wavetbl);
+        g_hash_table_destroy(dirty);    /* -- unref items */
+    }
+
+    return (FALSE);
+}
+
+static void
+cache_update_GHFunc(gpointer key, gpointer value, gpointer user_data)
+{
+    wavetbl_fluidsynth_update_item((SwamiWavetbl *)user_data, (IpatchItem *)key);
+}
+
+/* noteon event function for cached instruments.
+ * MT-NOTE: Called in the synthesis thread, hash is the voice cache hash from
+ * voice_cache_read_begin().  No locks or GObject references are used.
+ */
+static int
+cache_instrument_noteon(WavetblFluidSynth *wavetbl, GHashTable *hash,
+                        IpatchItem *item, fluid_synth_t *synth, int chan,
+                        int key, int vel)
+{
+    guint16 index_array[MAX_INST_VOICES];		/* voice index array */
+    int sel_values[IPATCH_SF2_VOICE_CACHE_MAX_SEL_VALUES];
+    fluid_voice_t *fluid_voices[MAX_REALTIME_VOICES];
+    IpatchSF2VoiceCache *cache;
+    IpatchSF2VoiceSelInfo *sel_info;
+    IpatchSF2GenArray *gen_array;
+    fluid_voice_t *flvoice;
+    CachedVoice *cvoice;
+    IpatchSF2Voice *voice;
+    CacheEntry *entry;
+    int i, voice_count, voice_num;
+
+    entry = g_hash_table_lookup(hash, item);
+
+    if(!entry)    /* instrument not yet cached or evicted? */
+    {
+        g_atomic_int_inc(&voice_cache_misses);
+
+        /* re-cache evicted presets, queued outside of the synthesis thread */
+        if(wavetbl->preload_presets
+                && item != g_atomic_pointer_get((gpointer *)&wavetbl->active_item))
+        {
+            cache_miss_post(wavetbl, item);
+        }
+
+        return (FLUID_OK);
+    }
+
+    g_atomic_int_inc(&voice_cache_hits);
+    g_atomic_int_set(&entry->last_use,
+                     g_atomic_int_exchange_and_add(&voice_cache_clock, 1));
+    cache = entry->cache;
+
+    for(i = 0; i < cache->sel_count; i++)
+    {
+        sel_info = &cache->sel_info[i];
+
+        switch(sel_info->type)
+        {
+        case IPATCH_SF2_VOICE_SEL_NOTE:
+            sel_values[i] = key;
+            break;
+
+        case IPATCH_SF2_VOICE_SEL_VELOCITY:
+            sel_values[i] = vel;
+            break;
+
+        default:
+            sel_values[i] = 127;	/* FIXME */
+            break;
+        }
+    }
+
+    voice_count = ipatch_sf2_voice_cache_select(cache, sel_values, index_array,
+                  MAX_INST_VOICES);
+
+    /* loop over matching voice indexes */
+    for(voice_num = 0; voice_num < voice_count; voice_num++)
+    {
+        voice = IPATCH_SF2_VOICE_CACHE_GET_VOICE(cache, index_array[voice_num]);
+        cvoice = g_atomic_pointer_get(&voice->user_data);
+
+        if(!cvoice || !cvoice->sample)
+        {
+            continue;    /* For ROM and other non-readable samples */
+        }
+
+        /* allocate the FluidSynth voice */
+        flvoice = fluid_synth_alloc_voice(synth, cvoice->sample, chan, key, vel);
+
+        if(!flvoice)
+        {
+            g_atomic_int_inc(&voice_alloc_failures);
+            return (TRUE);
+        }
+
+        /* set only those generator parameters that are set */
+        gen_array = &cvoice->gen_array;
+
+        for(i = 0; i < IPATCH_SF2_GEN_COUNT; i++)
+            if(IPATCH_SF2_GEN_ARRAY_TEST_FLAG(gen_array, i))
+            {
+                fluid_voice_gen_set(flvoice, i, (float)(gen_array->values[i].sword));
+            }
+
+        /* set modulators converted by cached_voice_new() */
+        for(i = 0; i < cvoice->mod_count; i++)
+        {
+            fluid_voice_add_mod(flvoice, CACHED_VOICE_MOD(cvoice, i),
+                                FLUID_VOICE_OVERWRITE);
+        }
+
+        fluid_synth_start_voice(synth, flvoice);  /* let 'er rip */
+
+        /* voice pointers are only used for realtime note on, but not much CPU */
+        if(voice_num < MAX_REALTIME_VOICES)
+        {
+            fluid_voices[voice_num] = flvoice;
+        }
+    }
+
+    /* check if item is the active audible, and update realtime vars if so
+     * (cache is kept alive for active_item_realtime_update() by the hash or
+     * by rt_hold, see voice_cache_hash_publish()), only for the wavetbl's own
+     * synth and not offline render synths */
+    if(synth == wavetbl->synth
+            && item == g_atomic_pointer_get((gpointer *)&wavetbl->active_item))
+    {
+        g_atomic_int_inc(&wavetbl->rt_seq);     /* odd: being written */
+
+        wavetbl->rt_note.item = item;
+        wavetbl->rt_note.cache = cache;
+
+        /* store selection criteria and FluidSynth voices for note event */
+        memcpy(wavetbl->rt_note.sel_values, sel_values,
+               cache->sel_count * sizeof(sel_values[0]));
+        memcpy(wavetbl->rt_note.voices, fluid_voices,
+               MIN(voice_count, MAX_REALTIME_VOICES) * sizeof(fluid_voices[0]));
+        wavetbl->rt_note.count = voice_count;
+
+        g_atomic_int_inc(&wavetbl->rt_seq);     /* even: done */
+    }
+
+    return (FLUID_OK);
+}
+
+/* Perform a realtime update on the active audible.  The generator updates
+ * are coalesced into rt_updates, which the audio callback applies once per
+ * period, so fast property changes (slider drags) only cost a table store.
+ * MT-NOTE: Wavetbl instance must be locked by caller.
+ */
+static void
+active_item_realtime_update(WavetblFluidSynth *wavetbl, IpatchItem *item,
+                            GParamSpec *pspec, const GValue *value)
+{
+    IpatchSF2VoiceUpdate updates[MAX_REALTIME_UPDATES], *upd;
+    RealtimeUpdates *rtupd = wavetbl->rt_updates;
+    RealtimeNote note;
+    int count, i, seq, rt_count;
+
+    /* voice cache lock keeps note.cache from being freed, see rt_hold */
+    voice_cache_lock();
+
+    seq = rt_note_read(wavetbl, &note);
+    rt_count = MIN(note.count, MAX_REALTIME_VOICES);
+
+    /* no note or note was played on a previous active item? */
+    if(!note.cache || rt_count == 0 || note.item != wavetbl->active_item)
+    {
+        G_UNLOCK(voice_cache_hash);
+        return;
+    }
+
+    count = ipatch_sf2_voice_cache_update
+            (note.cache, note.sel_values, (GObject *)(wavetbl->active_item),
+             (GObject *)item, pspec, value, updates, MAX_REALTIME_UPDATES);
+
+    G_UNLOCK(voice_cache_hash);
+
+    G_LOCK(rt_updates);
+
+    /* updates are for a new note? Pending updates of the old one are stale. */
+    if(rtupd->seq != seq || rtupd->count == 0)
+    {
+        for(i = 0; i < rtupd->pending_count; i++)
+        {
+            rtupd->dirty[rtupd->pending[i] / IPATCH_SF2_GEN_COUNT]
+            [rtupd->pending[i] % IPATCH_SF2_GEN_COUNT] = FALSE;
+        }
+
+        rtupd->pending_count = 0;
+        rtupd->seq = seq;
+        memcpy(rtupd->voices, note.voices, rt_count * sizeof(note.voices[0]));
+        rtupd->count = rt_count;
+    }
+
+    /* keep only the latest value per voice and generator */
+    for(i = 0; i < count; i++)
+    {
+        upd = &updates[i];
+
+        if(upd->voice >= rt_count || upd->genid >= IPATCH_SF2_GEN_COUNT)
+        {
+            continue;
+        }
+
+        rtupd->values[upd->voice][upd->genid] = upd->ival;
+
+        if(!rtupd->dirty[upd->voice][upd->genid])
+        {
+            rtupd->dirty[upd->voice][upd->genid] = TRUE;
+            rtupd->pending[rtupd->pending_count++]
+                = upd->voice * IPATCH_SF2_GEN_COUNT + upd->genid;
+        }
+    }
+
+    G_UNLOCK(rt_updates);
+
+    /* no audio callback to apply them? */
+    if(!wavetbl->audio)
+    {
+        rt_updates_apply(wavetbl, TRUE);
+    }
+}
+
+/* Apply pending realtime updates to the FluidSynth voices of the most recent
+ * note.  If wait is FALSE and the updates are locked, they are left for the
+ * next call, so the audio callback never blocks.
+ * MT-NOTE: Called in the audio thread, or any thread if wait is TRUE.
+ */
+static void
+rt_updates_apply(WavetblFluidSynth *wavetbl, gboolean wait)
+{
+    RealtimeUpdates *rtupd = wavetbl->rt_updates;
+    int voice, genid, i;
+
+    if(wait)
+    {
+        G_LOCK(rt_updates);
+    }
+    else if(!G_TRYLOCK(rt_updates))
+    {
+        return;
+    }
+
+    /* a new note was played since the updates? It already uses the new
+     * values from the voice cache, so updates are only cleared. */
+    if(rtupd->seq == g_atomic_int_get(&wavetbl->rt_seq))
+    {
+        for(i = 0; i < rtupd->pending_count; i++)
+        {
+            voice = rtupd->pending[i] / IPATCH_SF2_GEN_COUNT;
+            genid = rtupd->pending[i] % IPATCH_SF2_GEN_COUNT;
+            fluid_voice_gen_set(rtupd->voices[voice], genid,
+                                rtupd->values[voice][genid]);
+        }
+
+        /* update parameters (do separately so things are "more" atomic) */
+        for(i = 0; i < rtupd->pending_count; i++)
+        {
+            voice = rtupd->pending[i] / IPATCH_SF2_GEN_COUNT;
+            genid = rtupd->pending[i] % IPATCH_SF2_GEN_COUNT;
+            fluid_voice_update_param(rtupd->voices[voice], genid);
+        }
+    }
+
+    for(i = 0; i < rtupd->pending_count; i++)
+    {
+        rtupd->dirty[rtupd->pending[i] / IPATCH_SF2_GEN_COUNT]
+        [rtupd->pending[i] % IPATCH_SF2_GEN_COUNT] = FALSE;
+    }
+
+    rtupd->pending_count = 0;
+
+    G_UNLOCK(rt_updates);
+}
+
+static GType
+render_register_type(SwamiPlugin *plugin)
+{
+    static const GTypeInfo obj_info =
+    {
+        sizeof(WavetblFluidSynthRenderClass), NULL, NULL,
+        (GClassInitFunc) render_class_init, NULL, NULL,
+        sizeof(WavetblFluidSynthRender), 0,
+        (GInstanceInitFunc) render_init,
+    };
+
+    /* registered static for the same reason as in wavetbl_register_type() */
+    return g_type_register_static(G_TYPE_OBJECT, "WavetblFluidSynthRender",
+                                  &obj_info, 0);
+}
+
+static void
+render_class_init(WavetblFluidSynthRenderClass *klass)
+{
+    GObjectClass *obj_class = G_OBJECT_CLASS(klass);
+
+    render_parent_class = g_type_class_peek_parent(klass);
+    obj_class->finalize = render_finalize;
+    obj_class->set_property = render_set_property;
+    obj_class->get_property = render_get_property;
+
+    klass->add_event = render_real_add_event;
+    klass->clear_events = render_real_clear_events;
+
+    /* add an event to the event list: (time in msecs, SwamiMidiEvent *) */
+    render_signals[RENDER_ADD_EVENT] =
+        g_signal_new("add-event", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(WavetblFluidSynthRenderClass, add_event),
+                     NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+                     G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_POINTER);
+    render_signals[RENDER_CLEAR_EVENTS] =
+        g_signal_new("clear-events", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(WavetblFluidSynthRenderClass, clear_events),
+                     NULL, NULL, g_cclosure_marshal_VOID__VOID,
+                     G_TYPE_NONE, 0);
+
+    g_object_class_install_property(obj_class, RENDER_PROP_WAVETBL,
+                                    g_param_spec_object("wavetbl", _("Wavetable"),
+                                            _("FluidSynth wavetable to render with"),
+                                            WAVETBL_TYPE_FLUIDSYNTH,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_PATCHES,
+                                    g_param_spec_object("patches", _("Patches"),
+                                            _("Patches to load (NULL for patches loaded in wavetable)"),
+                                            IPATCH_TYPE_LIST,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_MIDI_FILE,
+                                    g_param_spec_string("midi-file", _("MIDI file"),
+                                            _("MIDI file to render (NULL for event list)"),
+                                            NULL, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_FILE_NAME,
+                                    g_param_spec_string("file-name", _("File name"),
+                                            _("Output sound file name"),
+                                            NULL, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_FILE_FORMAT,
+                                    g_param_spec_int("file-format", _("File format"),
+                                            _("Output file format (IpatchSndFileFormat value)"),
+                                            0, G_MAXINT, IPATCH_SND_FILE_DEFAULT_FORMAT,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_FLOAT_OUTPUT,
+                                    g_param_spec_boolean("float-output", _("Float output"),
+                                            _("Write floating point audio instead of 16 bit"),
+                                            FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_SAMPLE_RATE,
+                                    g_param_spec_int("sample-rate", _("Sample rate"),
+                                            _("Output sample rate (0 for wavetable sample rate)"),
+                                            0, 192000, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_BLOCK_SIZE,
+                                    g_param_spec_int("block-size", _("Block size"),
+                                            _("Frames rendered per FluidSynth call"),
+                                            64, 1024 * 1024, RENDER_DEFAULT_BLOCK_SIZE,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_TAIL_TIME,
+                                    g_param_spec_uint("tail-time", _("Tail time"),
+                                            _("Milliseconds rendered after the end"),
+                                            0, G_MAXUINT, RENDER_DEFAULT_TAIL_TIME,
+                                            G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_THREADS,
+                                    g_param_spec_int("threads", _("Threads"),
+                                            _("Count of channel groups rendered in parallel"),
+                                            1, 64, 1, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_ACTIVE,
+                                    g_param_spec_boolean("active", _("Active"),
+                                            _("Set to start or cancel rendering"),
+                                            FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(obj_class, RENDER_PROP_POSITION,
+                                    g_param_spec_uint("position", _("Position"),
+                                            _("Milliseconds rendered so far"),
+                                            0, G_MAXUINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, RENDER_PROP_REALTIME_FACTOR,
+                                    g_param_spec_float("realtime-factor", _("Realtime factor"),
+                                            _("Audio time divided by render time of last render"),
+                                            0.0, G_MAXFLOAT, 0.0, G_PARAM_READABLE));
+    g_object_class_install_property(obj_class, RENDER_PROP_ERROR,
+                                    g_param_spec_string("error", _("Error"),
+                                            _("Error message of last render or NULL"),
+                                            NULL, G_PARAM_READABLE));
+}
+
+static void
+render_init(WavetblFluidSynthRender *render)
+{
+    render->events = g_array_new(FALSE, FALSE, sizeof(RenderEvent));
+    render->file_format = IPATCH_SND_FILE_DEFAULT_FORMAT;
+    render->block_size = RENDER_DEFAULT_BLOCK_SIZE;
+    render->tail_time = RENDER_DEFAULT_TAIL_TIME;
+    render->threads = 1;
+}
+
+static void
+render_finalize(GObject *object)
+{
+    WavetblFluidSynthRender *render = WAVETBL_FLUIDSYNTH_RENDER(object);
+
+    render_stop(render);
+
+    if(render->done_id)
+    {
+        g_source_remove(render->done_id);
+    }
+
+    if(render->wavetbl)
+    {
+        g_object_unref(render->wavetbl);    /* -- unref wavetbl */
+    }
+
+    if(render->patches)
+    {
+        g_object_unref(render->patches);    /* -- unref patch list */
+    }
+
+    g_array_free(render->events, TRUE);
+    g_free(render->midi_file);
+    g_free(render->file_name);
+    g_free(render->error);
+
+    render_parent_class->finalize(object);
+}
+
+static void
+render_set_property(GObject *object, guint property_id,
+                    const GValue *value, GParamSpec *pspec)
+{
+    WavetblFluidSynthRender *render = WAVETBL_FLUIDSYNTH_RENDER(object);
+
+    if(property_id != RENDER_PROP_ACTIVE
+            && g_atomic_int_get(&render->running))
+    {
+        g_warning(_("Can't change render parameters while rendering"));
+        return;
+    }
+
+    switch(property_id)
+    {
+    case RENDER_PROP_WAVETBL:
+        if(render->wavetbl)
+        {
+            g_object_unref(render->wavetbl);    /* -- unref old wavetbl */
+        }
+
+        render->wavetbl = g_value_dup_object(value);    /* ++ ref wavetbl */
+        break;
+
+    case RENDER_PROP_PATCHES:
+        if(render->patches)
+        {
+            g_object_unref(render->patches);    /* -- unref old list */
+        }
+
+        render->patches = g_value_dup_object(value);    /* ++ ref list */
+        break;
+
+    case RENDER_PROP_MIDI_FILE:
+        g_free(render->midi_file);
+        render->midi_file = g_value_dup_string(value);
+        break;
+
+    case RENDER_PROP_FILE_NAME:
+        g_free(render->file_name);
+        render->file_name = g_value_dup_string(value);
+        break;
+
+    case RENDER_PROP_FILE_FORMAT:
+        render->file_format = g_value_get_int(value);
+        break;
+
+    case RENDER_PROP_FLOAT_OUTPUT:
+        render->float_output = g_value_get_boolean(value);
+        break;
+
+    case RENDER_PROP_SAMPLE_RATE:
+        render->sample_rate = g_value_get_int(value);
+        break;
+
+    case RENDER_PROP_BLOCK_SIZE:
+        render->block_size = g_value_get_int(value);
+        break;
+
+    case RENDER_PROP_TAIL_TIME:
+        render->tail_time = g_value_get_uint(value);
+        break;
+
+    case RENDER_PROP_THREADS:
+        render->threads = g_value_get_int(value);
+        break;
+
+    case RENDER_PROP_ACTIVE:
+        if(g_value_get_boolean(value))
+        {
+            render_start(render);
+        }
+        else
+        {
+            render_stop(render);
+        }
+
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+render_get_property(GObject *object, guint property_id,
+                    GValue *value, GParamSpec *pspec)
+{
+    WavetblFluidSynthRender *render = WAVETBL_FLUIDSYNTH_RENDER(object);
+    gboolean running = g_atomic_int_get(&render->running);
+
+    switch(property_id)
+    {
+    case RENDER_PROP_WAVETBL:
+        g_value_set_object(value, render->wavetbl);
+        break;
+
+    case RENDER_PROP_PATCHES:
+        g_value_set_object(value, render->patches);
+        break;
+
+    case RENDER_PROP_MIDI_FILE:
+        g_value_set_string(value, render->midi_file);
+        break;
+
+    case RENDER_PROP_FILE_NAME:
+        g_value_set_string(value, render->file_name);
+        break;
+
+    case RENDER_PROP_FILE_FORMAT:
+        g_value_set_int(value, render->file_format);
+        break;
+
+    case RENDER_PROP_FLOAT_OUTPUT:
+        g_value_set_boolean(value, render->float_output);
+        break;
+
+    case RENDER_PROP_SAMPLE_RATE:
+        g_value_set_int(value, render->sample_rate);
+        break;
+
+    case RENDER_PROP_BLOCK_SIZE:
+        g_value_set_int(value, render->block_size);
+        break;
+
+    case RENDER_PROP_TAIL_TIME:
+        g_value_set_uint(value, render->tail_time);
+        break;
+
+    case RENDER_PROP_THREADS:
+        g_value_set_int(value, render->threads);
+        break;
+
+    case RENDER_PROP_ACTIVE:
+        g_value_set_boolean(value, running);
+        break;
+
+    case RENDER_PROP_POSITION:
+        g_value_set_uint(value, (guint)g_atomic_int_get(&render->position));
+        break;
+
+    /* results are only valid once the render thread is done */
+    case RENDER_PROP_REALTIME_FACTOR:
+        g_value_set_float(value, running ? 0.0 : render->realtime_factor);
+        break;
+
+    case RENDER_PROP_ERROR:
+        g_value_set_string(value, running ? NULL : render->error);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+/* "add-event" signal class handler */
+static void
+render_real_add_event(WavetblFluidSynthRender *render, guint time,
+                      SwamiMidiEvent *event)
+{
+    RenderEvent revent;
+
+    g_return_if_fail(event != NULL);
+
+    if(g_atomic_int_get(&render->running))
+    {
+        g_warning(_("Can't change render parameters while rendering"));
+        return;
+    }
+
+    revent.time = time;
+    revent.index = render->events->len;
+    revent.event = *event;
+    g_array_append_val(render->events, revent);
+}
+
+/* "clear-events" signal class handler */
+static void
+render_real_clear_events(WavetblFluidSynthRender *render)
+{
+    if(g_atomic_int_get(&render->running))
+    {
+        g_warning(_("Can't change render parameters while rendering"));
+        return;
+    }
+
+    g_array_set_size(render->events, 0);
+}
+
+/* start rendering in a new thread */
+static void
+render_start(WavetblFluidSynthRender *render)
+{
+    GError *err = NULL;
+
+    if(g_atomic_int_get(&render->running))
+    {
+        return;
+    }
+
+    /* join previous render thread (if any), done notify not needed */
+    if(render->done_id)
+    {
+        g_source_remove(render->done_id);
+        render->done_id = 0;
+    }
+
+    render_stop(render);
+
+    g_free(render->error);
+    render->error = NULL;
+    render->realtime_factor = 0.0;
+    render->cancel = FALSE;
+    render->position = 0;
+
+    if(!render->wavetbl || !render->file_name)
+    {
+        render->error = g_strdup(_("Render wavetable and file name must be set"));
+        g_object_notify(G_OBJECT(render), "error");
+        return;
+    }
+
+    g_atomic_int_set(&render->running, TRUE);
+
+    render->thread = g_thread_create(render_thread, render, TRUE, &err);
+
+    if(!render->thread)
+    {
+        g_atomic_int_set(&render->running, FALSE);
+        render->error = g_strdup(ipatch_gerror_message(err));
+        g_clear_error(&err);
+        g_object_notify(G_OBJECT(render), "error");
+    }
+}
+
+/* cancel rendering (if active) and wait for the render thread */
+static void
+render_stop(WavetblFluidSynthRender *render)
+{
+    if(!render->thread)
+    {
+        return;
+    }
+
+    g_atomic_int_set(&render->cancel, TRUE);
+    g_thread_join(render->thread);
+    render->thread = NULL;
+}
+
+/* idle callback to notify that rendering is done (in GUI thread) */
+static gboolean
+render_done(gpointer data)
+{
+    WavetblFluidSynthRender *render = WAVETBL_FLUIDSYNTH_RENDER(data);
+
+    render->done_id = 0;
+    render_stop(render);        /* thread is done, join it */
+
+    g_object_notify(G_OBJECT(render), "active");
+
+    return (FALSE);
+}
+
+static gpointer
+render_thread(gpointer data)
+{
+    WavetblFluidSynthRender *render = WAVETBL_FLUIDSYNTH_RENDER(data);
+    GError *err = NULL;
+
+    if(!render_run(render, &err))
+    {
+        render->error = g_strdup(ipatch_gerror_message(err));
+        g_clear_error(&err);
+    }
+
+    /* done_id is removed by render_finalize(), after joining this thread */
+    render->done_id = g_idle_add(render_done, render);
+    g_atomic_int_set(&render->running, FALSE);
+
+    return (NULL);
+}
+
+/* Render the MIDI file or event list to the output file.  Channels are split
+ * into "threads" parts (channel % parts), each rendered by its own FluidSynth
+ * instance and thread, sharing the voice caches.  Each part runs reverb and
+ * chorus with the same parameters, since these effects are linear this
+ * matches running them once on the mixed bus, up to float rounding, as long
+ * as no part runs out of polyphony where a single instance wouldn't (or the
+ * other way around).  MIDI files are split by a player playback callback,
+ * which requires FluidSynth 2.2, with older versions they are rendered as
+ * a single part.
+ * MT-NOTE: Called in the render thread.
+ */
+static gboolean
+render_run(WavetblFluidSynthRender *render, GError **err)
+{
+    WavetblFluidSynth *wavetbl = render->wavetbl;
+    fluid_settings_t *settings;
+    RenderPart *parts = NULL;
+    RenderSync sync = { NULL, NULL, 0 };
+    GThreadPool *pool = NULL;
+    IpatchSample *store = NULL;
+    IpatchSampleHandle handle;
+    gboolean handle_open = FALSE;
+    gboolean retval = FALSE;
+    GSList *patches, *items, *p;
+    GTimer *timer = NULL;
+    float *buf = NULL;
+    guint64 frames = 0, end_frame, tail;
+    double rate;
+    guint count, i;
+    int sub_format, channels, nparts, n;
+
+    settings = render_settings_new(wavetbl, render->sample_rate);
+    fluid_settings_getnum(settings, "synth.sample-rate", &rate);
+    fluid_settings_getint(settings, "synth.midi-channels", &channels);
+
+    /* MIDI file player timing is driven by the rendered samples */
+    fluid_settings_setstr(settings, "player.timing-source", "sample");
+
+    /* make sure all presets are cached, offline rendering can't wait */
+    patches = render_get_patches(render);     /* ++ ref patches */
+    items = render_cache_presets(render, patches);    /* ++ ref pinned items */
+
+    nparts = CLAMP(render->threads, 1, MAX(channels, 1));
+
+#if !FLUID_VERSION_ATLEAST(2,2,0)
+    /* no player playback callback to split MIDI files by channel */
+    if(render->midi_file)
+    {
+        nparts = 1;
+    }
+#endif
+    parts = g_new0(RenderPart, nparts);
+
+    for(n = 0; n < nparts; n++)
+    {
+        parts[n].render = render;
+        parts[n].index = n;
+        parts[n].count = nparts;
+        parts[n].rate = rate;
+        parts[n].sync = &sync;
+        parts[n].buf = g_new(float, render->block_size * 2);
+        parts[n].synth = render_synth_new(wavetbl, settings, patches);
+
+        if(!parts[n].synth)
+        {
+            g_set_error(err, SWAMI_ERROR, SWAMI_ERROR_FAIL,
+                        _("Failed to create FluidSynth context"));
+            goto ret;
+        }
+
+        /* FluidSynth samples of voice caches must outlive its voices */
+        retired_synth_add(parts[n].synth);
+
+        if(!render->midi_file)
+        {
+            continue;
+        }
+
+        parts[n].player = new_fluid_player(parts[n].synth);
+
+        if(!parts[n].player
+                || fluid_player_add(parts[n].player, render->midi_file) != FLUID_OK)
+        {
+            g_set_error(err, SWAMI_ERROR, SWAMI_ERROR_FAIL,
+                        _("Failed to load MIDI file '%s'"), render->midi_file);
+            goto ret;
+        }
+
+#if FLUID_VERSION_ATLEAST(2,2,0)
+
+        if(nparts > 1)
+        {
+            fluid_player_set_playback_callback(parts[n].player,
+                                               render_part_playback, &parts[n]);
+        }
+
+#endif
+    }
+
+    /* part 0 is rendered by this thread, the others in the pool */
+    if(nparts > 1)
+    {
+        sync.mutex = g_mutex_new();
+        sync.cond = g_cond_new();
+        pool = g_thread_pool_new(render_part_func, NULL, nparts - 1, TRUE, err);
+
+        if(!pool)
+        {
+            goto ret;
+        }
+    }
+
+    /* ++ ref sound file sample store for writing */
+    sub_format = ipatch_snd_file_sample_format_to_sub_format
+                 (render->float_output ? IPATCH_SAMPLE_FLOAT : IPATCH_SAMPLE_16BIT,
+                  render->file_format);
+    store = ipatch_sample_store_snd_file_new(render->file_name);
+
+    if(!ipatch_sample_store_snd_file_init_write
+            (IPATCH_SAMPLE_STORE_SND_FILE(store), render->file_format, sub_format,
+             IPATCH_SND_FILE_ENDIAN_FILE, 2, (int)rate))
+    {
+        g_set_error(err, SWAMI_ERROR, SWAMI_ERROR_FAIL,
+                    _("Unsupported render output file format"));
+        goto ret;
+    }
+
+    if(!ipatch_sample_handle_open(store, &handle, 'w',
+                                  IPATCH_SAMPLE_FLOAT | IPATCH_SAMPLE_STEREO
+                                  | IPATCH_SAMPLE_ENDIAN_HOST,
+                                  IPATCH_SAMPLE_UNITY_CHANNEL_MAP, err))
+    {
+        goto ret;
+    }
+
+    handle_open = TRUE;
+
+    tail = (guint64)render->tail_time * (guint64)rate / 1000;
+
+    if(render->midi_file)
+    {
+        for(n = 0; n < nparts; n++)
+        {
+            fluid_player_play(parts[n].player);
+        }
+
+        end_frame = G_MAXUINT64;        /* set once players are done */
+    }
+    else
+    {
+        /* blocks are split at event times, so events are sample accurate */
+        g_array_sort(render->events, render_event_compare);
+        end_frame = tail;
+
+        if(render->events->len > 0)
+        {
+            end_frame += (guint64)g_array_index(render->events, RenderEvent,
+                                                render->events->len - 1).time
+                         * (guint64)rate / 1000;
         }
+    }
 
-        /* set only those generator parameters that are set */
-        gen_array = &voice->gen_array;
+    buf = (nparts > 1) ? g_new(float, render->block_size * 2) : parts[0].buf;
+    timer = g_timer_new();
 
-        for(i = 0; i < IPATCH_SF2_GEN_COUNT; i++)
-            if(IPATCH_SF2_GEN_ARRAY_TEST_FLAG(gen_array, i))
+    while(!g_atomic_int_get(&render->cancel))
+    {
+        /* MIDI file done? Render the tail for releases, reverb and chorus */
+        if(end_frame == G_MAXUINT64
+                && fluid_player_get_status(parts[0].player) != FLUID_PLAYER_PLAYING)
+        {
+            end_frame = frames + tail;
+        }
+
+        if(frames >= end_frame)
+        {
+            break;
+        }
+
+        count = MIN(end_frame - frames, (guint64)render->block_size);
+
+        for(n = 0; n < nparts; n++)
+        {
+            parts[n].frames = frames;
+            parts[n].block_frames = count;
+        }
+
+        if(pool)
+        {
+            sync.pending = nparts - 1;
+
+            for(n = 1; n < nparts; n++)
             {
-                fluid_voice_gen_set(flvoice, i, (float)(gen_array->values[i].sword));
+                g_thread_pool_push(pool, &parts[n], NULL);
             }
+        }
 
-        /* set modulators in fvoice internal list */
-        /* Note: here modulators are assumed non-linked modulators */
-        wumod = g_alloca(fluid_mod_sizeof());
-        /* clear  fields is more safe.( in particular next field ) */
-        memset(wumod, 0, fluid_mod_sizeof());
-        p = voice->mod_list;
+        render_part_block(&parts[0]);
 
-        while(p)
+        /* wait for the other parts and mix them */
+        if(pool)
         {
-            mod = (IpatchSF2Mod *)(p->data);
+            g_mutex_lock(sync.mutex);
 
-            fluid_mod_set_dest(wumod, mod->dest);
-            fluid_mod_set_source1(wumod,
-                                  mod->src & IPATCH_SF2_MOD_MASK_CONTROL,
-                                  ((mod->src & (IPATCH_SF2_MOD_MASK_DIRECTION
-                                                | IPATCH_SF2_MOD_MASK_POLARITY
-                                                | IPATCH_SF2_MOD_MASK_TYPE))
-                                   >> IPATCH_SF2_MOD_SHIFT_DIRECTION)
-                                  | ((mod->src & IPATCH_SF2_MOD_MASK_CC) ? FLUID_MOD_CC : 0));
+            while(sync.pending > 0)
+            {
+                g_cond_wait(sync.cond, sync.mutex);
+            }
 
-            fluid_mod_set_source2(wumod,
-                                  mod->amtsrc & IPATCH_SF2_MOD_MASK_CONTROL,
-                                  ((mod->amtsrc & (IPATCH_SF2_MOD_MASK_DIRECTION
-                                                   | IPATCH_SF2_MOD_MASK_POLARITY
-                                                   | IPATCH_SF2_MOD_MASK_TYPE))
-                                   >> IPATCH_SF2_MOD_SHIFT_DIRECTION)
-                                  | ((mod->amtsrc & IPATCH_SF2_MOD_MASK_CC) ? FLUID_MOD_CC : 0));
+            g_mutex_unlock(sync.mutex);
 
-            fluid_mod_set_amount(wumod, mod->amount);
+            memcpy(buf, parts[0].buf, count * 2 * sizeof(float));
 
-            fluid_voice_add_mod(flvoice, wumod, FLUID_VOICE_OVERWRITE);
+            for(n = 1; n < nparts; n++)
+                for(i = 0; i < count * 2; i++)
+                {
+                    buf[i] += parts[n].buf[i];
+                }
+        }
 
-            p = p->next;
+        if(!render_write(render, &handle, buf, count, &frames, rate, err))
+        {
+            goto ret;
         }
+    }
 
-        fluid_synth_start_voice(synth, flvoice);  /* let 'er rip */
+    if(g_atomic_int_get(&render->cancel))
+    {
+        g_set_error(err, SWAMI_ERROR, SWAMI_ERROR_CANCELED,
+                    _("Render canceled"));
+        goto ret;
+    }
 
-        /* voice pointers are only used for realtime note on, but not much CPU */
-        if(voice_num < MAX_REALTIME_VOICES)
+    if(g_timer_elapsed(timer, NULL) > 0.0)
+    {
+        render->realtime_factor = (frames / rate) / g_timer_elapsed(timer, NULL);
+    }
+
+    retval = TRUE;
+
+ret:
+    if(pool)
+    {
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+
+    if(sync.mutex)
+    {
+        g_mutex_free(sync.mutex);
+        g_cond_free(sync.cond);
+    }
+
+    if(timer)
+    {
+        g_timer_destroy(timer);
+    }
+
+    if(handle_open)
+    {
+        ipatch_sample_handle_close(&handle);
+    }
+
+    if(store)
+    {
+        g_object_unref(store);    /* -- unref sample store */
+    }
+
+    /* don't leave a partial output file behind */
+    if(handle_open && !retval)
+    {
+        g_unlink(render->file_name);
+    }
+
+    if(nparts > 1)
+    {
+        g_free(buf);
+    }
+
+    for(n = 0; n < nparts; n++)
+    {
+        if(parts[n].player)
         {
-            fluid_voices[voice_num] = flvoice;
+            delete_fluid_player(parts[n].player);
         }
 
-        /* !! store reference taken over by wusample structure */
+        if(parts[n].synth)
+        {
+            retired_synth_delete(parts[n].synth);
+        }
+
+        g_free(parts[n].buf);
+    }
+
+    g_free(parts);
+    delete_fluid_settings(settings);
+
+    retired_samples_free();
+
+    voice_cache_unpin(items);
+
+    for(p = items; p; p = p->next)
+    {
+        g_object_unref(p->data);    /* -- unref item */
+    }
+
+    g_slist_free(items);
+
+    for(p = patches; p; p = p->next)
+    {
+        g_object_unref(p->data);    /* -- unref patch */
     }
 
-    g_object_unref(cache);	/* -- unref cache */
+    g_slist_free(patches);
+
+    return (retval);
+}
+
+/* Cache the presets of the render patches and the active item.  They are
+ * pinned in the voice cache (regardless of the memory budget), so the render
+ * output doesn't depend on what else gets cached while rendering.
+ * Returns: List of pinned items (caller owns references), to unpin with
+ *   voice_cache_unpin() when done rendering
+ */
+static GSList *
+render_cache_presets(WavetblFluidSynthRender *render, GSList *patches)
+{
+    WavetblFluidSynth *wavetbl = render->wavetbl;
+    IpatchList *list;
+    GSList *items = NULL, *p;
+    gboolean cached;
+    GList *lp;
 
-    /* check if item is the active audible, and update realtime vars if so */
-    if(item == wavetbl->active_item)
+    for(p = patches; p; p = p->next)
     {
-        if(wavetbl->rt_cache)
+        /* ++ ref list of children */
+        list = ipatch_container_get_children(IPATCH_CONTAINER(p->data),
+                                             IPATCH_TYPE_ITEM);
+
+        for(lp = list->items; lp; lp = lp->next)
         {
-            g_object_unref(wavetbl->rt_cache);
+            if(cache_item_is_preset((IpatchItem *)(lp->data)))
+            {
+                items = g_slist_prepend(items, g_object_ref(lp->data)); /* ++ ref */
+            }
         }
 
-        wavetbl->rt_cache = g_object_ref(cache);
+        g_object_unref(list);         /* -- unref list */
+    }
 
-        /* store selection criteria and FluidSynth voices for note event */
-        memcpy(wavetbl->rt_sel_values, sel_values,
-               cache->sel_count * sizeof(sel_values[0]));
-        memcpy(wavetbl->rt_voices, fluid_voices,
-               MIN(voice_count, MAX_REALTIME_VOICES) * sizeof(fluid_voices[0]));
-        wavetbl->rt_count = voice_count;
+    SWAMI_LOCK_READ(wavetbl);
+
+    if(wavetbl->active_item)
+    {
+        items = g_slist_prepend(items, g_object_ref(wavetbl->active_item)); /* ++ ref */
     }
 
-    return (FLUID_OK);
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    /* pin before caching, so caching one can't evict another */
+    voice_cache_pin(items);
+
+    for(p = items; p; p = p->next)
+    {
+        voice_cache_lock();
+        cached = g_hash_table_lookup(voice_cache_hash, p->data) != NULL;
+        G_UNLOCK(voice_cache_hash);
+
+        if(!cached)
+        {
+            cache_instrument(wavetbl, (IpatchItem *)(p->data), FALSE);
+        }
+    }
+
+    return (items);
 }
 
-/* perform a realtime update on the active audible.
- * MT-NOTE: Wavetbl instance must be locked by caller.
+/* Render a block of a render part, dispatching the events of its channels at
+ * their exact frame.
+ * MT-NOTE: Called in the render thread or a render pool thread.
  */
 static void
-active_item_realtime_update(WavetblFluidSynth *wavetbl, IpatchItem *item,
-                            GParamSpec *pspec, const GValue *value)
+render_part_block(RenderPart *part)
 {
-    IpatchSF2VoiceUpdate updates[MAX_REALTIME_UPDATES], *upd;
-    int count, i, rt_count;
+    GArray *events = part->render->events;
+    RenderEvent *revent;
+    guint64 evframe;
+    guint done = 0, count;
+
+    while(done < part->block_frames)
+    {
+        count = part->block_frames - done;
+
+        /* events of MIDI file parts are dispatched by the player */
+        for(; !part->player && part->event_index < events->len;
+                part->event_index++)
+        {
+            revent = &g_array_index(events, RenderEvent, part->event_index);
+
+            if(revent->event.channel % part->count != part->index)
+            {
+                continue;       /* event of another part */
+            }
+
+            evframe = (guint64)revent->time * (guint64)part->rate / 1000;
 
-    rt_count = wavetbl->rt_count;
+            /* event after the current position? Render up to it. */
+            if(evframe > part->frames + done)
+            {
+                count = MIN(count, evframe - (part->frames + done));
+                break;
+            }
+
+            synth_midi_event(part->synth, &revent->event);
+        }
+
+        fluid_synth_write_float(part->synth, count, part->buf, done * 2, 2,
+                                part->buf, done * 2 + 1, 2);
+        done += count;
+    }
+}
 
-    if(!wavetbl->rt_cache || rt_count == 0)
+/* render pool thread function for a render part block */
+static void
+render_part_func(gpointer data, gpointer user_data)
+{
+    RenderPart *part = data;
+
+    render_part_block(part);
+
+    g_mutex_lock(part->sync->mutex);
+
+    if(--part->sync->pending == 0)
     {
-        return;
+        g_cond_signal(part->sync->cond);
     }
 
-    count = ipatch_sf2_voice_cache_update
-            (wavetbl->rt_cache, wavetbl->rt_sel_values, (GObject *)(wavetbl->active_item),
-             (GObject *)item, pspec, value, updates, MAX_REALTIME_UPDATES);
+    g_mutex_unlock(part->sync->mutex);
+}
 
-    /* loop over updates and apply to FluidSynth voices */
-    for(i = 0; i < count; i++)
+#if FLUID_VERSION_ATLEAST(2,2,0)
+/* MIDI file player callback of parallel render parts, channel messages of
+ * other parts are skipped */
+static int
+render_part_playback(void *data, fluid_midi_event_t *event)
+{
+    RenderPart *part = data;
+    int type = fluid_midi_event_get_type(event);
+
+    if(type >= 0x80 && type < 0xf0
+            && fluid_midi_event_get_channel(event) % part->count != part->index)
     {
-        upd = &updates[i];
+        return (FLUID_OK);
+    }
+
+    return (fluid_synth_handle_midi_event(part->synth, event));
+}
+#endif
+
+/* Get the patches to render with, the render "patches" or the patches loaded
+ * in the wavetbl synth.
+ * Returns: List of IpatchBase patches (caller owns references)
+ */
+static GSList *
+render_get_patches(WavetblFluidSynthRender *render)
+{
+    GSList *patches = NULL;
+    GList *p;
+
+    if(render->patches)
+    {
+        for(p = render->patches->items; p; p = p->next)
+        {
+            if(IPATCH_IS_BASE(p->data))
+            {
+                patches = g_slist_prepend(patches, g_object_ref(p->data));
+            }
+        }
 
-        if(upd->voice < rt_count)
-            fluid_voice_gen_set(wavetbl->rt_voices[upd->voice], upd->genid,
-                                upd->ival);
+        return (g_slist_reverse(patches));
     }
 
-    /* update parameters (do separately so things are "more" atomic) */
-    for(i = 0; i < count; i++)
+    return (wavetbl_get_patches(render->wavetbl));
+}
+
+/* Get the patches loaded in the wavetbl synth, in load order.
+ * Returns: List of IpatchBase patches (caller owns references)
+ */
+static GSList *
+wavetbl_get_patches(WavetblFluidSynth *wavetbl)
+{
+    sfloader_sfont_data_t *sfont_data;
+    fluid_sfont_t *sfont;
+    GSList *patches = NULL;
+    int i, count;
+
+    SWAMI_LOCK_READ(wavetbl);
+
+    if(wavetbl->synth)
     {
-        upd = &updates[i];
+        count = fluid_synth_sfcount(wavetbl->synth);
+
+        /* index 0 is the most recently loaded font, prepend to keep the
+         * load order, skip the dummy font */
+        for(i = 0; i < count; i++)
+        {
+            sfont = fluid_synth_get_sfont(wavetbl->synth, i);
+            sfont_data = (sfloader_sfont_data_t *)fluid_sfont_get_data(sfont);
+
+            if(sfont_data && sfont_data->base_item)
+            {
+                patches = g_slist_prepend(patches,
+                                          g_object_ref(sfont_data->base_item));
+            }
+        }
+    }
+
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    return (patches);
+}
+
+/* bag for render_settings_copy() */
+typedef struct
+{
+    fluid_settings_t *src;
+    fluid_settings_t *dest;
+} SettingsCopyBag;
+
+/* Create FluidSynth settings for a render synth with a copy of the wavetbl
+ * settings.  sample_rate is the synth sample rate or 0 to keep wavetbl's. */
+static fluid_settings_t *
+render_settings_new(WavetblFluidSynth *wavetbl, int sample_rate)
+{
+    SettingsCopyBag bag;
+
+    bag.dest = new_fluid_settings();
+    bag.src = wavetbl->settings;
+
+    SWAMI_LOCK_READ(wavetbl);
+    fluid_settings_foreach(wavetbl->settings, &bag, render_settings_copy);
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    if(sample_rate > 0)
+    {
+        fluid_settings_setnum(bag.dest, "synth.sample-rate", sample_rate);
+    }
+
+    return (bag.dest);
+}
+
+/* fluid_settings_foreach() callback to copy a setting */
+static void
+render_settings_copy(void *data, const char *name, int type)
+{
+    SettingsCopyBag *bag = data;
+    char s[256];
+    double d;
+    int i;
+
+    switch(type)
+    {
+    case FLUID_NUM_TYPE:
+        if(fluid_settings_getnum(bag->src, name, &d) == FLUID_OK)
+        {
+            fluid_settings_setnum(bag->dest, name, d);
+        }
+
+        break;
+
+    case FLUID_INT_TYPE:
+        if(fluid_settings_getint(bag->src, name, &i) == FLUID_OK)
+        {
+            fluid_settings_setint(bag->dest, name, i);
+        }
+
+        break;
 
-        if(upd->voice < rt_count)
+    case FLUID_STR_TYPE:
+        if(fluid_settings_copystr(bag->src, name, s, sizeof(s)) == FLUID_OK)
         {
-            fluid_voice_update_param(wavetbl->rt_voices[upd->voice], upd->genid);
+            fluid_settings_setstr(bag->dest, name, s);
         }
+
+        break;
+    }
+}
+
+/* Create a FluidSynth instance like wavetbl_fluidsynth_open() does, but
+ * without drivers, with the patches loaded via our sfloader.
+ * MT-NOTE: wavetbl fields are accessed with the wavetbl lock.
+ */
+static fluid_synth_t *
+render_synth_new(WavetblFluidSynth *wavetbl, fluid_settings_t *settings,
+                 GSList *patches)
+{
+    fluid_synth_t *synth;
+    fluid_sfloader_t *loader;
+    char s[32];			/* enough space to store printf "&%p" */
+    GSList *p;
+    int i;
+
+    synth = new_fluid_synth(settings);
+
+    if(!synth)
+    {
+        return (NULL);
+    }
+
+    loader = new_fluid_sfloader(sfloader_load_sfont, delete_fluid_sfloader);
+
+    if(!loader)
+    {
+        delete_fluid_synth(synth);
+        return (NULL);
+    }
+
+    fluid_sfloader_set_data(loader, wavetbl);
+    fluid_synth_add_sfloader(synth, loader);
+
+    /* Load dummy SoundFont to make active items work - sfloader_load_sfont */
+    fluid_synth_sfload(synth, "!", FALSE);
+
+    for(p = patches; p; p = p->next)
+    {
+        g_snprintf(s, sizeof(s), "&%p", p->data);
+        fluid_synth_sfload(synth, s, FALSE);
+    }
+
+    SWAMI_LOCK_READ(wavetbl);
+
+    synth_set_reverb(synth, &wavetbl->reverb_params);
+    synth_set_chorus(synth, &wavetbl->chorus_params);
+    fluid_synth_set_interp_method(synth, -1, wavetbl->interp);
+
+    /* start with the wavetbl bank and program channel selections */
+    for(i = 0; i < wavetbl->channel_count; i++)
+    {
+        fluid_synth_bank_select(synth, i, wavetbl->banks[i]);
+        fluid_synth_program_change(synth, i, wavetbl->programs[i]);
+    }
+
+    SWAMI_UNLOCK_READ(wavetbl);
+
+    return (synth);
+}
+
+/* write rendered frames to the output file and update position */
+static gboolean
+render_write(WavetblFluidSynthRender *render, IpatchSampleHandle *handle,
+             const float *buf, guint count, guint64 *frames, double rate,
+             GError **err)
+{
+    if(!ipatch_sample_handle_write(handle, *frames, count, buf, err))
+    {
+        return (FALSE);
+    }
+
+    *frames += count;
+    g_atomic_int_set(&render->position, (gint)(*frames * 1000 / rate));
+
+    return (TRUE);
+}
+
+/* GCompareFunc to sort render events by time and order added */
+static gint
+render_event_compare(gconstpointer a, gconstpointer b)
+{
+    const RenderEvent *aevent = a, *bevent = b;
+
+    if(aevent->time != bevent->time)
+    {
+        return (aevent->time < bevent->time ? -1 : 1);
     }
+
+    return (aevent->index < bevent->index ? -1 : 1);
 }
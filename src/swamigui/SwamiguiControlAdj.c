@@ -303,14 +303,14 @@ swamigui_control_adj_block_changes(SwamiguiControlAdj *ctrladj)
 {
     g_return_if_fail(SWAMIGUI_IS_CONTROL_ADJ(ctrladj));
 
-    SWAMI_LOCK_READ(ctrladj);
+    SWAMI_LOCK_WRITE(ctrladj);
 
     if(ctrladj->adj)
     {
         g_signal_handler_block(ctrladj->adj, ctrladj->value_change_id);
     }
 
-    SWAMI_UNLOCK_READ(ctrladj);
+    SWAMI_UNLOCK_WRITE(ctrladj);
 }
 
 /**
@@ -324,14 +324,14 @@ swamigui_control_adj_unblock_changes(SwamiguiControlAdj *ctrladj)
 {
     g_return_if_fail(SWAMIGUI_IS_CONTROL_ADJ(ctrladj));
 
-    SWAMI_LOCK_READ(ctrladj);
+    SWAMI_LOCK_WRITE(ctrladj);
 
     if(ctrladj->adj)
     {
         g_signal_handler_unblock(ctrladj->adj, ctrladj->value_change_id);
     }
 
-    SWAMI_UNLOCK_READ(ctrladj);
+    SWAMI_UNLOCK_WRITE(ctrladj);
 }
 
 /* adjustment value changed signal callback */
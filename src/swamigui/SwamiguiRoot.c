@@ -72,6 +72,9 @@ enum
 /* Default splash delay in milliseconds */
 #define SWAMIGUI_ROOT_DEFAULT_SPLASH_DELAY 5000
 
+/* Max microseconds of queued control events run per GUI update */
+#define SWAMIGUI_CTRL_QUEUE_RUN_BUDGET 10000
+
 #define SWAMIGUI_ROOT_DEFAULT_LOWER_KEYS  "z,s,x,d,c,v,g,b,h,n,j,m,comma,l,period,semicolon,slash"
 #define SWAMIGUI_ROOT_DEFAULT_UPPER_KEYS  "q,2,w,3,e,r,5,t,6,y,7,u,i,9,o,0,p,bracketleft,equal,bracketright"
 
@@ -838,6 +841,11 @@ swamigui_root_init(SwamiguiRoot *root)
     swami_control_queue_set_test_func(root->ctrl_queue,
                                       swamigui_queue_test_func);
 
+    /* limit time spent running queued events per GUI update, so an event
+     * flood can't starve redraws */
+    swami_control_queue_set_run_budget(root->ctrl_queue,
+                                       SWAMIGUI_CTRL_QUEUE_RUN_BUDGET);
+
     /* create queued patch item property changed listener */
     root->ctrl_prop = swami_control_func_new();  /* ++ ref new control */
     swami_control_func_assign_funcs(root->ctrl_prop, NULL /* get_func */,